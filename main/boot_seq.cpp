@@ -0,0 +1,142 @@
+//=========================================================================================================
+// boot_seq.cpp - Implements a dependency-aware boot sequencer
+//=========================================================================================================
+#include "esp_timer.h"
+#include "globals.h"
+
+
+//=========================================================================================================
+// now_ms() - Returns the number of milliseconds since power-up
+//=========================================================================================================
+static U32 now_ms() {return (U32)(esp_timer_get_time() / 1000);}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// launch_step() - Runs one init step, then deletes the task it was running in
+//=========================================================================================================
+static void launch_step(void* pvParameters)
+{
+    BootSeq.run_step((int)(intptr_t)pvParameters);
+    vTaskDelete(nullptr);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// add() - Registers an init step
+//
+// Passed: name        = The name of the step, as it should appear in the timeline
+//         function    = The routine that performs the step
+//         depends_on  = The bits (as returned by add()) of the steps that must finish before this one
+//         is_deferred = If true, run() doesn't wait for this step to finish
+//
+// Returns: The bit that represents this step, or 0 if there is no room for it
+//=========================================================================================================
+U32 CBootSeq::add(const char* name, void (*function)(), U32 depends_on, bool is_deferred)
+{
+    // If we're out of steps, refuse to add this one
+    if (m_step_count >= BOOT_MAX_STEPS)
+    {
+        printf("*** Too many boot steps, \"%s\" ignored!\n", name);
+        return 0;
+    }
+
+    // Fill in the description of this step
+    boot_step_t* p_step = m_step + m_step_count;
+    p_step->name        = name;
+    p_step->function    = function;
+    p_step->depends_on  = depends_on;
+    p_step->is_deferred = is_deferred;
+    p_step->start_ms    = 0;
+    p_step->end_ms      = 0;
+
+    // Hand the caller the bit for this step
+    return 1 << m_step_count++;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// run() - Starts every step in its own task and waits for the non-deferred ones to finish
+//=========================================================================================================
+void CBootSeq::run()
+{
+    U32 critical_bits = 0;
+
+    // Create the event group that steps use to signal completion
+    m_done_bits = xEventGroupCreate();
+
+    // Start each step in its own task.  Each will wait for its own dependencies
+    for (int i=0; i<m_step_count; ++i)
+    {
+        xTaskCreatePinnedToCore(launch_step, m_step[i].name, BOOT_STEP_STACK, (void*)(intptr_t)i, DEFAULT_TASK_PRI, NULL, TASK_CPU);
+        if (!m_step[i].is_deferred) critical_bits |= (1 << i);
+    }
+
+    // Wait for every step that isn't deferred to finish
+    xEventGroupWaitBits(m_done_bits, critical_bits, pdFALSE, pdTRUE, portMAX_DELAY);
+
+    // Tell the world that the critical part of booting is done
+    mark("READY");
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// run_step() - Waits for the dependencies of a step to finish, then runs it
+//=========================================================================================================
+void CBootSeq::run_step(int index)
+{
+    boot_step_t* p_step = m_step + index;
+
+    // Wait for every step that this one depends on
+    if (p_step->depends_on)
+    {
+        xEventGroupWaitBits(m_done_bits, p_step->depends_on, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+
+    // Run the step, and keep track of how long it took
+    p_step->start_ms = now_ms();
+    p_step->function();
+    p_step->end_ms = now_ms();
+
+    // Add this step to the boot timeline
+    printf("$$$>>>BOOT:%s %u %u\n", p_step->name, p_step->start_ms, p_step->end_ms);
+
+    // Tell anyone waiting on this step that it's done
+    xEventGroupSetBits(m_done_bits, 1 << index);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// mark() - Records a milestone in the boot timeline
+//=========================================================================================================
+void CBootSeq::mark(const char* name)
+{
+    static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    U32  time_ms = now_ms();
+    bool is_new  = true;
+
+    // Milestones can be recorded from any task, so claim the list while we update it
+    portENTER_CRITICAL(&mux);
+
+    // If we've already recorded this milestone, or there's no room for another one, don't record it
+    if (m_mark_count >= BOOT_MAX_MARKS) is_new = false;
+    for (int i=0; is_new && i<m_mark_count; ++i) if (strcmp(m_mark[i].name, name) == 0) is_new = false;
+
+    // Record the milestone
+    if (is_new)
+    {
+        m_mark[m_mark_count].name    = name;
+        m_mark[m_mark_count].time_ms = time_ms;
+        ++m_mark_count;
+    }
+
+    portEXIT_CRITICAL(&mux);
+
+    // And add it to the boot timeline
+    if (is_new) printf("$$$>>>BOOT:%s %u\n", name, time_ms);
+}
+//=========================================================================================================
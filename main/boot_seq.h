@@ -0,0 +1,90 @@
+//=========================================================================================================
+// boot_seq.h - Defines a dependency-aware boot sequencer
+//
+// Each init step is registered along with the set of steps it depends on.  run() starts every step
+// in its own task; a step waits until all of its dependencies have finished, so independent steps
+// run concurrently.  run() returns once every step that isn't marked "deferred" has finished, and
+// deferred steps carry on in the background.  Every step, and every milestone passed to mark(), is
+// printed on the serial port as a "$$$>>>BOOT:" line with its time since power-up.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+#include "freertos/event_groups.h"
+
+// The maximum number of init steps.  Each step is one bit in an event group
+#define BOOT_MAX_STEPS      16
+
+// The maximum number of milestones that are remembered
+#define BOOT_MAX_MARKS      8
+
+// The stack size of the task that runs each step
+#define BOOT_STEP_STACK     4096
+
+
+//=========================================================================================================
+// One of these describes each init step, and the time it started and finished
+//=========================================================================================================
+struct boot_step_t
+{
+    const char* name;
+    void        (*function)();
+    U32         depends_on;
+    bool        is_deferred;
+    U32         start_ms;
+    U32         end_ms;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// A milestone is a named point in the boot timeline that isn't an init step (i.e, "got an IP address")
+//=========================================================================================================
+struct boot_mark_t
+{
+    const char* name;
+    U32         time_ms;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CBootSeq - Singleton class, runs the boot sequence
+//=========================================================================================================
+class CBootSeq
+{
+public:
+
+    // Registers an init step.  Returns the bit that other steps use to depend on this one
+    U32     add(const char* name, void (*function)(), U32 depends_on = 0, bool is_deferred = false);
+
+    // Runs every step, and returns when every step that isn't deferred is complete
+    void    run();
+
+    // Records a milestone in the boot timeline.  Only the first occurence of each name is recorded
+    void    mark(const char* name);
+
+    // Access to the timeline
+    int                 step_count()        {return m_step_count;}
+    const boot_step_t*  step(int index)     {return m_step + index;}
+    int                 mark_count()        {return m_mark_count;}
+    const boot_mark_t*  get_mark(int index) {return m_mark + index;}
+
+public:
+
+    // This runs a single step in its own task.  It should not be called externally
+    void    run_step(int index);
+
+protected:
+
+    // The init steps
+    boot_step_t         m_step[BOOT_MAX_STEPS];
+    int                 m_step_count;
+
+    // The milestones
+    boot_mark_t         m_mark[BOOT_MAX_MARKS];
+    int                 m_mark_count;
+
+    // Each step sets its bit in here when it completes
+    EventGroupHandle_t  m_done_bits;
+};
+//=========================================================================================================
@@ -10,6 +10,7 @@
 #define TASK_CPU          1
 #define DEFAULT_TASK_PRI  5
 #define TASK_PRIO_TCP     6
+#define TASK_PRIO_I2C     7
 #define TASK_PRIO_FLASH   9  // This has to be higher priority than all other tasks
 
 #define USE_NTP 1
@@ -44,6 +45,9 @@
 #define NET_PW_RAW_LEN  64
 #define NET_PW_ENC_LEN (NET_PW_RAW_LEN * 2)
 
+// The number of Wi-Fi networks we can store credentials for.  Network 0 is the primary network
+#define NET_MAX_NETWORKS 4
+
 
 //=========================================================================================================
 // GPIO pin definitions
@@ -69,6 +73,19 @@ typedef  int64_t    S64;
 
 
 
+//=========================================================================================================
+// Credentials for one of the alternate Wi-Fi networks stored in nvsdata_t
+//=========================================================================================================
+struct net_cred_t
+{
+    uint8_t   ssid[32];
+    char      pw[NET_PW_RAW_LEN];
+    char      user[64];
+};
+//=========================================================================================================
+
+
+
 //=========================================================================================================
 // This is the structure that we're going to read and write to/from non-volatile storage
 //
@@ -84,7 +101,12 @@ struct nvsdata_t
     uint8_t   network_ssid[32];
     char      network_pw[NET_PW_ENC_LEN];
     char      network_user[64];
-    char      unused[788];
+    uint32_t  generation;
+    char      ntp_server[64];
+    net_cred_t alt_network[NET_MAX_NETWORKS - 1];
+    uint8_t   power_policy;
+    uint16_t  ap_timeout_min;
+    char      unused[236];
 };
 //=========================================================================================================
 
@@ -0,0 +1,21 @@
+//=========================================================================================================
+// crc32.h - Defines the 32-bit CRC engine
+//
+// For a one-shot CRC of a buffer, call crc32().  To compute a CRC over data that arrives in pieces:
+//
+//     uint32_t state = crc32_init();
+//     state = crc32_update(state, piece1, len1);
+//     state = crc32_update(state, piece2, len2);
+//     uint32_t crc = crc32_final(state);
+//=========================================================================================================
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Computes the CRC of a buffer in a single call
+uint32_t crc32(void *buf, size_t len);
+
+// Incremental interface
+uint32_t crc32_init();
+uint32_t crc32_update(uint32_t state, const void* buf, size_t len);
+uint32_t crc32_final(uint32_t state);
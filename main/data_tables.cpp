@@ -0,0 +1,280 @@
+//=========================================================================================================
+// data_tables.cpp - Implements read-only access to large data tables stored in a dedicated flash partition
+//=========================================================================================================
+#ifdef ESP_PLATFORM
+#include "globals.h"
+#else
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "data_tables.h"
+#include "crc32.h"
+#endif
+#include <stdarg.h>
+
+// Every valid image starts with this value ("DTBL")
+static const U32 IMAGE_MAGIC = 0x4C425444;
+
+
+//=========================================================================================================
+// report() - A printf-style function for our messages.  On the ESP32 they go to the console.  On a 
+//            host build they go to stderr, so that they don't get mixed in with a test's output
+//=========================================================================================================
+static void report(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+#ifdef ESP_PLATFORM
+    vprintf(fmt, args);
+#else
+    vfprintf(stderr, fmt, args);
+#endif
+    va_end(args);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// init() - Maps the table image into our address space and verifies it
+//
+// Returns: 'true' if a valid image is mapped
+//
+// Other tasks may look at the tables while this runs, so the image is only published, by setting
+// m_image, once it has been verified
+//=========================================================================================================
+bool CDataTables::init()
+{
+    const U8* p_image;
+    size_t    size;
+
+    // Until we know better, there is no image
+    m_image = nullptr;
+
+    // Map the image.  If there isn't one, we're done
+    if (!map(&p_image, &size)) return false;
+
+    // If the image is damaged, or isn't in a format we understand, throw it away.  Nobody else has
+    // seen it, so it's safe to unmap
+    if (!verify(p_image, size))
+    {
+        unmap(p_image, size);
+        return false;
+    }
+
+    // Fill in the handy pointers, and only then make the image visible to everyone else
+    m_header    = (const dtbl_header_t*)p_image;
+    m_directory = (const dtbl_entry_t*)(p_image + sizeof(dtbl_header_t));
+    m_map_size  = size;
+    __sync_synchronize();
+    m_image     = p_image;
+
+    // Tell the engineer what we found
+    report("Data tables: %i tables, version %u\n", m_header->count, m_header->data_version);
+    return true;
+}
+//=========================================================================================================
+
+
+#ifdef ESP_PLATFORM
+//=========================================================================================================
+// map() - Maps the entire "tables" partition into the data address space via the flash cache
+//
+// Passed: pp_image = Filled in with the address of the mapping
+//         p_size   = Filled in with the number of bytes mapped
+//=========================================================================================================
+bool CDataTables::map(const U8** pp_image, size_t* p_size)
+{
+    const void* ptr;
+
+    // Find the partition that holds our tables
+    const esp_partition_t* partition = esp_partition_find_first
+    (
+        ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, DTBL_PARTITION_LABEL
+    );
+
+    // If there is no such partition, there are no tables
+    if (partition == nullptr)
+    {
+        report("*** No \"%s\" partition found!\n", DTBL_PARTITION_LABEL);
+        return false;
+    }
+
+    // Map the whole partition.  The MMU maps in 64K pages, and partitions are aligned to match
+    esp_err_t status = esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &ptr, &m_map_handle);
+    if (status != ESP_OK)
+    {
+        report("*** esp_partition_mmap() failed!! (0x%X)\n", status);
+        return false;
+    }
+
+    // Tell the caller where the image lives and how big the mapping is
+    *pp_image = (const U8*)ptr;
+    *p_size   = partition->size;
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// unmap() - Releases the flash mapping
+//=========================================================================================================
+void CDataTables::unmap(const U8* p_image, size_t size)
+{
+    spi_flash_munmap(m_map_handle);
+}
+//=========================================================================================================
+
+#else
+
+//=========================================================================================================
+// map() - On a host build, maps the image from a file
+//
+// Passed: pp_image = Filled in with the address of the mapping
+//         p_size   = Filled in with the number of bytes mapped
+//=========================================================================================================
+bool CDataTables::map(const U8** pp_image, size_t* p_size)
+{
+    struct stat info;
+
+    // Open the file that holds the image
+    int fd = open(DTBL_HOST_FILE, O_RDONLY);
+    if (fd < 0)
+    {
+        report("*** Can't open \"%s\"\n", DTBL_HOST_FILE);
+        return false;
+    }
+
+    // Find out how big the file is, and map all of it
+    void* ptr = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        ptr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    // The mapping stays valid after the file is closed
+    close(fd);
+
+    // If the file couldn't be mapped, there are no tables
+    if (ptr == MAP_FAILED) return false;
+
+    // Tell the caller where the image lives and how big the mapping is
+    *pp_image = (const U8*)ptr;
+    *p_size   = info.st_size;
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// unmap() - Releases the file mapping
+//=========================================================================================================
+void CDataTables::unmap(const U8* p_image, size_t size)
+{
+    munmap((void*)p_image, size);
+}
+//=========================================================================================================
+#endif
+
+
+//=========================================================================================================
+// verify() - Checks that a mapped image is in a format we understand and is undamaged
+//
+// Passed: p_image  = The start of the mapping
+//         map_size = The number of bytes mapped
+//
+// Returns: 'true' if the image is good
+//=========================================================================================================
+bool CDataTables::verify(const U8* p_image, size_t map_size)
+{
+    // Get handy pointers to the header and the directory
+    const dtbl_header_t* p_header    = (const dtbl_header_t*)p_image;
+    const dtbl_entry_t*  p_directory = (const dtbl_entry_t*)(p_image + sizeof(dtbl_header_t));
+
+    // If there's no room for a header, or the image was never written, there are no tables
+    if (map_size < sizeof(dtbl_header_t) || p_header->magic != IMAGE_MAGIC)
+    {
+        report("*** No data table image found\n");
+        return false;
+    }
+
+    // If this image was built for a different version of this code, we can't use it
+    if (p_header->format_version != DTBL_FORMAT_VERSION)
+    {
+        report("*** Data table image is format %u, expected %u\n", p_header->format_version, DTBL_FORMAT_VERSION);
+        return false;
+    }
+
+    // Make sure the image and its directory both fit in the mapping
+    size_t directory_end = sizeof(dtbl_header_t) + p_header->count * sizeof(dtbl_entry_t);
+    if (p_header->length > map_size || directory_end > p_header->length)
+    {
+        report("*** Data table image has a bad length\n");
+        return false;
+    }
+
+    // Check the CRC of everything after the header
+    if (crc32((void*)p_directory, p_header->length - sizeof(dtbl_header_t)) != p_header->crc)
+    {
+        report("*** Data table image is corrupt\n");
+        return false;
+    }
+
+    // Check each table to make sure it lies within the image and is undamaged
+    for (int i=0; i<p_header->count; ++i)
+    {
+        const dtbl_entry_t* p_entry = p_directory + i;
+
+        // The name must be nul-terminated and the data must be inside the image
+        if (memchr(p_entry->name, 0, sizeof p_entry->name) == nullptr
+        ||  p_entry->offset < directory_end
+        ||  p_entry->offset > p_header->length
+        ||  p_entry->length > p_header->length - p_entry->offset)
+        {
+            report("*** Data table %i has a bad directory entry\n", i);
+            return false;
+        }
+
+        // And the data must match its CRC
+        if (crc32((void*)(p_image + p_entry->offset), p_entry->length) != p_entry->crc)
+        {
+            report("*** Data table \"%s\" is corrupt\n", p_entry->name);
+            return false;
+        }
+    }
+
+    // If we get here, the image is good
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// find() - Finds a table by name
+//
+// Passed: name     = The name of the table
+//         p_length = If not nullptr, filled in with the length of the table in bytes
+//
+// Returns: A pointer to the table data, or nullptr if there is no such table
+//
+// The returned pointer is valid for as long as the program runs
+//=========================================================================================================
+const void* CDataTables::find(const char* name, size_t* p_length)
+{
+    for (int i=0; i<count(); ++i)
+    {
+        const dtbl_entry_t* p_entry = m_directory + i;
+        if (strcmp(p_entry->name, name) == 0)
+        {
+            if (p_length) *p_length = p_entry->length;
+            return m_image + p_entry->offset;
+        }
+    }
+
+    // If we get here, there is no such table
+    if (p_length) *p_length = 0;
+    return nullptr;
+}
+//=========================================================================================================
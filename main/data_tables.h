@@ -0,0 +1,117 @@
+//=========================================================================================================
+// data_tables.h - Defines read-only access to large data tables stored in a dedicated flash partition
+//
+// The partition holds a single image: a header, a directory of named tables, then the table data.  The
+// whole image is memory-mapped through the flash cache at boot, so a table of any size can be read in
+// place, with no copy into RAM.  The image is rejected at map time if its format version is one we
+// don't understand, or if the CRC of the image or of any table is bad.
+//
+// On a host build (no ESP_PLATFORM), the image is mapped from a file instead of a partition.  The host
+// build needs only this header, crc32.h, and the standard/POSIX headers
+//=========================================================================================================
+#pragma once
+#ifdef ESP_PLATFORM
+#include "common.h"
+#include "esp_partition.h"
+#else
+#include <stdint.h>
+#include <stddef.h>
+typedef uint8_t     U8;
+typedef uint16_t    U16;
+typedef uint32_t    U32;
+#endif
+
+// This is the label of the partition in the partition table
+#define DTBL_PARTITION_LABEL "tables"
+
+// On a host build, this is the file that holds the image
+#define DTBL_HOST_FILE       "tables.bin"
+
+// This is the version of the image format that this code understands
+#define DTBL_FORMAT_VERSION  1
+
+// Table names are at most this many characters
+#define DTBL_MAX_NAME_LEN    15
+
+
+//=========================================================================================================
+// The image begins with one of these.  The CRC covers everything in the image after the header
+//=========================================================================================================
+struct dtbl_header_t
+{
+    U32     magic;
+    U16     format_version;
+    U16     count;
+    U32     data_version;
+    U32     length;
+    U32     crc;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// The header is followed by "count" of these.  The offset is from the start of the image
+//=========================================================================================================
+struct dtbl_entry_t
+{
+    char    name[DTBL_MAX_NAME_LEN + 1];
+    U32     offset;
+    U32     length;
+    U32     crc;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CDataTables - Singleton class, provides access to the tables in the mapped image
+//=========================================================================================================
+class CDataTables
+{
+public:
+
+    // Call this once at startup to map and verify the image.  Returns 'true' if the image is valid
+    bool                init();
+
+    // Returns a pointer to the named table (and optionally its length), or nullptr if there isn't one
+    const void*         find(const char* name, size_t* p_length = nullptr);
+
+    // Returns 'true' if a valid image is mapped
+    bool                is_available()  {return m_image != nullptr;}
+
+    // Returns the number of tables in the image
+    int                 count()         {return m_image ? m_header->count : 0;}
+
+    // Returns the directory entry for the specified table
+    const dtbl_entry_t* entry(int index) {return m_directory + index;}
+
+    // Returns the version number that the image was built with
+    U32                 data_version()  {return m_image ? m_header->data_version : 0;}
+
+protected:
+
+    // Maps the image into our address space, and reports where it is and how big the mapping is
+    bool                map(const U8** pp_image, size_t* p_size);
+
+    // Releases a mapping
+    void                unmap(const U8* p_image, size_t size);
+
+    // Checks the image header, directory, and CRCs of a mapped image
+    bool                verify(const U8* p_image, size_t map_size);
+
+    // The start of the mapped image, or nullptr if there isn't one.  This is only set once the image
+    // has been verified, and the pointers below are valid whenever it's set
+    const U8* volatile  m_image;
+
+    // The number of bytes that are mapped
+    size_t              m_map_size;
+
+    // Handy pointers into the image
+    const dtbl_header_t* m_header;
+    const dtbl_entry_t*  m_directory;
+
+#ifdef ESP_PLATFORM
+    // The handle that the flash mapping is released with
+    spi_flash_mmap_handle_t m_map_handle;
+#endif
+};
+//=========================================================================================================
@@ -0,0 +1,591 @@
+//=========================================================================================================
+// event_log.cpp - Implements an append-only ring log of event records in a dedicated flash partition
+//=========================================================================================================
+#include <stdlib.h>
+#include "globals.h"
+
+// Every valid sector header starts with this value ("ELOG")
+static const U32 SECTOR_MAGIC = 0x474F4C45;
+
+// An erased (never written) record header has this in the length field
+static const U16 ERASED_LENGTH = 0xFFFF;
+
+//=========================================================================================================
+// record_size() - Returns the number of bytes a record occupies in a sector, including padding
+//=========================================================================================================
+static int record_size(int payload_length)
+{
+    return (sizeof(evtlog_rec_t) + payload_length + 3) & ~3;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// record_crc() - Computes the CRC of a record.  The CRC covers the first 8 bytes of the header and
+//                the payload
+//=========================================================================================================
+static U32 record_crc(const evtlog_rec_t* p_rec, const void* payload)
+{
+    U32 state = crc32_init();
+    state = crc32_update(state, p_rec, offsetof(evtlog_rec_t, crc));
+    state = crc32_update(state, payload, p_rec->length);
+    return crc32_final(state);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// walk_sector() - Walks the records in a sector image, calling the callback for each intact one
+//
+// Returns: The offset of the first byte after the last intact record.  *p_is_clean is set to 'true'
+//          if the walk ended at erased flash, and 'false' if it ended at a damaged record.  If
+//          p_count is not nullptr, the number of intact records is added to *p_count
+//=========================================================================================================
+static int walk_sector(const U8* data, bool* p_is_clean, int* p_count,
+                       void (*callback)(const evtlog_rec_t*, const U8*, void*), void* context)
+{
+    // The records start right after the sector header
+    int offset = sizeof(evtlog_sector_t);
+
+    // Presume for the moment we'll reach the end of the data without finding damage
+    *p_is_clean = true;
+
+    while (offset + (int)sizeof(evtlog_rec_t) <= EVTLOG_SECTOR_SIZE)
+    {
+        // Get a handy pointer to this record and its payload
+        const evtlog_rec_t* p_rec = (const evtlog_rec_t*)(data + offset);
+        const U8* payload = data + offset + sizeof(evtlog_rec_t);
+
+        // If we've hit erased flash, we've found the end of the data
+        if (p_rec->length == ERASED_LENGTH) break;
+
+        // If this record is malformed or its CRC is bad, it was torn by a power failure
+        if (p_rec->length > EVTLOG_MAX_PAYLOAD
+        ||  offset + record_size(p_rec->length) > EVTLOG_SECTOR_SIZE
+        ||  record_crc(p_rec, payload) != p_rec->crc)
+        {
+            *p_is_clean = false;
+            break;
+        }
+
+        // Hand this record to the caller
+        if (callback) callback(p_rec, payload, context);
+        if (p_count) ++*p_count;
+
+        // And point to the next record
+        offset += record_size(p_rec->length);
+    }
+
+    return offset;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// launch_task() - Just calls the task() method of our EventLog object
+//=========================================================================================================
+static void launch_task(void *pvParameters) {EventLog.task();}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// init() - Finds our flash partition, recovers the state of the log, and starts the writer task
+//
+// Returns: 'true' if the partition exists
+//=========================================================================================================
+bool CEventLog::init()
+{
+    // Find the partition that holds our log
+    const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, EVTLOG_PARTITION_LABEL);
+
+    // If there is no such partition, there is no event log
+    if (partition == nullptr)
+    {
+        printf("*** No \"%s\" partition found!\n", EVTLOG_PARTITION_LABEL);
+        return false;
+    }
+
+    // Find out how many sectors the log has room for
+    m_sector_count = partition->size / EVTLOG_SECTOR_SIZE;
+
+    // Create our mutexes and the semaphore that signals the end of a flush
+    m_mutex       = xSemaphoreCreateMutex();
+    m_flash_mutex = xSemaphoreCreateMutex();
+    m_flushed_sem = xSemaphoreCreateBinary();
+
+    // Reset our statistics
+    m_appended = m_dropped = m_sectors_written = 0;
+    m_is_erasing = false;
+    m_lane       = FLASH_LANE_BACKGROUND;
+
+    // We may be initialized while other tasks are already running.  Once m_partition is set they
+    // can call us, so hold the staging buffers until recovery is complete
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    m_partition = partition;
+
+    // Find the newest sector in the log and recover the records in it
+    recover();
+
+    // And launch the task that moves data from the staging buffers to flash
+    xTaskCreatePinnedToCore(::launch_task, "eventlog", 3072, nullptr, DEFAULT_TASK_PRI, &m_task_handle, TASK_CPU);
+
+    // Other tasks are now free to use the log
+    xSemaphoreGive(m_mutex);
+
+    // Tell the caller that all is well
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// read_sector_header() - Reads the header of a sector
+//
+// Returns: 'true' if the header is valid
+//=========================================================================================================
+bool CEventLog::read_sector_header(int sector, evtlog_sector_t* p_header)
+{
+    // Fetch the header from flash
+    if (esp_partition_read(m_partition, sector * EVTLOG_SECTOR_SIZE, p_header, sizeof *p_header) != ESP_OK) return false;
+
+    // The header is valid if the magic number and the CRC are correct
+    return p_header->magic == SECTOR_MAGIC && p_header->crc == crc32(p_header, offsetof(evtlog_sector_t, crc));
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// start_sector() - Initializes a staging buffer to hold the image of a brand new sector
+//=========================================================================================================
+void CEventLog::start_sector(staging_t* p_buffer, int sector, U32 sequence)
+{
+    evtlog_sector_t header;
+
+    // Build the sector header
+    header.magic    = SECTOR_MAGIC;
+    header.sequence = sequence;
+    header.crc      = crc32(&header, offsetof(evtlog_sector_t, crc));
+    header.reserved = 0xFFFFFFFF;
+
+    // The sector image looks like erased flash with a header at the front of it
+    memset(p_buffer->data, 0xFF, EVTLOG_SECTOR_SIZE);
+    memcpy(p_buffer->data, &header, sizeof header);
+
+    // Fill in the bookkeeping
+    p_buffer->sector   = sector;
+    p_buffer->sequence = sequence;
+    p_buffer->fill     = sizeof header;
+    p_buffer->flushed  = 0;
+    p_buffer->sealed   = false;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// reset_buffers() - Marks every staging buffer as idle and makes the first one active
+//=========================================================================================================
+void CEventLog::reset_buffers()
+{
+    for (int i=0; i<EVTLOG_STAGING_COUNT; ++i)
+    {
+        m_buffer[i].fill = m_buffer[i].flushed = 0;
+        m_buffer[i].sealed = false;
+    }
+    m_active = 0;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// recover() - Finds the newest sector in the log and reloads it into the active staging buffer so
+//             that we can keep appending to it
+//=========================================================================================================
+void CEventLog::recover()
+{
+    evtlog_sector_t header;
+    bool is_clean;
+
+    int newest_sector   = -1;
+    U32 newest_sequence = 0;
+
+    // We don't know of any erased sectors yet
+    m_erased_count = 0;
+
+    // Producers will append to the first staging buffer
+    reset_buffers();
+    staging_t* p_buffer = m_buffer;
+
+    // Find the sector with the highest sequence number
+    for (int sector = 0; sector < m_sector_count; ++sector)
+    {
+        if (read_sector_header(sector, &header) && header.sequence > newest_sequence)
+        {
+            newest_sector   = sector;
+            newest_sequence = header.sequence;
+        }
+    }
+
+    // If the log is empty, start at the beginning of the partition
+    if (newest_sector < 0)
+    {
+        start_sector(p_buffer, 0, 1);
+        m_next_fresh = 0;
+        return;
+    }
+
+    // Read the newest sector into our staging buffer and find the end of the intact records
+    esp_partition_read(m_partition, newest_sector * EVTLOG_SECTOR_SIZE, p_buffer->data, EVTLOG_SECTOR_SIZE);
+    int end = walk_sector(p_buffer->data, &is_clean, nullptr, nullptr, nullptr);
+
+    // If the sector ended with a torn record, we can't write over it.  Start a new sector
+    if (!is_clean)
+    {
+        printf("Event log: damaged record in sector %i\n", newest_sector);
+        start_sector(p_buffer, (newest_sector + 1) % m_sector_count, newest_sequence + 1);
+        m_next_fresh = p_buffer->sector;
+        return;
+    }
+
+    // Otherwise, we'll keep appending to the newest sector.  It's already been written to, so the
+    // first sector to get a fresh write will be the one after it
+    m_next_fresh = (newest_sector + 1) % m_sector_count;
+    p_buffer->sector   = newest_sector;
+    p_buffer->sequence = newest_sequence;
+    p_buffer->fill     = end;
+    p_buffer->flushed  = end;
+    p_buffer->sealed   = false;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// append() - Appends a record to the log
+//
+// This copies the record into RAM and returns.  If every staging buffer is full because flash can't
+// keep up, or the log is being erased, the record is dropped rather than making the caller wait.
+//
+// Passed: type   = An arbitrary record type, for the use of the caller
+//         data   = The record payload
+//         length = The length of the payload in bytes
+//
+// Returns: 'true' if the record was accepted, 'false' if it was dropped
+//=========================================================================================================
+bool CEventLog::append(U16 type, const void* data, size_t length)
+{
+    evtlog_rec_t rec;
+
+    // If there's no log partition, or the record is too big, we can't log it
+    if (m_partition == nullptr || length > EVTLOG_MAX_PAYLOAD) return false;
+
+    // Find out how much room this record will take
+    int size = record_size(length);
+
+    // Build the record header
+    rec.length    = length;
+    rec.type      = type;
+    rec.timestamp = (U32)(esp_timer_get_time() / 1000);
+    rec.crc       = record_crc(&rec, data);
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // If the log is being erased, there's nowhere to put this record
+    if (m_is_erasing)
+    {
+        ++m_dropped;
+        xSemaphoreGive(m_mutex);
+        return false;
+    }
+
+    // Get a handy pointer to the staging buffer we're filling
+    staging_t* p_buffer = m_buffer + m_active;
+
+    // If this record won't fit in the current sector, switch to the next staging buffer
+    if (p_buffer->fill + size > EVTLOG_SECTOR_SIZE)
+    {
+        int next = (m_active + 1) % EVTLOG_STAGING_COUNT;
+        staging_t* p_next = m_buffer + next;
+
+        // If the writer hasn't finished writing the next buffer yet, every buffer is full and we
+        // have to drop this record
+        if (p_next->sealed)
+        {
+            ++m_dropped;
+            xSemaphoreGive(m_mutex);
+            return false;
+        }
+
+        // The current buffer is full and ready to be written
+        p_buffer->sealed = true;
+
+        // The next buffer will hold the next sector
+        start_sector(p_next, (p_buffer->sector + 1) % m_sector_count, p_buffer->sequence + 1);
+        m_active = next;
+        p_buffer = p_next;
+
+        // Wake up the writer
+        xTaskNotifyGive(m_task_handle);
+    }
+
+    // Copy the record into the staging buffer
+    U8* p = p_buffer->data + p_buffer->fill;
+    memcpy(p, &rec, sizeof rec);
+    memcpy(p + sizeof rec, data, length);
+    p_buffer->fill += size;
+
+    // Keep track of how many records have been logged
+    ++m_appended;
+
+    xSemaphoreGive(m_mutex);
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// write_buffer() - Writes the unwritten portion of a staging buffer to flash
+//
+// Passed: p_buffer    = The staging buffer to write
+//         sealed_only = If true, the buffer is only written if it's full and waiting to be written
+//=========================================================================================================
+void CEventLog::write_buffer(staging_t* p_buffer, bool sealed_only)
+{
+    xSemaphoreTake(m_flash_mutex, portMAX_DELAY);
+
+    // Find out what portion of the buffer hasn't been written yet
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    int  start     = p_buffer->flushed;
+    int  end       = p_buffer->fill;
+    int  sector    = p_buffer->sector;
+    bool is_wanted = p_buffer->sealed || !sealed_only;
+    xSemaphoreGive(m_mutex);
+
+    // If there's nothing to write, we're done
+    if (!is_wanted || end <= start)
+    {
+        xSemaphoreGive(m_flash_mutex);
+        return;
+    }
+
+    // This is the address of the sector within the partition
+    int address = sector * EVTLOG_SECTOR_SIZE;
+
+    // If this is the first write to this sector, it has to be erased first, unless erase_ahead() 
+    // has already done it
+    bool erase_first = false;
+    if (start == 0)
+    {
+        if (m_erased_count > 0 && sector == m_next_fresh)
+            --m_erased_count;
+        else
+        {
+            erase_first    = true;
+            m_erased_count = 0;
+        }
+        m_next_fresh = (sector + 1) % m_sector_count;
+    }
+
+    // Write the new data, normally in the background lane.  Producers only ever append beyond "end",
+    // so this region is stable
+    FlashIO.write_partition(m_partition, address + start, p_buffer->data + start, end - start, erase_first, m_lane);
+
+    // Record how much of this buffer is now in flash.  If it's full and completely written, it's free
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    p_buffer->flushed = end;
+    if (p_buffer->sealed && p_buffer->flushed == p_buffer->fill)
+    {
+        p_buffer->sealed = false;
+        ++m_sectors_written;
+    }
+    xSemaphoreGive(m_mutex);
+
+    xSemaphoreGive(m_flash_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// erase_ahead() - Erases sectors ahead of the head of the log, so that starting a new sector doesn't
+//                 have to wait on an erase
+//
+// When the run of erased sectors gets short, we erase up to the next block boundary.  After the first
+// time, that's always an entire block, which flash erases much faster than 16 separate sectors
+//=========================================================================================================
+void CEventLog::erase_ahead()
+{
+    xSemaphoreTake(m_flash_mutex, portMAX_DELAY);
+
+    // If there are plenty of erased sectors ahead of us, there's nothing to do
+    if (m_erased_count >= EVTLOG_ERASE_LOW)
+    {
+        xSemaphoreGive(m_flash_mutex);
+        return;
+    }
+
+    // Erase from the end of the run up to the next block boundary (or the end of the partition)
+    int start = (m_next_fresh + m_erased_count) % m_sector_count;
+    int count = EVTLOG_BLOCK_SECTORS - (start % EVTLOG_BLOCK_SECTORS);
+    if (count > m_sector_count - start) count = m_sector_count - start;
+
+    // Never let the run wrap around onto the sector we're appending to
+    if (count > m_sector_count - 1 - m_erased_count) count = m_sector_count - 1 - m_erased_count;
+
+    if (count > 0 && FlashIO.erase_partition(m_partition, start * EVTLOG_SECTOR_SIZE, count * EVTLOG_SECTOR_SIZE))
+        m_erased_count += count;
+
+    xSemaphoreGive(m_flash_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// task() - Moves data from the staging buffers to flash
+//
+// This wakes up whenever a staging buffer fills, and at least every EVTLOG_FLUSH_MS milliseconds
+//=========================================================================================================
+void CEventLog::task()
+{
+    while (true)
+    {
+        // Wait until a buffer fills or it's time for a periodic flush
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(EVTLOG_FLUSH_MS));
+
+        // Write the sealed buffers oldest first, then the one being filled.  Sectors are always
+        // written for the first time in ring order
+        int active = m_active;
+        for (int i=1; i<EVTLOG_STAGING_COUNT; ++i)
+        {
+            write_buffer(m_buffer + (active + i) % EVTLOG_STAGING_COUNT, true);
+        }
+        write_buffer(m_buffer + active, false);
+
+        // Tell anyone waiting in flush() that we've made a pass
+        xSemaphoreGive(m_flushed_sem);
+
+        // Keep the sectors ahead of us erased
+        erase_ahead();
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// flush() - Waits for everything that has been appended so far to be written to flash
+//
+// Passed: lane = The FlashIO lane to write in.  System.reboot() uses FLASH_LANE_URGENT, so that the 
+//                last records make it to flash without waiting on background erases
+//=========================================================================================================
+void CEventLog::flush(flash_lane_t lane)
+{
+    if (m_partition == nullptr) return;
+
+    // Have the writer use the lane we were asked for until we're done
+    m_lane = lane;
+
+    // A few passes of the writer are always enough
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        // Find out if everything has been written
+        xSemaphoreTake(m_mutex, portMAX_DELAY);
+        staging_t* p_active = m_buffer + m_active;
+        bool is_done = p_active->flushed == p_active->fill;
+        for (int i=0; i<EVTLOG_STAGING_COUNT; ++i) if (m_buffer[i].sealed) is_done = false;
+        xSemaphoreGive(m_mutex);
+        if (is_done) break;
+
+        // Wake up the writer and wait for it to make a pass
+        xSemaphoreTake(m_flushed_sem, 0);
+        xTaskNotifyGive(m_task_handle);
+        xSemaphoreTake(m_flushed_sem, pdMS_TO_TICKS(EVTLOG_FLUSH_MS * 2));
+    }
+
+    // The writer goes back to the background lane
+    m_lane = FLASH_LANE_BACKGROUND;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// erase() - Erases the entire log
+//
+// Erasing the partition takes seconds, so we don't hold the staging buffers while it happens.  Records 
+// appended in the meantime are dropped
+//=========================================================================================================
+void CEventLog::erase()
+{
+    if (m_partition == nullptr) return;
+
+    // Keep the writer away from flash until we're done
+    xSemaphoreTake(m_flash_mutex, portMAX_DELAY);
+
+    // Throw away everything that's staged, and turn away new records until the erase is done
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    m_is_erasing = true;
+    reset_buffers();
+    start_sector(m_buffer, 0, 1);
+    xSemaphoreGive(m_mutex);
+
+    // Erase the entire partition
+    FlashIO.erase_partition(m_partition, 0, m_sector_count * EVTLOG_SECTOR_SIZE);
+
+    // The log starts over at the beginning of the partition, and every sector is erased
+    m_next_fresh   = 0;
+    m_erased_count = m_sector_count;
+
+    // Producers can append again
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    m_is_erasing = false;
+    xSemaphoreGive(m_mutex);
+
+    xSemaphoreGive(m_flash_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// for_each() - Calls the callback for every intact record in the log, oldest first
+//
+// Returns: The number of records found
+//=========================================================================================================
+int CEventLog::for_each(void (*callback)(const evtlog_rec_t*, const U8*, void*), void* context)
+{
+    evtlog_sector_t header;
+    bool is_clean;
+    int  count = 0;
+
+    if (m_partition == nullptr) return 0;
+
+    // Make sure everything that's been appended is in flash
+    flush();
+
+    // We need a buffer to hold the image of a sector
+    U8* data = (U8*)malloc(EVTLOG_SECTOR_SIZE);
+    if (data == nullptr) return 0;
+
+    // Find out which sector is the newest
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    int head_sector   = m_buffer[m_active].sector;
+    U32 head_sequence = m_buffer[m_active].sequence;
+    xSemaphoreGive(m_mutex);
+
+    // The ring is in sequence order, so the sector after the newest one is the oldest
+    for (int i = 1; i <= m_sector_count; ++i)
+    {
+        int sector = (head_sector + i) % m_sector_count;
+
+        // Read this sector into RAM
+        xSemaphoreTake(m_flash_mutex, portMAX_DELAY);
+        bool is_valid = read_sector_header(sector, &header);
+        if (is_valid) esp_partition_read(m_partition, sector * EVTLOG_SECTOR_SIZE, data, EVTLOG_SECTOR_SIZE);
+        xSemaphoreGive(m_flash_mutex);
+
+        // Skip sectors that are erased or that belong to an earlier pass through the log
+        if (!is_valid || header.sequence > head_sequence) continue;
+
+        // Hand each intact record in this sector to the caller
+        walk_sector(data, &is_clean, &count, callback, context);
+    }
+
+    free(data);
+    return count;
+}
+//=========================================================================================================
@@ -0,0 +1,184 @@
+//=========================================================================================================
+// event_log.h - Defines an append-only ring log of event records in a dedicated flash partition
+//
+// The partition is treated as a ring of 4K sectors.  Each sector starts with a header that carries a
+// sequence number, and is followed by packed records, each with its own CRC.  Producers append
+// records into a ring of RAM staging buffers and never wait on flash; a background task writes the
+// staged data to flash and keeps a run of sectors ahead of the head erased, a 64K block at a time, so
+// that writing a full sector never waits on an erase.  After a power failure, the newest sector is found
+// by sequence number and the records in it are recovered up to the first one with a bad CRC.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+#include "esp_partition.h"
+#include "flash_io.h"
+
+// This is the label of the partition in the partition table
+#define EVTLOG_PARTITION_LABEL "eventlog"
+
+// Flash is erased in units of this many bytes
+#define EVTLOG_SECTOR_SIZE     4096
+
+// Erasing a whole block at once is several times faster than erasing its sectors one by one.  The
+// partition must be aligned to a block boundary for this to help
+#define EVTLOG_BLOCK_SIZE      65536
+#define EVTLOG_BLOCK_SECTORS   (EVTLOG_BLOCK_SIZE / EVTLOG_SECTOR_SIZE)
+
+// When fewer than this many sectors ahead of the head are erased, the writer erases up to the next
+// block boundary
+#define EVTLOG_ERASE_LOW       8
+
+// The number of sector-sized staging buffers.  These absorb bursts while the writer is busy erasing
+#define EVTLOG_STAGING_COUNT   8
+
+// The largest record payload we accept
+#define EVTLOG_MAX_PAYLOAD     1024
+
+// The staging buffer is flushed to flash at least this often
+#define EVTLOG_FLUSH_MS        1000
+
+// The record types that the firmware itself logs.  The payload of a reboot record is one byte, 
+// which is non-zero if we're rebooting into AP mode
+#define EVTLOG_TYPE_TEXT       0
+#define EVTLOG_TYPE_REBOOT     1
+
+
+//=========================================================================================================
+// Every sector begins with one of these
+//=========================================================================================================
+struct evtlog_sector_t
+{
+    U32     magic;
+    U32     sequence;
+    U32     crc;
+    U32     reserved;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// Every record begins with one of these.  The CRC covers the first 8 bytes of the header plus the
+// payload.  Records are padded to a 4-byte boundary.
+//=========================================================================================================
+struct evtlog_rec_t
+{
+    U16     length;
+    U16     type;
+    U32     timestamp;
+    U32     crc;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CEventLog - Singleton class, manages the ring log
+//=========================================================================================================
+class CEventLog
+{
+public:
+
+    // Call this once at startup to find the partition, recover the log and start the writer task
+    bool    init();
+
+    // Appends a record to the log.  Never blocks on flash.  Returns 'false' if the record was dropped
+    bool    append(U16 type, const void* data, size_t length);
+
+    // Forces everything that's been appended so far to be written to flash.  Pass FLASH_LANE_URGENT
+    // for a last-gasp flush that mustn't wait behind other background flash work
+    void    flush(flash_lane_t lane = FLASH_LANE_BACKGROUND);
+
+    // Erases the entire log
+    void    erase();
+
+    // Calls the callback for every intact record in the log, oldest first.  Returns the record count
+    int     for_each(void (*callback)(const evtlog_rec_t*, const U8* payload, void* context), void* context);
+
+    // Returns 'true' if the log partition was found
+    bool    is_available() {return m_partition != nullptr;}
+
+    // Statistics
+    U32     records_appended()   {return m_appended;}
+    U32     records_dropped()    {return m_dropped;}
+    U32     sectors_written()    {return m_sectors_written;}
+    int     sector_count()       {return m_sector_count;}
+    U32     head_sequence()      {return m_buffer[m_active].sequence;}
+    int     sectors_erased()     {return m_erased_count;}
+
+public:
+
+    // This is the task that writes staged data to flash.  It should not be called externally
+    void    task();
+
+protected:
+
+    // One of these holds the RAM image of the sector currently being filled or written
+    struct staging_t
+    {
+        U8      data[EVTLOG_SECTOR_SIZE];
+        int     sector;      // The sector in the partition this data belongs to
+        U32     sequence;    // The sequence number of that sector
+        int     fill;        // The number of bytes in "data" that are in use
+        int     flushed;     // The number of bytes in "data" that have been written to flash
+        bool    sealed;      // True if this buffer is full and waiting to be written
+    };
+
+    // Initializes a staging buffer for a new sector
+    void    start_sector(staging_t* p_buffer, int sector, U32 sequence);
+
+    // Writes whatever is unwritten in a staging buffer to flash.  If "sealed_only" is true, the buffer
+    // is only written if it's full
+    void    write_buffer(staging_t* p_buffer, bool sealed_only);
+
+    // Erases sectors ahead of the head if the run of erased sectors is getting short
+    void    erase_ahead();
+
+    // Marks every staging buffer as idle
+    void    reset_buffers();
+
+    // Reads the header of a sector and returns 'true' if it's valid
+    bool    read_sector_header(int sector, evtlog_sector_t* p_header);
+
+    // Looks for the newest sector in the log and recovers the records in it
+    void    recover();
+
+    // The partition we store the log in
+    const esp_partition_t*  m_partition;
+
+    // The number of sectors in the partition
+    int                     m_sector_count;
+
+    // A ring of staging buffers.  Producers fill m_buffer[m_active], and the ones after it are either
+    // idle or sealed and waiting for the writer
+    staging_t               m_buffer[EVTLOG_STAGING_COUNT];
+    int                     m_active;
+
+    // The next sector that will be written for the first time, and the number of sectors starting
+    // there that we know are erased
+    int                     m_next_fresh;
+    int                     m_erased_count;
+
+    // True while the entire log is being erased.  Records appended in the meantime are dropped
+    volatile bool           m_is_erasing;
+
+    // The FlashIO lane that the writer writes staged data in
+    volatile flash_lane_t   m_lane;
+
+    // Protects the staging buffers
+    SemaphoreHandle_t       m_mutex;
+
+    // Held by whoever is reading, writing or erasing the partition.  Anyone who needs both mutexes
+    // takes this one first
+    SemaphoreHandle_t       m_flash_mutex;
+
+    // The writer gives this every time it finishes a pass over the staging buffers
+    SemaphoreHandle_t       m_flushed_sem;
+
+    // The handle of the writer task
+    TaskHandle_t            m_task_handle;
+
+    // Statistics
+    U32     m_appended;
+    U32     m_dropped;
+    U32     m_sectors_written;
+};
+//=========================================================================================================
@@ -2,13 +2,15 @@
 // flash_io.cpp - Implements a task that manages reads/write to and from flash memory 
 //=========================================================================================================
 #include <nvs_flash.h>
+#include <esp_timer.h>
 #include "globals.h"
 
 #define FLASH_READ  0
 #define FLASH_WRITE 1
-
-// This is the namespace that NVS stores our data structure under
-static const char* NAMESPACE = "storage";
+#define FLASH_ERASE 2
+#define FLASH_LIST  3
+#define FLASH_PART_WRITE 4
+#define FLASH_PART_ERASE 5
 
 //=========================================================================================================
 // launch_task() - Just calles the task() method of our FlashIO object
@@ -20,21 +22,50 @@ static void launch_task(void *pvParameters) {FlashIO.task();}
 //=========================================================================================================
 // write_flash() - Writes a blob of data to a named region of flash memory
 //=========================================================================================================
-static void write_flash(const char* nvs_key, char* buffer, size_t length)
+static esp_err_t write_flash(const char* nvs_namespace, const char* nvs_key, char* buffer, size_t length)
 {
     nvs_handle  handle;
 
     // Open a handle to non-volatile storage
-    nvs_open(NAMESPACE, NVS_READWRITE, &handle);
+    esp_err_t status = nvs_open(nvs_namespace, NVS_READWRITE, &handle);
+    if (status != ESP_OK) return status;
 
     // Write this chunk of memory to flash
-    nvs_set_blob(handle, nvs_key, buffer, length);
+    status = nvs_set_blob(handle, nvs_key, buffer, length);
 
     // Commit those flash changes (i.e., make them permanent)
-    nvs_commit(handle);
+    if (status == ESP_OK) status = nvs_commit(handle);
+
+    // We're done with NVS storage for the moment
+    nvs_close(handle);
+
+    // Tell the caller whether this worked
+    return status;
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// erase_flash() - Erases a named blob of data from flash memory
+//=========================================================================================================
+static esp_err_t erase_flash(const char* nvs_namespace, const char* nvs_key)
+{
+    nvs_handle  handle;
+
+    // Open a handle to non-volatile storage
+    esp_err_t status = nvs_open(nvs_namespace, NVS_READWRITE, &handle);
+    if (status != ESP_OK) return status;
+
+    // Erase this key, and make the change permanent
+    status = nvs_erase_key(handle, nvs_key);
+    if (status == ESP_OK) status = nvs_commit(handle);
 
     // We're done with NVS storage for the moment
     nvs_close(handle);
+
+    // Tell the caller whether this worked
+    return status;
 }
 //=========================================================================================================
 
@@ -43,8 +74,14 @@ static void write_flash(const char* nvs_key, char* buffer, size_t length)
 
 //=========================================================================================================
 // read_flash() - Reads a blob of data from named region of flash memory
+//
+// Passed: nvs_namespace = The NVS namespace the blob lives in
+//         nvs_key       = The name of the blob
+//         buffer        = Where to store the data
+//         max_length    = The size of the buffer
+//         p_length      = On exit, contains the size of the blob (0 if it doesn't exist)
 //=========================================================================================================
-static void read_flash(const char* nvs_key, char* buffer)
+static esp_err_t read_flash(const char* nvs_namespace, const char* nvs_key, char* buffer, size_t max_length, size_t* p_length)
 {
     nvs_handle handle;
     size_t     blob_size = 0;
@@ -52,48 +89,110 @@ static void read_flash(const char* nvs_key, char* buffer)
 
     // As a convenience to callers that are expecting ASCII data to be read, fill in the start 
     // of their buffer with nul-bytes, just in case the requested nvs_key doesn't exist yet
-    *(U32*)buffer = 0;
+    memset(buffer, 0, max_length < 4 ? max_length : 4);
+
+    // Until we know better, the blob is empty
+    *p_length = 0;
 
     // Tell the engineer what we're up to
     printf("Reading flash memory key \"%s\"\n", nvs_key);
 
     // Open a handle to non-volatile storage
-    status = nvs_open(NAMESPACE, NVS_READWRITE, &handle);
-    if (status != ESP_OK) printf("*** nvs_open() failed!! 0x%X)\n", status);
+    status = nvs_open(nvs_namespace, NVS_READWRITE, &handle);
+    if (status != ESP_OK)
+    {
+        printf("*** nvs_open() failed!! 0x%X)\n", status);
+        return status;
+    }
 
     // Call this the first time to find out how big this data structure in flash is
-    nvs_get_blob(handle, nvs_key, buffer, &blob_size);
-    
+    status = nvs_get_blob(handle, nvs_key, nullptr, &blob_size);
+
+    // If the blob won't fit into the caller's buffer, don't read it
+    if (status == ESP_OK && blob_size > max_length) status = ESP_ERR_NVS_INVALID_LENGTH;
+
     // If there is data in flash available to read, go read it
-    if (blob_size > 0)
+    if (status == ESP_OK && blob_size > 0)
     {
         status = nvs_get_blob(handle, nvs_key, buffer, &blob_size);
         if (status != ESP_OK) printf("*** nvs_get_blob() failed!! (0x%X)\n", status);
     }
 
+    // Tell the caller how much data we read
+    if (status == ESP_OK) *p_length = blob_size;
+
     // We're done with NVS storage for the moment
     nvs_close(handle);
+
+    // Tell the caller whether this worked
+    return status;
 }
 //=========================================================================================================
 
 
 
 //=========================================================================================================
-// begin() - Creates the message queues and starts up the task thread
+// list_flash() - Calls a callback function for every blob in a namespace (or in all namespaces)
+//=========================================================================================================
+static esp_err_t list_flash(const char* nvs_namespace, flash_list_cb_t callback, void* context)
+{
+    nvs_entry_info_t info;
+    nvs_handle       handle;
+
+    // Find the first blob.  A nullptr means there isn't one
+    nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, nvs_namespace, NVS_TYPE_BLOB);
+
+    // Loop through every blob we find
+    while (it)
+    {
+        // Find out the namespace and key of this blob
+        nvs_entry_info(it, &info);
+
+        // The iterator doesn't tell us the size of the blob, so go find out
+        size_t length = 0;
+        if (nvs_open(info.namespace_name, NVS_READONLY, &handle) == ESP_OK)
+        {
+            nvs_get_blob(handle, info.key, nullptr, &length);
+            nvs_close(handle);
+        }
+
+        // Tell the caller about this blob
+        callback(info.namespace_name, info.key, length, context);
+
+        // And move on to the next one.  This releases the iterator when we hit the end
+        it = nvs_entry_next(it);
+    }
+
+    return ESP_OK;
+}
+//=========================================================================================================
+
+
+
+//=========================================================================================================
+// begin() - Creates the lane queues and the semaphore pool, and starts up the task thread
 //=========================================================================================================
 void CFlashIO::begin()
 {
-    // Other threads will write to this queue to start a read/write operation
-    m_start_qh = xQueueCreate(4, 1);
+    // Other threads will write request pointers to these queues to start an operation
+    for (int lane = 0; lane < FLASH_LANE_COUNT; ++lane)
+    {
+        m_lane_qh[lane] = xQueueCreate(FLASH_MAX_WAITERS, sizeof(flash_req_t*));
+    }
 
-    // Other threads will do a blocking read from this queue to know when that operation is done
-    m_done_qh = xQueueCreate(4, 1);
+    // Each waiting thread borrows a semaphore from this pool and blocks on it until its request is done
+    m_sem_pool_qh = xQueueCreate(FLASH_MAX_WAITERS, sizeof(SemaphoreHandle_t));
+    for (int i = 0; i < FLASH_MAX_WAITERS; ++i)
+    {
+        SemaphoreHandle_t sem = xSemaphoreCreateBinary();
+        xQueueSend(m_sem_pool_qh, &sem, 0);
+    }
 
-    // This mutex will ensure one-thread-at-a-time access to reading/writing flash memory
-    m_mutex = xSemaphoreCreateMutex();
+    // No requests have been serviced yet
+    memset(m_stats, 0, sizeof m_stats);
 
     // And finally, launch the task that will perform flash memory read/writes for us
-    xTaskCreatePinnedToCore(::launch_task, "flashio", 2048, nullptr, TASK_PRIO_FLASH, NULL, TASK_CPU);
+    xTaskCreatePinnedToCore(::launch_task, "flashio", 3072, nullptr, TASK_PRIO_FLASH, &m_task_handle, TASK_CPU);
 }
 //=========================================================================================================
 
@@ -106,80 +205,368 @@ void CFlashIO::begin()
 // flash reads/writes happen.  This is to ensure that no thread tries to read from SPRAM while a flash
 // write is taking place.  We do this to avoid the documented dangers of the SPRAM disappearing from the
 // memory map (during flash writes) because SPRAM and flash memory share cache.
+//
+// Urgent requests are always serviced before normal ones, and normal ones before background ones.  A
+// background request is carried out one sector at a time, and before each sector we go back and look
+// for urgent or normal work.  This bounds the latency of an urgent write to the time it takes to
+// erase and write a single sector, or to erase a single block when a background erase spans one.
 //=========================================================================================================
 void CFlashIO::task()
 {
-    char    cmd;
+    flash_req_t* p_req;
+    flash_req_t* p_background = nullptr;
 
-    // We're going to sit in a loop forever listening for commands
+    // We're going to sit in a loop forever listening for requests
     while (true)
     {
-        // Wait for a command to arrive
-        xQueueReceive(m_start_qh, &cmd, portMAX_DELAY);
+        // If there's an urgent or a normal request waiting, carry it out in its entirety
+        if (xQueueReceive(m_lane_qh[FLASH_LANE_URGENT], &p_req, 0) == pdTRUE
+        ||  xQueueReceive(m_lane_qh[FLASH_LANE_NORMAL], &p_req, 0) == pdTRUE)
+        {
+            while (!step(p_req));
+            complete(p_req);
+            continue;
+        }
+
+        // If we're not already working on a background request, see if there is one waiting
+        if (p_background == nullptr) xQueueReceive(m_lane_qh[FLASH_LANE_BACKGROUND], &p_background, 0);
+
+        // If there's a background request, carry out the next step of it
+        if (p_background)
+        {
+            if (step(p_background))
+            {
+                complete(p_background);
+                p_background = nullptr;
+            }
+            continue;
+        }
+
+        // There's nothing to do.  Wait for someone to queue up a request
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+//=========================================================================================================
 
-        // Perform the requested operation
-        if (cmd == FLASH_WRITE) write_flash(m_nvs_key, m_rw_buffer, m_rw_length);
-        if (cmd == FLASH_READ ) read_flash(m_nvs_key, m_rw_buffer);
 
-        // Tell the requesting task that the operation is complete
-        xQueueSend(m_done_qh, &cmd, portMAX_DELAY);
+//=========================================================================================================
+// step() - Carries out one step of a request
+//
+// NVS operations are always performed in a single step.  Raw partition writes are performed one sector
+// per step.  Raw erases are performed one block per step where they cover whole aligned blocks, and one
+// sector per step elsewhere.
+//
+// Returns: 'true' if the request is complete, otherwise 'false'
+//
+// On Exit: if the request is complete, p_req->status contains the result
+//=========================================================================================================
+bool CFlashIO::step(flash_req_t* p_req)
+{
+    size_t address, chunk;
+
+    switch (p_req->cmd)
+    {
+        case FLASH_WRITE:
+            p_req->status = write_flash(p_req->nvs_namespace, p_req->nvs_key, p_req->buffer, p_req->length);
+            return true;
+
+        case FLASH_READ:
+            p_req->status = read_flash(p_req->nvs_namespace, p_req->nvs_key, p_req->buffer, p_req->length, &p_req->length);
+            return true;
+
+        case FLASH_ERASE:
+            p_req->status = erase_flash(p_req->nvs_namespace, p_req->nvs_key);
+            return true;
+
+        case FLASH_LIST:
+            p_req->status = list_flash(p_req->nvs_namespace, p_req->list_cb, p_req->list_context);
+            return true;
+
+        case FLASH_PART_WRITE:
+
+            // Find out where in the partition this step starts, and how many bytes we can write
+            // without crossing into the next sector
+            address = p_req->offset + p_req->progress;
+            chunk   = FLASH_SECTOR_SIZE - (address % FLASH_SECTOR_SIZE);
+            if (chunk > p_req->length - p_req->progress) chunk = p_req->length - p_req->progress;
+
+            // If we've been asked to, erase the sector before we write to it
+            if (p_req->erase_first)
+            {
+                p_req->status = esp_partition_erase_range(p_req->partition, address - (address % FLASH_SECTOR_SIZE), FLASH_SECTOR_SIZE);
+                if (p_req->status != ESP_OK) return true;
+            }
+
+            // Write this chunk of the caller's data
+            p_req->status = esp_partition_write(p_req->partition, address, p_req->buffer + p_req->progress, chunk);
+            if (p_req->status != ESP_OK) return true;
+
+            // We're done when every byte has been written
+            p_req->progress += chunk;
+            return p_req->progress >= p_req->length;
+
+        case FLASH_PART_ERASE:
+
+            // If the rest of the region starts with an entire block, erase the block.  Otherwise, erase
+            // the next sector
+            address = p_req->partition->address + p_req->offset + p_req->progress;
+            chunk   = FLASH_SECTOR_SIZE;
+            if (address % FLASH_BLOCK_SIZE == 0 && p_req->length - p_req->progress >= FLASH_BLOCK_SIZE) chunk = FLASH_BLOCK_SIZE;
+            p_req->status = esp_partition_erase_range(p_req->partition, p_req->offset + p_req->progress, chunk);
+            if (p_req->status != ESP_OK) return true;
+
+            // We're done when every sector has been erased
+            p_req->progress += chunk;
+            return p_req->progress >= p_req->length;
     }
+
+    // If we get here, someone handed us a command we don't understand
+    p_req->status = ESP_ERR_INVALID_ARG;
+    return true;
 }
 //=========================================================================================================
 
 
 //=========================================================================================================
-// read() - Reads from flash memory with a very high priorty task that blocks other tasks
+// complete() - Records the latency of a request and tells the requesting task that it's done
 //=========================================================================================================
-void CFlashIO::read(const char* nvs_key, char* buffer)
+void CFlashIO::complete(flash_req_t* p_req)
 {
-    char cmd = FLASH_READ;
+    // How long did this request take from the time it was queued?
+    U32 elapsed_us = (U32)(esp_timer_get_time() - p_req->queued_time);
+
+    // Keep track of latency statistics for this lane
+    flash_lane_stats_t& stats = m_stats[p_req->lane];
+    ++stats.count;
+    stats.last_us   = elapsed_us;
+    stats.total_us += elapsed_us;
+    if (elapsed_us > stats.max_us) stats.max_us = elapsed_us;
+
+    // Wake up the task that's waiting on this request
+    xSemaphoreGive(p_req->done_sem);
+}
+//=========================================================================================================
 
-    // Only one thread a time is allowed to read/write flash memory
-    xSemaphoreTake(m_mutex, portMAX_DELAY);
 
-    // Fill in the paramaters required to read an object from flash
-    m_nvs_key   = nvs_key;
-    m_rw_buffer = buffer;
+//=========================================================================================================
+// perform() - Hands a request to the flash task, and waits for it to complete
+//
+// Passed: p_req = The request.  Everything except the bookkeeping fields must be filled in
+//
+// Returns: The ESP-IDF status of the operation
+//=========================================================================================================
+esp_err_t CFlashIO::perform(flash_req_t* p_req)
+{
+    SemaphoreHandle_t sem;
+
+    // Borrow a semaphore to wait on.  If every one of them is in use, this waits for one to free up
+    xQueueReceive(m_sem_pool_qh, &sem, portMAX_DELAY);
 
-    // Tell the read/write task to commence the operation
-    xQueueSend(m_start_qh, &cmd, portMAX_DELAY);
+    // Fill in the bookkeeping fields of the request
+    p_req->done_sem    = sem;
+    p_req->progress    = 0;
+    p_req->status      = ESP_FAIL;
+    p_req->queued_time = esp_timer_get_time();
+
+    // Queue up the request in its lane, and wake up the flash task
+    xQueueSend(m_lane_qh[p_req->lane], &p_req, portMAX_DELAY);
+    xTaskNotifyGive(m_task_handle);
 
     // Wait for the operation to complete
-    xQueueReceive(m_done_qh, &cmd, portMAX_DELAY);
+    xSemaphoreTake(sem, portMAX_DELAY);
+
+    // Give the semaphore back to the pool
+    xQueueSend(m_sem_pool_qh, &sem, portMAX_DELAY);
 
-    // Allow other threads to read/write flash memory
-    xSemaphoreGive(m_mutex);
+    // Tell the caller whether it worked
+    return p_req->status;
 }
 //=========================================================================================================
 
 
+//=========================================================================================================
+// read() - Reads from flash memory with a very high priorty task that blocks other tasks
+//=========================================================================================================
+void CFlashIO::read(const char* nvs_key, char* buffer)
+{
+    // Callers of this routine are trusted to supply a buffer large enough for the blob
+    read_blob(FLASH_DEFAULT_NAMESPACE, nvs_key, buffer, SIZE_MAX);
+}
+//=========================================================================================================
 
 
 //=========================================================================================================
 // write() - Writes to flash memory with a very high priorty task that blocks other tasks
 //=========================================================================================================
-void CFlashIO::write(const char* nvs_key, char* buffer, size_t length)
+void CFlashIO::write(const char* nvs_key, char* buffer, size_t length, flash_lane_t lane)
 {
-    char cmd = FLASH_WRITE;
+    write_blob(FLASH_DEFAULT_NAMESPACE, nvs_key, buffer, length, lane);
+}
+//=========================================================================================================
 
-    // Only one thread a time is allowed to read/write flash memory
-    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+//=========================================================================================================
+// read_blob() - Reads a blob from flash memory in any namespace
+//
+// Passed: nvs_namespace = The NVS namespace the blob lives in
+//         nvs_key       = The name of the blob
+//         buffer        = Where to store the data
+//         max_length    = The size of the buffer
+//         p_length      = If not nullptr, filled in with the number of bytes read
+//
+// Returns: 'true' if the blob exists and fit into the buffer
+//=========================================================================================================
+bool CFlashIO::read_blob(const char* nvs_namespace, const char* nvs_key, void* buffer, size_t max_length, size_t* p_length)
+{
+    flash_req_t req = {};
+
+    // Fill in the paramaters required to read an object from flash
+    req.cmd           = FLASH_READ;
+    req.lane          = FLASH_LANE_NORMAL;
+    req.nvs_namespace = nvs_namespace;
+    req.nvs_key       = nvs_key;
+    req.buffer        = (char*)buffer;
+    req.length        = max_length;
+
+    // Go read the blob
+    esp_err_t status = perform(&req);
+
+    // Tell the caller how many bytes we read
+    if (p_length) *p_length = req.length;
+
+    // Tell the caller whether this worked
+    return status == ESP_OK;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// write_blob() - Writes a blob to flash memory in any namespace
+//=========================================================================================================
+bool CFlashIO::write_blob(const char* nvs_namespace, const char* nvs_key, const void* buffer, size_t length, flash_lane_t lane)
+{
+    flash_req_t req = {};
 
     // Fill in the paramaters required to write an object to flash
-    m_nvs_key   = nvs_key;
-    m_rw_buffer = buffer;
-    m_rw_length = length;
+    req.cmd           = FLASH_WRITE;
+    req.lane          = lane;
+    req.nvs_namespace = nvs_namespace;
+    req.nvs_key       = nvs_key;
+    req.buffer        = (char*)buffer;
+    req.length        = length;
+
+    // Go write the blob and tell the caller whether it worked
+    return perform(&req) == ESP_OK;
+}
+//=========================================================================================================
 
-    // Tell the read/write task to commence the operation
-    xQueueSend(m_start_qh, &cmd, portMAX_DELAY);
 
-    // Wait for the operation to complete
-    xQueueReceive(m_done_qh, &cmd, portMAX_DELAY);
+//=========================================================================================================
+// erase_blob() - Erases a blob from flash memory in any namespace
+//=========================================================================================================
+bool CFlashIO::erase_blob(const char* nvs_namespace, const char* nvs_key)
+{
+    flash_req_t req = {};
+
+    // Fill in the paramaters required to erase an object from flash
+    req.cmd           = FLASH_ERASE;
+    req.lane          = FLASH_LANE_NORMAL;
+    req.nvs_namespace = nvs_namespace;
+    req.nvs_key       = nvs_key;
 
-    // Allow other threads to read/write flash memory
-    xSemaphoreGive(m_mutex);
+    // Go erase the blob and tell the caller whether it worked
+    return perform(&req) == ESP_OK;
 }
 //=========================================================================================================
 
 
+//=========================================================================================================
+// list() - Calls the callback once for every blob in the specified namespace
+//
+// Passed: nvs_namespace = The namespace to list, or nullptr for "all namespaces"
+//         callback      = The routine to call for each blob
+//         context       = Arbitrary pointer that is handed to the callback
+//=========================================================================================================
+bool CFlashIO::list(const char* nvs_namespace, flash_list_cb_t callback, void* context)
+{
+    flash_req_t req = {};
+
+    // Fill in the paramaters required to list the blobs
+    req.cmd           = FLASH_LIST;
+    req.lane          = FLASH_LANE_NORMAL;
+    req.nvs_namespace = nvs_namespace;
+    req.list_cb       = callback;
+    req.list_context  = context;
+
+    // Go perform the listing and tell the caller whether it worked
+    return perform(&req) == ESP_OK;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// write_partition() - Writes raw data to a data partition
+//
+// Passed: partition   = The partition to write to
+//         offset      = The offset in the partition to start writing at
+//         buffer      = The data to write
+//         length      = The number of bytes to write
+//         erase_first = If true, every sector the data touches is erased before it's written to
+//         lane        = The priority lane to perform the write in
+//
+// Returns: 'true' if the write succeeded
+//=========================================================================================================
+bool CFlashIO::write_partition(const esp_partition_t* partition, size_t offset, const void* buffer, size_t length,
+                               bool erase_first, flash_lane_t lane)
+{
+    flash_req_t req = {};
+
+    // There's nothing to do for an empty write
+    if (length == 0) return true;
+
+    // Fill in the parameters required to write to the partition
+    req.cmd         = FLASH_PART_WRITE;
+    req.lane        = lane;
+    req.partition   = partition;
+    req.offset      = offset;
+    req.buffer      = (char*)buffer;
+    req.length      = length;
+    req.erase_first = erase_first;
+
+    // Go perform the write and tell the caller whether it worked
+    return perform(&req) == ESP_OK;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// erase_partition() - Erases a region of a data partition
+//
+// Passed: partition = The partition to erase
+//         offset    = The offset of the region to erase.  Must be a multiple of FLASH_SECTOR_SIZE
+//         length    = The length of the region to erase.  Must be a multiple of FLASH_SECTOR_SIZE
+//         lane      = The priority lane to perform the erase in
+//
+// Returns: 'true' if the erase succeeded
+//=========================================================================================================
+bool CFlashIO::erase_partition(const esp_partition_t* partition, size_t offset, size_t length, flash_lane_t lane)
+{
+    flash_req_t req = {};
+
+    // The region to be erased must consist of whole sectors
+    if (offset % FLASH_SECTOR_SIZE || length % FLASH_SECTOR_SIZE) return false;
+
+    // There's nothing to do for an empty region
+    if (length == 0) return true;
+
+    // Fill in the parameters required to erase the region
+    req.cmd       = FLASH_PART_ERASE;
+    req.lane      = lane;
+    req.partition = partition;
+    req.offset    = offset;
+    req.length    = length;
+
+    // Go perform the erase and tell the caller whether it worked
+    return perform(&req) == ESP_OK;
+}
+//=========================================================================================================
@@ -1,15 +1,90 @@
 //=========================================================================================================
-// flash_io.h - Defines a task that manages reads/write to and from flash memory 
+// flash_io.h - Defines a task that manages reads/write to and from flash memory
 //=========================================================================================================
 #pragma once
 #include "common.h"
+#include "esp_partition.h"
+
+// This is the namespace that NVS stores our own data structure under
+#define FLASH_DEFAULT_NAMESPACE "storage"
+
+// Raw partition writes and erases are performed (and can be preempted) in units of this many bytes
+#define FLASH_SECTOR_SIZE 4096
+
+// An erase that covers an entire aligned block of this size erases the whole block in one step, which
+// is several times faster than erasing its sectors one at a time
+#define FLASH_BLOCK_SIZE  65536
+
+// The maximum number of tasks that can be waiting on a flash operation at the same time
+#define FLASH_MAX_WAITERS 8
+
+// FlashIO.list() calls one of these for each blob it finds
+typedef void (*flash_list_cb_t)(const char* nvs_namespace, const char* nvs_key, size_t length, void* context);
+
+//=========================================================================================================
+// Every request is placed into one of these lanes.  The flash task always services the urgent lane
+// first, then the normal lane, then the background lane.  A background request that spans many
+// sectors is carried out one sector (or, for an erase, one aligned 64K block) at a time, and 
+// urgent/normal requests are serviced in between.
+//=========================================================================================================
+enum flash_lane_t
+{
+    FLASH_LANE_URGENT,
+    FLASH_LANE_NORMAL,
+    FLASH_LANE_BACKGROUND,
+    FLASH_LANE_COUNT
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// Latency statistics for a lane, measured from the time a request is queued to the time it completes
+//=========================================================================================================
+struct flash_lane_stats_t
+{
+    U32     count;
+    U32     last_us;
+    U32     max_us;
+    U64     total_us;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// Describes a single request to the flash task.  Callers build one of these on their own stack
+//=========================================================================================================
+struct flash_req_t
+{
+    int                     cmd;
+    flash_lane_t            lane;
+
+    // For NVS operations
+    const char*             nvs_namespace;
+    const char*             nvs_key;
+    char*                   buffer;
+    size_t                  length;
+    flash_list_cb_t         list_cb;
+    void*                   list_context;
+
+    // For raw partition operations
+    const esp_partition_t*  partition;
+    size_t                  offset;
+    bool                    erase_first;
+    size_t                  progress;
+
+    // Bookkeeping
+    S64                     queued_time;
+    SemaphoreHandle_t       done_sem;
+    esp_err_t               status;
+};
+//=========================================================================================================
 
 
 class CFlashIO
 {
 public:
 
-    // Called once at startup 
+    // Called once at startup
     void    begin();
 
     // This is the thread that waits for messages and performs IO
@@ -19,21 +94,53 @@ public:
     void    read(const char* nvs_key, char* buffer);
 
     // Call this to write an object to flash memory
-    void    write(const char* nvs_key, char* buffer, size_t length);
+    void    write(const char* nvs_key, char* buffer, size_t length, flash_lane_t lane = FLASH_LANE_NORMAL);
+
+    // Reads a blob from any namespace.  Fails if the blob doesn't exist or won't fit in the buffer
+    bool    read_blob(const char* nvs_namespace, const char* nvs_key, void* buffer, size_t max_length, size_t* p_length = nullptr);
+
+    // Writes a blob into any namespace
+    bool    write_blob(const char* nvs_namespace, const char* nvs_key, const void* buffer, size_t length,
+                       flash_lane_t lane = FLASH_LANE_NORMAL);
+
+    // Erases a blob from any namespace
+    bool    erase_blob(const char* nvs_namespace, const char* nvs_key);
+
+    // Calls "callback" for every blob in the specified namespace (or in every namespace if nullptr).
+    // The callback runs in the context of the flash task and must not call FlashIO
+    bool    list(const char* nvs_namespace, flash_list_cb_t callback, void* context);
+
+    // Writes raw data to a partition.  If erase_first is true, each sector is erased before it's written
+    bool    write_partition(const esp_partition_t* partition, size_t offset, const void* buffer, size_t length,
+                            bool erase_first, flash_lane_t lane = FLASH_LANE_BACKGROUND);
+
+    // Erases a sector-aligned region of a partition
+    bool    erase_partition(const esp_partition_t* partition, size_t offset, size_t length,
+                            flash_lane_t lane = FLASH_LANE_BACKGROUND);
+
+    // Returns the latency statistics for a lane
+    const flash_lane_stats_t& lane_stats(flash_lane_t lane) {return m_stats[lane];}
 
 protected:
 
-    // Other tasks write to this queue to signal the start of a flash read/write
-    QueueHandle_t   m_start_qh;
-    
-    // A blocking read on this queue will return when the requested flash read/write is complete
-    QueueHandle_t   m_done_qh;
+    // Hands a request to the flash task and waits for it to complete
+    esp_err_t   perform(flash_req_t* p_req);
+
+    // Carries out one step of a request.  Returns 'true' when the request is complete
+    bool        step(flash_req_t* p_req);
+
+    // Tells the requesting task that its request is complete
+    void        complete(flash_req_t* p_req);
+
+    // Other tasks write request pointers into these queues, one queue per lane
+    QueueHandle_t       m_lane_qh[FLASH_LANE_COUNT];
+
+    // A pool of semaphores that requesting tasks block on until their request completes
+    QueueHandle_t       m_sem_pool_qh;
 
-    // This is the handle to the mutex that ensures thread-safe reads/writes to/from flash
-    SemaphoreHandle_t   m_mutex;
+    // The handle of the flash task
+    TaskHandle_t        m_task_handle;
 
-    // To perform a read/write we need a blob name, a buffer to read/write, and a buffer length
-    const char* m_nvs_key;
-    char*       m_rw_buffer;
-    int         m_rw_length;
+    // Per-lane latency statistics
+    flash_lane_stats_t  m_stats[FLASH_LANE_COUNT];
 };
@@ -10,7 +10,20 @@
 #include "stack_track.h"
 #include "buttons.h"
 #include "i2c_bus.h"
+#include "i2c_batch.h"
+#include "i2c_engine.h"
+#include "i2c_eeprom.h"
 #include "tcp_server.h"
+#include "crc32.h"
+#include "kv_store.h"
+#include "event_log.h"
+#include "data_tables.h"
+#include "boot_seq.h"
+#include "time_sync.h"
+#include "scan_cache.h"
+#include "link_monitor.h"
+#include "power_mgr.h"
+#include "sensor_sched.h"
 
 extern CSystem     System;
 extern CNVS        NVS;
@@ -20,10 +33,20 @@ extern CNVRAM      NVRAM;
 extern CStackTrack StackMgr;
 extern CProvButton ProvButton;
 extern CI2C        I2C;
+extern CI2CEngine  I2CEngine;
+extern CI2CEeprom  Eeprom;
 extern CTCPServer  TCPServer;
+extern CKVStore    KV;
+extern CEventLog   EventLog;
+extern CDataTables DataTables;
+extern CBootSeq    BootSeq;
+extern CTimeSync   TimeSync;
+extern CScanCache  ScanCache;
+extern CLinkMonitor LinkMon;
+extern CPowerMgr   PowerMgr;
+extern CSensorSched Sensors;
 
 
-uint32_t crc32(void *buf, size_t len);
 void     msdelay(uint32_t milliseconds);
 bool     parse_utc_string(const char* input, hms_t* p_hms);
 
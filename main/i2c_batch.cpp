@@ -0,0 +1,220 @@
+//=========================================================================================================
+// i2c_batch.cpp - Implements a builder that chains I2C operations on many devices into one transaction
+//=========================================================================================================
+#include "globals.h"
+
+
+//=========================================================================================================
+// Constructor/destructor - Create and destroy the command link
+//=========================================================================================================
+CI2CBatch::CI2CBatch()
+{
+    m_cmd    = nullptr;
+    m_bus_us = 0;
+    reset();
+}
+
+CI2CBatch::~CI2CBatch()
+{
+    #ifdef I2C_BATCH_STATIC_LINK
+    if (m_cmd) i2c_cmd_link_delete_static(m_cmd);
+    #else
+    if (m_cmd) i2c_cmd_link_delete(m_cmd);
+    #endif
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// reset() - Throws away any operations in the batch
+//
+// A command link can't be emptied, so we start a new one.  With the static buffer, this costs nothing
+// but re-initializing the buffer.  Otherwise, deleting the old link frees every command in it, and
+// the new link and each command added to it are separate heap allocations.  Avoid resetting a batch
+// that is going to be performed again
+//=========================================================================================================
+void CI2CBatch::reset()
+{
+    #ifdef I2C_BATCH_STATIC_LINK
+    if (m_cmd) i2c_cmd_link_delete_static(m_cmd);
+    m_cmd = i2c_cmd_link_create_static(m_link_buffer, sizeof m_link_buffer);
+    #else
+    if (m_cmd) i2c_cmd_link_delete(m_cmd);
+    m_cmd = i2c_cmd_link_create();
+    #endif
+
+    m_ops         = 0;
+    m_is_overflow = (m_cmd == nullptr);
+    m_is_closed   = false;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// add_address() - Starts a new operation by appending a (repeated) START and a device address byte
+//
+// Passed: i2c_address = The 7-bit address of the device
+//         rw          = I2C_MASTER_READ or I2C_MASTER_WRITE
+//
+// Returns: 'false' if there's no room in the batch
+//=========================================================================================================
+bool CI2CBatch::add_address(int i2c_address, int rw)
+{
+    // If the batch is already full or closed, we can't add anything to it
+    if (m_is_overflow || m_is_closed || m_ops == I2C_BATCH_MAX_OPS) return false;
+
+    // Remember which device this operation talks to
+    m_address[m_ops] = i2c_address;
+
+    if (i2c_master_start(m_cmd) != ESP_OK) m_is_overflow = true;
+    if (i2c_master_write_byte(m_cmd, i2c_address << 1 | rw, true) != ESP_OK) m_is_overflow = true;
+    return !m_is_overflow;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// add_register() - Appends a register address of 1 to 4 bytes, most significant byte first
+//=========================================================================================================
+bool CI2CBatch::add_register(int reg, int reg_len)
+{
+    // The driver doesn't copy the data, so the register address has to live somewhere safe
+    U8* p = m_reg_bytes[m_ops];
+
+    // Store the register address in big-endian order
+    if (reg_len > 4) reg_len = 4;
+    for (int i=0; i<reg_len; ++i) p[i] = reg >> (8 * (reg_len - 1 - i));
+
+    if (reg_len > 0 && i2c_master_write(m_cmd, p, reg_len, true) != ESP_OK) m_is_overflow = true;
+    return !m_is_overflow;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// add_read() - Appends the commands that read data from a device.  The last byte is NACKed
+//=========================================================================================================
+bool CI2CBatch::add_read(void* vp_data, int length)
+{
+    if (i2c_master_read(m_cmd, (U8*)vp_data, length, I2C_MASTER_LAST_NACK) != ESP_OK) m_is_overflow = true;
+    return !m_is_overflow;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// read() - Adds a read of "length" bytes from a device
+//=========================================================================================================
+bool CI2CBatch::read(int i2c_address, void* vp_data, int length)
+{
+    // Allow 0 length reads
+    if (length < 1) return true;
+
+    if (!add_address(i2c_address, I2C_MASTER_READ)) return false;
+    if (!add_read(vp_data, length)) return false;
+    ++m_ops;
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// write() - Adds a write of "length" bytes to a device
+//=========================================================================================================
+bool CI2CBatch::write(int i2c_address, const void* vp_data, int length)
+{
+    if (!add_address(i2c_address, I2C_MASTER_WRITE)) return false;
+    if (length > 0 && i2c_master_write(m_cmd, (const U8*)vp_data, length, true) != ESP_OK) m_is_overflow = true;
+    if (m_is_overflow) return false;
+    ++m_ops;
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// read_reg() - Adds a register read: write the register address, repeated START, read the data
+//
+// Passed: i2c_address = The 7-bit address of the device
+//         reg         = The register to read
+//         reg_len     = The number of bytes in the register address (usually 1 or 2)
+//         vp_data     = Where the data will be stored when the batch executes
+//         length      = The number of bytes to read
+//=========================================================================================================
+bool CI2CBatch::read_reg(int i2c_address, int reg, int reg_len, void* vp_data, int length)
+{
+    // Allow 0 length reads
+    if (length < 1) return true;
+
+    if (!add_address(i2c_address, I2C_MASTER_WRITE)) return false;
+    if (!add_register(reg, reg_len)) return false;
+    if (i2c_master_start(m_cmd) != ESP_OK) m_is_overflow = true;
+    if (i2c_master_write_byte(m_cmd, i2c_address << 1 | I2C_MASTER_READ, true) != ESP_OK) m_is_overflow = true;
+    if (!add_read(vp_data, length)) return false;
+    ++m_ops;
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// write_reg() - Adds a register write: the register address followed by the data
+//=========================================================================================================
+bool CI2CBatch::write_reg(int i2c_address, int reg, int reg_len, const void* vp_data, int length)
+{
+    if (!add_address(i2c_address, I2C_MASTER_WRITE)) return false;
+    if (!add_register(reg, reg_len)) return false;
+    if (length > 0 && i2c_master_write(m_cmd, (const U8*)vp_data, length, true) != ESP_OK) m_is_overflow = true;
+    if (m_is_overflow) return false;
+    ++m_ops;
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// execute() - Performs the entire batch as a single bus transaction
+//
+// Passed: bus = The I2C bus to perform the batch on
+//
+// Returns: 'true' if every device in the batch ACKed every byte
+//=========================================================================================================
+bool CI2CBatch::execute(CI2C& bus)
+{
+    // If the batch overflowed, some of its operations are missing, so don't perform any of them
+    if (m_is_overflow) return false;
+
+    // An empty batch trivially succeeds
+    if (m_ops == 0) return true;
+
+    // The first time the batch executes, it needs a STOP at the end
+    if (!m_is_closed)
+    {
+        if (i2c_master_stop(m_cmd) != ESP_OK) return false;
+        m_is_closed = true;
+    }
+
+    // The batch has to run at a speed that every device in it can handle
+    U32 speed_hz = I2C_MAX_HZ;
+    for (int i=0; i<m_ops; ++i)
+    {
+        U32 device_hz = bus.device_speed(m_address[i]);
+        if (device_hz < speed_hz) speed_hz = device_hz;
+    }
+
+    // Perform the batch, keeping track of how long it held the bus
+    S64 start_time = esp_timer_get_time();
+    bool status = bus.perform(m_cmd, speed_hz);
+    m_bus_us = (U32)(esp_timer_get_time() - start_time);
+
+    // Record the outcome against every device in the batch.  The driver doesn't tell us which device
+    // failed, so the failure of a batch with more than one device in it isn't held against any of
+    // them.  A caller that needs to know retries the devices one by one
+    bool is_shared = false;
+    for (int i=1; i<m_ops; ++i) if (m_address[i] != m_address[0]) is_shared = true;
+    if (status || !is_shared) for (int i=0; i<m_ops; ++i) bus.note_result(m_address[i], status);
+
+    // Tell the caller whether or not the batch was successful
+    return status;
+}
+//=========================================================================================================
@@ -0,0 +1,104 @@
+//=========================================================================================================
+// i2c_batch.h - Defines a builder that chains I2C operations on many devices into one bus transaction
+//
+// Each operation begins with a (repeated) START, so a batch that polls ten sensors costs one command
+// link and one bus arbitration instead of ten.  The whole batch succeeds or fails as a unit: if any
+// device fails to ACK, the driver abandons the rest of the batch.
+//
+// Building a batch is the expensive part.  Before ESP-IDF 4.4, the driver allocates the command link
+// and every START, write, read and STOP in it from the heap, so a batch built for a dozen operations
+// costs dozens of allocations.  A built batch can be executed again and again without allocating
+// anything, so a polling loop should build its batch once and keep it, rather than reset() it.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+#include "esp_idf_version.h"
+
+// The maximum number of operations in a batch
+#define I2C_BATCH_MAX_OPS   16
+
+// ESP-IDF 4.4 and later can build a command link in a buffer that we supply, with no heap allocation
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+#define I2C_BATCH_STATIC_LINK 1
+#endif
+
+class CI2C;
+
+
+//=========================================================================================================
+// CI2CBatch - Collects I2C operations and performs them in a single transaction
+//=========================================================================================================
+class CI2CBatch
+{
+public:
+
+    CI2CBatch();
+    ~CI2CBatch();
+
+    // Throws away any operations that have been added, so that the batch can be built again
+    void    reset();
+
+    // Adds a read of "length" bytes from a device
+    bool    read(int i2c_address, void* vp_data, int length);
+
+    // Adds a write of "length" bytes to a device.  The data must remain valid until execute() returns
+    bool    write(int i2c_address, const void* vp_data, int length);
+
+    // Adds a register read: writes a "reg_len" byte register address, then does a repeated-start
+    // read of "length" bytes
+    bool    read_reg(int i2c_address, int reg, int reg_len, void* vp_data, int length);
+
+    // Adds a register write: writes a "reg_len" byte register address followed by "length" bytes of
+    // data.  The data must remain valid until execute() returns
+    bool    write_reg(int i2c_address, int reg, int reg_len, const void* vp_data, int length);
+
+    // Performs every operation in the batch as a single transaction on the specified bus.  A batch
+    // can be executed over and over again (to poll the same sensors, for instance), but no more
+    // operations can be added to it until it's reset
+    bool    execute(CI2C& bus);
+
+    // Returns the number of operations in the batch
+    int     ops() {return m_ops;}
+
+    // Returns the number of microseconds the most recent execute() held the bus
+    U32     bus_us() {return m_bus_us;}
+
+protected:
+
+    // Appends a START and the address byte of a device
+    bool    add_address(int i2c_address, int rw);
+
+    // Appends a big-endian register address
+    bool    add_register(int reg, int reg_len);
+
+    // Appends the commands that read "length" bytes
+    bool    add_read(void* vp_data, int length);
+
+    // The command link that the batch is built in
+    i2c_cmd_handle_t    m_cmd;
+
+    // When the driver allows it, the command link and its commands live in this buffer rather than on
+    // the heap.  On older versions of ESP-IDF, every command is a separate heap allocation
+    #ifdef I2C_BATCH_STATIC_LINK
+    U8                  m_link_buffer[I2C_LINK_RECOMMENDED_SIZE(I2C_BATCH_MAX_OPS * 2)];
+    #endif
+
+    // The driver doesn't copy the data we write, so register addresses are stored here
+    U8                  m_reg_bytes[I2C_BATCH_MAX_OPS][4];
+
+    // The number of operations in the batch
+    int                 m_ops;
+
+    // The address of the device in each operation.  The batch runs at the clock of the slowest one
+    U8                  m_address[I2C_BATCH_MAX_OPS];
+
+    // This is true if the command link ran out of room
+    bool                m_is_overflow;
+
+    // This is true once the STOP that ends the batch has been appended
+    bool                m_is_closed;
+
+    // The number of microseconds the most recent execute() held the bus
+    U32                 m_bus_us;
+};
+//=========================================================================================================
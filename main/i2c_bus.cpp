@@ -1,8 +1,12 @@
 //=========================================================================================================
 // i2c_bus.cpp - Implements the interfaces to an I2C multi-drop serial bus
 //=========================================================================================================
+#include "esp_rom_sys.h"
 #include "globals.h"
 
+// This protects the statistics of every I2C bus
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
 
 //=========================================================================================================
 // init() - Call this once at bootup to initialize this I2C bus
@@ -10,10 +14,11 @@
 // Passed: port    = I2C_NUM_0 or I2C_NUM_1
 //         sda_pin = The name of the GPIO that will be the I2C data (SDA) pin.
 //         scl_pin = The name of the GPIO that will be the I2C clock (SCL) pin 
+//         clk_hz  = The bus clock for devices that don't have a speed profile
 //=========================================================================================================
-void CI2C::init(i2c_port_t port, gpio_num_t sda_pin, gpio_num_t scl_pin)
+void CI2C::init(i2c_port_t port, gpio_num_t sda_pin, gpio_num_t scl_pin, U32 clk_hz)
 {
-    i2c_config_t conf;
+    i2c_config_t& conf = m_conf;
     
     // Save the port number for future use
     m_port = port;
@@ -32,8 +37,16 @@ void CI2C::init(i2c_port_t port, gpio_num_t sda_pin, gpio_num_t scl_pin)
     conf.sda_pullup_en = GPIO_PULLUP_ENABLE;
     conf.scl_pullup_en = GPIO_PULLUP_ENABLE;
 
-    // Set the I2C bus clock to 100 kilohertz
-    conf.master.clk_speed = 100000;
+    // Set the I2C bus clock
+    if (clk_hz > I2C_MAX_HZ) clk_hz = I2C_MAX_HZ;
+    if (clk_hz < I2C_MIN_HZ) clk_hz = I2C_MIN_HZ;
+    conf.master.clk_speed = clk_hz;
+    m_default_hz = m_current_hz = clk_hz;
+    m_retimes = 0;
+
+    // No device has a speed profile yet, and we don't know what devices are on the bus
+    memset(m_speed_khz, 0, sizeof m_speed_khz);
+    memset(m_device, 0, sizeof m_device);
 
     // Configure this I2C serial bus
     i2c_param_config(port, &conf);
@@ -41,19 +54,54 @@ void CI2C::init(i2c_port_t port, gpio_num_t sda_pin, gpio_num_t scl_pin)
     // And install the I2C bus driver
     i2c_driver_install(port, conf.mode, 0, 0, 0);
     
-    // Create the mutex that we will use to ensure thread-safe access to the I2C bus
-    m_mutex = xSemaphoreCreateMutex();
+    // Create the mutex that we will use to ensure thread-safe access to the I2C bus.  It's
+    // recursive so that a task that has locked the bus can still call perform()
+    m_mutex = xSemaphoreCreateRecursiveMutex();
+
+    // Nobody is holding the bus, and nobody has used it yet
+    m_lock_depth = 0;
+    m_lock_start = 0;
+    memset(&m_stats, 0, sizeof m_stats);
 }
 //=========================================================================================================
 
 
 //=========================================================================================================
 // perform() - Performs an I2C read or write transaction
+//
+// Passed: cmd      = The command link to perform
+//         speed_hz = The fastest clock every device in the transaction can handle, or 0 for the default
+//
+// Returns: 'false' if the transaction failed, or if we couldn't acquire the bus
 //=========================================================================================================
-bool CI2C::perform(i2c_cmd_handle_t cmd)
+bool CI2C::perform(i2c_cmd_handle_t cmd, U32 speed_hz)
 {
+    // Get exclusive access to the bus.  If the caller already has it, this costs almost nothing
+    CI2CGuard guard(*this);
+    if (!guard.locked()) return false;
+
+    // Make sure the bus is running at the right speed for this transaction.  If we can't, don't
+    // run it at whatever speed the bus happens to be at
+    if (!retime(speed_hz ? speed_hz : m_default_hz))
+    {
+        portENTER_CRITICAL(&stats_mux);
+        ++m_stats.errors;
+        portEXIT_CRITICAL(&stats_mux);
+        return false;
+    }
+
     // Perform the read or write transaction
-    esp_err_t status = i2c_master_cmd_begin(m_port, cmd, 0);
+    esp_err_t status = i2c_master_cmd_begin(m_port, cmd, pdMS_TO_TICKS(I2C_CMD_TIMEOUT_MS));
+
+    // Keep track of how many transactions we've performed, and how many failed
+    portENTER_CRITICAL(&stats_mux);
+    ++m_stats.transactions;
+    if (status != ESP_OK) ++m_stats.errors;
+    portEXIT_CRITICAL(&stats_mux);
+
+    // A transaction always ends with a STOP, which releases SDA.  If SDA is still low after a 
+    // failure, a device is holding the bus hostage (typically after a brownout), so free it
+    if (status != ESP_OK && gpio_get_level((gpio_num_t)m_conf.sda_io_num) == 0) clear_bus();
 
     // Tell the caller whether or not this read or write operation was successful
     return status == ESP_OK;
@@ -83,7 +131,8 @@ bool  CI2C::read(int i2c_address, void* vp_data, int length)
     i2c_master_stop(cmd);
  
     // Perform the I2C read operation
-    bool status = I2C.perform(cmd);
+    bool status = perform(cmd, device_speed(i2c_address));
+    note_result(i2c_address, status);
  
     // Free the resources we allocated earlier
     i2c_cmd_link_delete(cmd);
@@ -108,32 +157,36 @@ bool  CI2C::read(int i2c_address, void* vp_data, int length)
 //=========================================================================================================
 bool  CI2C::write(int i2c_address, int val1, int len1, int val2, int len2)
 {
-    // Allocate an I2C command buffer for the write operation
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    U8 buffer[9], *p = buffer;
 
-    // Initialize the write-operation buffer
-    i2c_master_start(cmd);
-
-    // Tell the I2C bus that this is going to be a write operation to the specified device
-    i2c_master_write_byte(cmd, i2c_address << 1 | I2C_MASTER_WRITE, true);
+    // The first byte is the address of the device, and says this is going to be a write operation
+    *p++ = i2c_address << 1 | I2C_MASTER_WRITE;
 
-    // Buffer up the first value to be written
-    if (len1 >= 4) i2c_master_write_byte(cmd, val1 >> 24, true);
-    if (len1 >= 3) i2c_master_write_byte(cmd, val1 >> 16, true);
-    if (len1 >= 2) i2c_master_write_byte(cmd, val1 >>  8, true);
-    if (len1 >= 1) i2c_master_write_byte(cmd, val1      , true);
+    // Buffer up the first value to be written, most significant byte first
+    if (len1 >= 4) *p++ = val1 >> 24;
+    if (len1 >= 3) *p++ = val1 >> 16;
+    if (len1 >= 2) *p++ = val1 >>  8;
+    if (len1 >= 1) *p++ = val1      ;
 
     // Buffer up the second value to be written
-    if (len2 >= 4) i2c_master_write_byte(cmd, val2 >> 24, true);
-    if (len2 >= 3) i2c_master_write_byte(cmd, val2 >> 16, true);
-    if (len2 >= 2) i2c_master_write_byte(cmd, val2 >>  8, true);
-    if (len2 >= 1) i2c_master_write_byte(cmd, val2      , true);
+    if (len2 >= 4) *p++ = val2 >> 24;
+    if (len2 >= 3) *p++ = val2 >> 16;
+    if (len2 >= 2) *p++ = val2 >>  8;
+    if (len2 >= 1) *p++ = val2      ;
+
+    // Allocate an I2C command buffer for the write operation
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+
+    // Initialize the write-operation buffer, and queue up all of the bytes as a single command
+    i2c_master_start(cmd);
+    i2c_master_write(cmd, buffer, p - buffer, true);
 
     // Finalize the command buffer
     i2c_master_stop(cmd);
  
     // Perform the I2C write commands
-    bool status = I2C.perform(cmd);
+    bool status = perform(cmd, device_speed(i2c_address));
+    note_result(i2c_address, status);
 
     // Free up the resources we allocated earlier
     i2c_cmd_link_delete(cmd);
@@ -145,8 +198,322 @@ bool  CI2C::write(int i2c_address, int val1, int len1, int val2, int len2)
 
 
 //=========================================================================================================
-// lock() / unlock() - These are used to manage thread-safe exclusive access to the I2C bus.
+// lock() - Obtains thread-safe exclusive access to the I2C bus
+//
+// Passed: timeout_ms = The longest we're willing to wait for another task to release the bus
+//
+// Returns: 'true' if we now hold the bus, 'false' if we timed out
 //=========================================================================================================
-void CI2C::lock()   {xSemaphoreTake(m_mutex, portMAX_DELAY);}
-void CI2C::unlock() {xSemaphoreGive(m_mutex);}
+bool CI2C::lock(U32 timeout_ms)
+{
+    S64 start_time = esp_timer_get_time();
+
+    // Wait for the bus.  If we time out, keep track of that
+    if (xSemaphoreTakeRecursive(m_mutex, pdMS_TO_TICKS(timeout_ms)) != pdTRUE)
+    {
+        portENTER_CRITICAL(&stats_mux);
+        ++m_stats.timeouts;
+        portEXIT_CRITICAL(&stats_mux);
+        return false;
+    }
+
+    // If we already held the bus, there's nothing to keep track of
+    if (m_lock_depth++) return true;
+
+    // Keep track of how long we waited, and when we started holding the bus
+    S64 now = esp_timer_get_time();
+    U32 wait_us  = (U32)(now - start_time);
+    m_lock_start = now;
+    portENTER_CRITICAL(&stats_mux);
+    ++m_stats.locks;
+    m_stats.wait_us_total += wait_us;
+    if (wait_us > m_stats.wait_us_max) m_stats.wait_us_max = wait_us;
+    portEXIT_CRITICAL(&stats_mux);
+
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// unlock() - Releases the I2C bus.  Every successful lock() must be matched by an unlock()
+//=========================================================================================================
+void CI2C::unlock()
+{
+    // When the outermost lock is released, keep track of how long we held the bus
+    if (--m_lock_depth == 0)
+    {
+        U32 hold_us = (U32)(esp_timer_get_time() - m_lock_start);
+        portENTER_CRITICAL(&stats_mux);
+        m_stats.hold_us_total += hold_us;
+        if (hold_us > m_stats.hold_us_max) m_stats.hold_us_max = hold_us;
+        portEXIT_CRITICAL(&stats_mux);
+    }
+
+    xSemaphoreGiveRecursive(m_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get_stats() - Fetches a snapshot of the contention statistics
+//=========================================================================================================
+void CI2C::get_stats(i2c_stats_t* p_stats)
+{
+    portENTER_CRITICAL(&stats_mux);
+    *p_stats = m_stats;
+    portEXIT_CRITICAL(&stats_mux);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// set_device_speed() - Sets the fastest clock a device can handle
+//
+// Passed: i2c_address = The 7-bit address of the device
+//         max_hz      = Its fastest clock, or 0 to have it run at the default clock
+//
+// The clock is clamped to the range from I2C_MIN_HZ to I2C_MAX_HZ
+//=========================================================================================================
+void CI2C::set_device_speed(int i2c_address, U32 max_hz)
+{
+    if (i2c_address < 0 || i2c_address >= I2C_ADDRESS_COUNT) return;
+    if (max_hz > I2C_MAX_HZ) max_hz = I2C_MAX_HZ;
+    if (max_hz && max_hz < I2C_MIN_HZ) max_hz = I2C_MIN_HZ;
+    m_speed_khz[i2c_address] = max_hz / 1000;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// device_speed() - Returns the clock to use when talking to a device
+//=========================================================================================================
+U32 CI2C::device_speed(int i2c_address)
+{
+    if (i2c_address < 0 || i2c_address >= I2C_ADDRESS_COUNT) return m_default_hz;
+    U32 khz = m_speed_khz[i2c_address];
+    return khz ? khz * 1000 : m_default_hz;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// retime() - Changes the bus clock, but only if it isn't already running at the requested speed
+//
+// On Entry: the caller is holding the bus
+//
+// Returns: 'false' if the bus couldn't be set to this speed, in which case its speed is unchanged
+//
+// Devices that share a bus usually share a speed, so in practice the bus is only retimed when a 
+// transaction to a slower (or faster) device follows one to a faster (or slower) device
+//=========================================================================================================
+bool CI2C::retime(U32 hz)
+{
+    // If we're already running at this speed, there's nothing to do
+    if (hz == m_current_hz) return true;
+
+    // Compute the SCL period and the START, STOP, and data timings for the new clock.  If they
+    // don't fit in the timing registers, leave the bus alone
+    i2c_timing_t t;
+    if (!i2c_compute_timing(hz, &t)) return false;
+
+    // And load them into the timing registers.  Unlike i2c_param_config(), this leaves the pins and
+    // the rest of the peripheral alone.  The timings are all computed up front, so these only fail
+    // if the port is bad, but if one does, the registers are a mix of two clocks
+    bool status = i2c_set_period      (m_port, t.scl_high,    t.scl_low)    == ESP_OK
+               && i2c_set_start_timing(m_port, t.start_setup, t.start_hold) == ESP_OK
+               && i2c_set_stop_timing (m_port, t.stop_setup,  t.stop_hold)  == ESP_OK
+               && i2c_set_data_timing (m_port, t.data_sample, t.data_hold)  == ESP_OK
+               && i2c_set_timeout     (m_port, t.timeout)                   == ESP_OK;
+
+    // If that failed, we no longer know what speed the bus is at, so the next retime must reload
+    // the registers whatever speed it asks for
+    if (!status)
+    {
+        m_current_hz = 0;
+        return false;
+    }
+
+    // Keep our copy of the configuration in step with the hardware
+    m_conf.master.clk_speed = hz;
+    m_current_hz = hz;
+    ++m_retimes;
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// note_result() - Records the outcome of a transaction with a device
+//=========================================================================================================
+void CI2C::note_result(int i2c_address, bool status)
+{
+    if (i2c_address < 0 || i2c_address >= I2C_ADDRESS_COUNT) return;
+    i2c_device_t& device = m_device[i2c_address];
+
+    portENTER_CRITICAL(&stats_mux);
+    ++device.transactions;
+    if (status)
+        device.is_present = true;
+    else
+        ++device.errors;
+    portEXIT_CRITICAL(&stats_mux);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get_device() - Fetches what we know about the device at an address
+//=========================================================================================================
+void CI2C::get_device(int i2c_address, i2c_device_t* p_device)
+{
+    if (i2c_address < 0 || i2c_address >= I2C_ADDRESS_COUNT)
+    {
+        memset(p_device, 0, sizeof *p_device);
+        return;
+    }
+
+    portENTER_CRITICAL(&stats_mux);
+    *p_device = m_device[i2c_address];
+    portEXIT_CRITICAL(&stats_mux);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// scan() - Probes every address on the bus and records which devices answer
+//
+// Returns: The number of devices found, or -1 if we couldn't acquire the bus
+//
+// A NACK ends a command link, so each address needs its own probe, but we hold the bus for the 
+// whole scan.  We don't know what's at an address until it answers, so every address is probed at
+// the default clock
+//=========================================================================================================
+int CI2C::scan()
+{
+    int found = 0;
+
+    // Get exclusive access to the bus for the entire scan
+    CI2CGuard guard(*this);
+    if (!guard.locked()) return -1;
+
+    // Probe at the default clock, which every device on the bus can handle
+    if (!retime(m_default_hz)) return -1;
+
+    for (int address = I2C_FIRST_ADDRESS; address <= I2C_LAST_ADDRESS; ++address)
+    {
+        // If the device ACKs, it's there
+        bool is_present = probe(address, m_default_hz);
+
+        // Record the result
+        portENTER_CRITICAL(&stats_mux);
+        m_device[address].is_present = is_present;
+        portEXIT_CRITICAL(&stats_mux);
+        if (is_present) ++found;
+    }
+
+    // Tell the caller how many devices we found
+    return found;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// probe() - Finds out whether a device ACKs its address
+//
+// A probe is just a START, the address byte, and a STOP, with a short timeout.  A device that NACKs
+// is either absent or busy (an EEPROM in its write cycle, for instance), so it isn't counted as an
+// error
+//
+// Passed: i2c_address = The 7-bit address to probe
+//         speed_hz    = The clock to probe at
+//=========================================================================================================
+bool CI2C::probe(int i2c_address, U32 speed_hz)
+{
+    // Get exclusive access to the bus
+    CI2CGuard guard(*this);
+    if (!guard.locked()) return false;
+
+    // Make sure the bus is running at the requested speed
+    if (!retime(speed_hz)) return false;
+
+    // Build the probe
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    i2c_master_start(cmd);
+    i2c_master_write_byte(cmd, i2c_address << 1 | I2C_MASTER_WRITE, true);
+    i2c_master_stop(cmd);
+
+    // And find out if the device ACKs
+    bool status = (i2c_master_cmd_begin(m_port, cmd, pdMS_TO_TICKS(10)) == ESP_OK);
+    i2c_cmd_link_delete(cmd);
+    return status;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// clear_bus() - Frees a bus that a device is holding SDA low on
+//
+// Returns: 'true' if SDA is high afterwards
+//
+// A device that was in the middle of sending us a byte when it was interrupted (by a brownout, or by
+// our own reset) will hold SDA low until it has clocked out the rest of the byte.  We take the pins
+// away from the I2C peripheral, pulse SCL up to 9 times until the device lets go of SDA, send a STOP
+// to put every device back in the idle state, and then give the pins back
+//=========================================================================================================
+bool CI2C::clear_bus()
+{
+    gpio_num_t sda = (gpio_num_t)m_conf.sda_io_num;
+    gpio_num_t scl = (gpio_num_t)m_conf.scl_io_num;
+    gpio_config_t io_conf;
+
+    // Get exclusive access to the bus
+    CI2CGuard guard(*this);
+    if (!guard.locked()) return false;
+
+    // Turn SDA and SCL into ordinary open-drain GPIOs, both released
+    memset(&io_conf, 0, sizeof io_conf);
+    io_conf.pin_bit_mask = (1ULL << sda) | (1ULL << scl);
+    io_conf.mode         = GPIO_MODE_INPUT_OUTPUT_OD;
+    io_conf.pull_up_en   = GPIO_PULLUP_ENABLE;
+    gpio_set_level(sda, 1);
+    gpio_set_level(scl, 1);
+    gpio_config(&io_conf);
+    esp_rom_delay_us(5);
+
+    // Clock SCL until the device releases SDA, up to one full byte plus the ACK bit
+    for (int i=0; i<9 && gpio_get_level(sda) == 0; ++i)
+    {
+        gpio_set_level(scl, 0);
+        esp_rom_delay_us(5);
+        gpio_set_level(scl, 1);
+        esp_rom_delay_us(5);
+    }
+
+    // Send a STOP: SDA goes from low to high while SCL is high
+    gpio_set_level(scl, 0);
+    esp_rom_delay_us(5);
+    gpio_set_level(sda, 0);
+    esp_rom_delay_us(5);
+    gpio_set_level(scl, 1);
+    esp_rom_delay_us(5);
+    gpio_set_level(sda, 1);
+    esp_rom_delay_us(5);
+
+    // Find out whether the bus is free now
+    bool is_free = (gpio_get_level(sda) == 1);
+
+    // Give the pins back to the I2C peripheral and throw away anything left in its FIFOs
+    i2c_set_pin(m_port, sda, scl, m_conf.sda_pullup_en, m_conf.scl_pullup_en, I2C_MODE_MASTER);
+    i2c_reset_tx_fifo(m_port);
+    i2c_reset_rx_fifo(m_port);
+
+    // Keep track of how often this happens
+    portENTER_CRITICAL(&stats_mux);
+    ++m_stats.bus_clears;
+    portEXIT_CRITICAL(&stats_mux);
+    ESP_LOGW("I2C", "Bus cleared, SDA is %s", is_free ? "free" : "still stuck");
+
+    return is_free;
+}
 //=========================================================================================================
@@ -3,18 +3,68 @@
 //=========================================================================================================
 #pragma once
 #include "common.h"
+#include "i2c_timing.h"
+
+// By default, a task waits this long for another task to finish with the bus
+#define I2C_LOCK_TIMEOUT_MS     100
+
+// The longest a single I2C transaction is allowed to take
+#define I2C_CMD_TIMEOUT_MS      50
+
+// The default bus clock, and the fastest clock we allow (Fast-mode Plus)
+#define I2C_DEFAULT_HZ          100000
+#define I2C_MAX_HZ              1000000
+
+// The number of 7-bit I2C addresses
+#define I2C_ADDRESS_COUNT       128
+
+// A bus scan probes every address in this range.  The others are reserved by the I2C specification
+#define I2C_FIRST_ADDRESS       0x08
+#define I2C_LAST_ADDRESS        0x77
+
+
+//=========================================================================================================
+// Contention statistics for an I2C bus
+//=========================================================================================================
+struct i2c_stats_t
+{
+    U32     locks;              // The number of times the bus has been acquired
+    U32     timeouts;           // The number of times a task gave up waiting for the bus
+    U32     transactions;       // The number of transactions performed
+    U32     errors;             // The number of transactions that failed
+    U32     wait_us_max;        // The longest any task has waited to acquire the bus
+    U64     wait_us_total;
+    U32     hold_us_max;        // The longest any task has held the bus
+    U64     hold_us_total;
+    U32     bus_clears;         // The number of times a stuck bus has been cleared
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// What we know about each device on the bus
+//=========================================================================================================
+struct i2c_device_t
+{
+    bool    is_present;         // True if the device has answered a scan or a transaction
+    U32     transactions;       // The number of transactions with the device
+    U32     errors;             // How many of those failed
+};
+//=========================================================================================================
 
 
 class CI2C
 {
 public:
 
-    // Call this once at bootup to initialize this I2C bus
-    void    init(i2c_port_t port, gpio_num_t sda_pin, gpio_num_t scl_pin);
+    // Call this once at bootup to initialize this I2C bus.  "clk_hz" is the clock used for devices
+    // that don't have a speed profile
+    void    init(i2c_port_t port, gpio_num_t sda_pin, gpio_num_t scl_pin, U32 clk_hz = I2C_DEFAULT_HZ);
 
-    // These should be called before and after a set of "perform" and/or "read" operations to 
-    // obtain thread-safe exclusive access to the bus.
-    void    lock();
+    // These should be called before and after a set of "perform" and/or "read" operations to
+    // obtain thread-safe exclusive access to the bus.  The lock is recursive, so a task that holds it
+    // can still call read(), write() and perform().  lock() returns 'false' if it times out
+    bool    lock(U32 timeout_ms = I2C_LOCK_TIMEOUT_MS);
     void    unlock();
 
     // This is a convenience method that calls "perform" to do an I2C read for a specified number of bytes
@@ -23,15 +73,101 @@ public:
     // This is a convenience method that calls "perform" to write one or two integer values to an I2C device
     bool    write(int i2c_address, int val1, int len1, int val2=0, int len2=0);
 
-    // Call this to perform an arbitrary set of I2C read/write commands
-    bool    perform(i2c_cmd_handle_t cmd);
+    // Call this to perform an arbitrary set of I2C read/write commands.  This locks the bus for the
+    // duration of the transaction.  "speed_hz" is the fastest clock that every device in the 
+    // transaction can handle.  0 means the default clock
+    bool    perform(i2c_cmd_handle_t cmd, U32 speed_hz = 0);
+
+    // Sets the fastest clock a device can handle, clamped to what the hardware supports.  0 removes
+    // the device's profile, so that it runs at the default clock
+    void    set_device_speed(int i2c_address, U32 max_hz);
+
+    // Returns the clock to use when talking to a device
+    U32     device_speed(int i2c_address);
+
+    // Returns the current and default bus clocks.  The current clock is 0 if a retime failed partway
+    U32     clock() {return m_current_hz;}
+    U32     default_clock() {return m_default_hz;}
+
+    // Returns the number of times the bus has been retimed
+    U32     retime_count() {return m_retimes;}
+
+    // Probes every address on the bus and records which devices answer.  Returns the number found
+    int     scan();
+
+    // Returns 'true' if the device at an address ACKs its address.  This doesn't count as an error
+    // if it doesn't, so it can be used to poll a device that is busy.  "speed_hz" is the clock to
+    // probe at: device_speed() for a known device, or the default clock for an unknown one
+    bool    probe(int i2c_address, U32 speed_hz);
+
+    // Frees a bus that a device is holding SDA low on.  Returns 'true' if SDA is released.  This is
+    // done automatically when a failed transaction leaves SDA low
+    bool    clear_bus();
+
+    // Fetches what we know about the device at an address
+    void    get_device(int i2c_address, i2c_device_t* p_device);
+
+    // Records the outcome of a transaction with a device.  read(), write() and CI2CBatch call this
+    void    note_result(int i2c_address, bool status);
+
+    // Fetches a snapshot of the contention statistics
+    void    get_stats(i2c_stats_t* p_stats);
+
+    // Returns the I2C port number of this bus
+    i2c_port_t  port() {return m_port;}
 
 protected:
 
+    // Changes the bus clock if it isn't already at the requested speed.  Returns 'false' if it can't
+    bool    retime(U32 hz);
+
     // This is the I2C port number of this I2C bus
     i2c_port_t          m_port;
-        
-    // This is the handle to the mutex that ensures thread-safe access to the I2C bus
+
+    // This is the configuration of the bus.  We need it again to change the clock or clear the bus
+    i2c_config_t        m_conf;
+
+    // The registry of devices, indexed by I2C address
+    i2c_device_t        m_device[I2C_ADDRESS_COUNT];
+
+    // The default clock, the clock the bus is running at right now, and how often it has changed
+    U32                 m_default_hz;
+    U32                 m_current_hz;
+    U32                 m_retimes;
+
+    // The speed profile of each device in kHz, indexed by I2C address.  0 = use the default clock
+    U16                 m_speed_khz[I2C_ADDRESS_COUNT];
+
+    // This is the handle to the recursive mutex that ensures thread-safe access to the I2C bus
     SemaphoreHandle_t   m_mutex;
 
-};
\ No newline at end of file
+    // How deeply the task holding the bus has locked it, and when it first locked it
+    int                 m_lock_depth;
+    S64                 m_lock_start;
+
+    // Contention statistics
+    i2c_stats_t         m_stats;
+};
+
+
+//=========================================================================================================
+// CI2CGuard - Locks an I2C bus for as long as the guard is in scope
+//
+// Check locked() before using the bus: if the bus couldn't be acquired before the timeout, the
+// guard doesn't hold it
+//=========================================================================================================
+class CI2CGuard
+{
+public:
+    CI2CGuard(CI2C& bus, U32 timeout_ms = I2C_LOCK_TIMEOUT_MS) : m_bus(bus) {m_is_locked = bus.lock(timeout_ms);}
+    ~CI2CGuard() {if (m_is_locked) m_bus.unlock();}
+    CI2CGuard(const CI2CGuard&) = delete;
+
+    // Returns 'true' if we are holding the bus
+    bool    locked() {return m_is_locked;}
+
+protected:
+    CI2C&   m_bus;
+    bool    m_is_locked;
+};
+//=========================================================================================================
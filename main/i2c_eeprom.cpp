@@ -0,0 +1,139 @@
+//=========================================================================================================
+// i2c_eeprom.cpp - Implements a block-device driver for I2C EEPROM and FRAM chips
+//=========================================================================================================
+#include "globals.h"
+
+
+//=========================================================================================================
+// init() - Describes the chip
+//
+// Passed: p_bus       = The I2C bus the chip is on
+//         i2c_address = The 7-bit address of the chip
+//         size        = The size of the chip in bytes
+//         page_size   = The size of a write page in bytes (EEPROM only)
+//         addr_bytes  = The number of bytes in a memory address (1 or 2)
+//         is_fram     = True if the chip is FRAM, which has no pages and no write cycle
+//         max_hz      = The fastest clock the chip can handle
+//=========================================================================================================
+void CI2CEeprom::init(CI2C* p_bus, int i2c_address, U32 size, U32 page_size, int addr_bytes, bool is_fram, U32 max_hz)
+{
+    m_bus        = p_bus;
+    m_address    = i2c_address;
+    m_size       = size;
+    m_addr_bytes = addr_bytes;
+    m_is_fram    = is_fram;
+    m_polls      = 0;
+    m_pages      = 0;
+
+    // FRAM is written in bursts that are limited only by the I2C command timeout
+    m_page_size  = is_fram ? EEPROM_BURST_SIZE : page_size;
+
+    // Let the bus run as fast as the chip can go when we're talking to it
+    p_bus->set_device_speed(i2c_address, max_hz);
+
+    // Create the mutex that serializes access to our batch
+    m_mutex = xSemaphoreCreateMutex();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// wait_ready() - Waits for the chip to finish an internal write cycle
+//
+// While an EEPROM is busy writing a page, it doesn't ACK its address.  Polling it tells us the moment
+// it's done, which is usually well before the worst-case write time
+//
+// Returns: 'false' if the chip never became ready
+//=========================================================================================================
+bool CI2CEeprom::wait_ready()
+{
+    S64 deadline = esp_timer_get_time() + EEPROM_WRITE_TIMEOUT_MS * 1000;
+    U32 speed_hz = m_bus->device_speed(m_address);
+
+    while (true)
+    {
+        ++m_polls;
+        if (m_bus->probe(m_address, speed_hz)) return true;
+        if (esp_timer_get_time() > deadline) return false;
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// read() - Reads an arbitrary number of bytes
+//
+// Passed: offset  = The address in the chip to start reading at
+//         vp_data = Where to store the data
+//         length  = The number of bytes to read
+//
+// The chip increments its address pointer after each byte, so this is one sequential read per burst
+//=========================================================================================================
+bool CI2CEeprom::read(U32 offset, void* vp_data, U32 length)
+{
+    U8* p_data = (U8*)vp_data;
+    bool status = true;
+
+    // Don't read past the end of the chip
+    if (offset + length > m_size) return false;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    while (status && length)
+    {
+        U32 burst = length < EEPROM_BURST_SIZE ? length : EEPROM_BURST_SIZE;
+        m_batch.reset();
+        m_batch.read_reg(m_address, offset, m_addr_bytes, p_data, burst);
+        status = m_batch.execute(*m_bus);
+        offset += burst;
+        p_data += burst;
+        length -= burst;
+    }
+    xSemaphoreGive(m_mutex);
+
+    return status;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// write() - Writes an arbitrary number of bytes
+//
+// Passed: offset  = The address in the chip to start writing at
+//         vp_data = The data to write
+//         length  = The number of bytes to write
+//
+// The data is split at page boundaries, because a burst that crosses one wraps around to the start
+// of the page.  After each page, we wait for the chip to finish its write cycle.  We don't hold the
+// bus while we wait, so other devices can use it in the meantime
+//=========================================================================================================
+bool CI2CEeprom::write(U32 offset, const void* vp_data, U32 length)
+{
+    const U8* p_data = (const U8*)vp_data;
+    bool status = true;
+
+    // Don't write past the end of the chip
+    if (offset + length > m_size) return false;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    while (status && length)
+    {
+        // Write as much as fits in the rest of this page
+        U32 room  = m_page_size - (offset % m_page_size);
+        U32 burst = length < room ? length : room;
+        m_batch.reset();
+        m_batch.write_reg(m_address, offset, m_addr_bytes, p_data, burst);
+        status = m_batch.execute(*m_bus);
+        ++m_pages;
+
+        // Wait for an EEPROM to finish writing the page
+        if (status && !m_is_fram) status = wait_ready();
+
+        offset += burst;
+        p_data += burst;
+        length -= burst;
+    }
+    xSemaphoreGive(m_mutex);
+
+    return status;
+}
+//=========================================================================================================
@@ -0,0 +1,75 @@
+//=========================================================================================================
+// i2c_eeprom.h - Defines a block-device driver for I2C EEPROM and FRAM chips
+//
+// Writes are split at page boundaries so that each page is written in a single burst, and completion
+// is detected by ACK-polling the chip rather than by waiting a fixed worst-case time.  Reads are
+// sequential and can be any length.  FRAM has no pages and no write delay, so it's written in large
+// bursts and never polled.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+#include "i2c_batch.h"
+
+// The default chip: a 24LC256 (32 KB, 64-byte pages, 2-byte addresses) at address 0x50
+#define EEPROM_I2C_ADDRESS      0x50
+#define EEPROM_SIZE             32768
+#define EEPROM_PAGE_SIZE        64
+#define EEPROM_ADDR_BYTES       2
+#define EEPROM_MAX_HZ           400000
+
+// The longest an EEPROM page write can take (tWR is 5 ms on most parts)
+#define EEPROM_WRITE_TIMEOUT_MS 10
+
+// Reads and FRAM writes are broken into bursts of this many bytes, which keeps each transaction well
+// inside the I2C command timeout
+#define EEPROM_BURST_SIZE       256
+
+
+class CI2CEeprom
+{
+public:
+
+    // Call this once at startup to describe the chip.  For FRAM, pass is_fram = true; the page size
+    // is then ignored
+    void    init(CI2C* p_bus, int i2c_address = EEPROM_I2C_ADDRESS, U32 size = EEPROM_SIZE,
+                 U32 page_size = EEPROM_PAGE_SIZE, int addr_bytes = EEPROM_ADDR_BYTES,
+                 bool is_fram = false, U32 max_hz = EEPROM_MAX_HZ);
+
+    // Reads "length" bytes starting at "offset".  Returns 'false' on failure
+    bool    read(U32 offset, void* vp_data, U32 length);
+
+    // Writes "length" bytes starting at "offset".  Returns 'false' on failure
+    bool    write(U32 offset, const void* vp_data, U32 length);
+
+    // Returns the geometry of the chip
+    U32     size()      {return m_size;}
+    U32     page_size() {return m_page_size;}
+    int     address()   {return m_address;}
+    bool    is_fram()   {return m_is_fram;}
+
+    // Returns the number of ACK-polls and the number of page writes since boot
+    U32     poll_count() {return m_polls;}
+    U32     page_count() {return m_pages;}
+
+protected:
+
+    // Waits for the chip to finish an internal write cycle by polling it until it ACKs
+    bool    wait_ready();
+
+    // The bus the chip is on, and its address and geometry
+    CI2C*   m_bus;
+    int     m_address;
+    U32     m_size;
+    U32     m_page_size;
+    int     m_addr_bytes;
+    bool    m_is_fram;
+
+    // Statistics
+    U32     m_polls;
+    U32     m_pages;
+
+    // Each burst is built in this batch.  The mutex serializes access to it
+    CI2CBatch           m_batch;
+    SemaphoreHandle_t   m_mutex;
+};
+//=========================================================================================================
@@ -0,0 +1,263 @@
+//=========================================================================================================
+// i2c_engine.cpp - Implements a task that performs I2C transactions asynchronously
+//=========================================================================================================
+#include "globals.h"
+
+// This protects the statistics and the list of pending requests, which are updated by every task that
+// submits a request
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+//=========================================================================================================
+// launch_task() - Just calls the task() method of our I2CEngine object
+//=========================================================================================================
+static void launch_task(void *pvParameters) {I2CEngine.task();}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// begin() - Creates the request queue and launches the engine task
+//
+// Passed: p_bus = The I2C bus that this engine will perform transactions on
+//=========================================================================================================
+void CI2CEngine::begin(CI2C* p_bus)
+{
+    // Keep track of which bus we're servicing
+    m_bus = p_bus;
+
+    // No requests have been serviced yet, and none are pending
+    memset(&m_stats, 0, sizeof m_stats);
+    memset(m_pending, 0, sizeof m_pending);
+    m_last_token = 0;
+
+    // Other tasks will place their requests in this queue
+    m_queue = xQueueCreate(I2C_ENGINE_QUEUE_DEPTH, sizeof(i2c_req_t));
+
+    // And launch the task that performs the requests
+    xTaskCreatePinnedToCore(::launch_task, "i2c", 3072, nullptr, TASK_PRIO_I2C, &m_task_handle, TASK_CPU);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// enqueue() - Gives a request a token and adds it to the queue without waiting
+//
+// Returns: 'false' if the queue is full
+//=========================================================================================================
+bool CI2CEngine::enqueue(i2c_req_t& req)
+{
+    int slot = -1;
+
+    // Issue the next token.  Tokens fit in 31 bits, so that a notification can carry the status too,
+    // and are never 0
+    portENTER_CRITICAL(&stats_mux);
+    m_last_token = (m_last_token + 1) & ~I2C_NOTIFY_OK;
+    if (m_last_token == 0) m_last_token = 1;
+    req.token = m_last_token;
+
+    // Add it to the list of pending requests
+    for (int i=0; i<I2C_ENGINE_QUEUE_DEPTH; ++i) if (m_pending[i] == 0)
+    {
+        m_pending[i] = req.token;
+        slot = i;
+        break;
+    }
+    portEXIT_CRITICAL(&stats_mux);
+
+    // If there's no room in the queue, turn the request away rather than blocking the caller
+    bool status = (slot >= 0 && xQueueSend(m_queue, &req, 0) == pdTRUE);
+    if (!status) remove_pending(req.token);
+
+    // Keep track of rejected requests, and of the deepest the queue has ever been
+    U32 depth = uxQueueMessagesWaiting(m_queue);
+    portENTER_CRITICAL(&stats_mux);
+    if (!status) ++m_stats.rejected;
+    if (depth > m_stats.peak_depth) m_stats.peak_depth = depth;
+    portEXIT_CRITICAL(&stats_mux);
+
+    return status;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// submit() - Submits a batch that will call a completion callback when it's done
+//=========================================================================================================
+bool CI2CEngine::submit(CI2CBatch* p_batch, i2c_done_cb_t callback, void* context)
+{
+    i2c_req_t req = {p_batch, callback, context, nullptr, 0};
+    return enqueue(req);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// submit() - Submits a batch that will notify the calling task when it's done
+//
+// Returns: The token to hand to wait(), or 0 if the queue is full
+//=========================================================================================================
+i2c_token_t CI2CEngine::submit(CI2CBatch* p_batch)
+{
+    i2c_req_t req = {p_batch, nullptr, nullptr, xTaskGetCurrentTaskHandle(), 0};
+    return enqueue(req) ? req.token : 0;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// wait() - Waits for a batch that was submitted without a callback to complete
+//
+// Passed: token      = The token that submit() returned
+//         timeout_ms = The longest we're willing to wait
+//         p_is_done  = If not nullptr, set to 'true' if the batch finished, and 'false' if we timed out
+//
+// Returns: 'true' if the batch completed successfully, 'false' if it failed or we timed out
+//
+// A notification for some other token is left over from a request whose wait() timed out, and is
+// thrown away
+//=========================================================================================================
+bool CI2CEngine::wait(i2c_token_t token, U32 timeout_ms, bool* p_is_done)
+{
+    uint32_t   value;
+    TickType_t ticks = (timeout_ms == portMAX_DELAY) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+    TickType_t start = xTaskGetTickCount();
+
+    if (p_is_done) *p_is_done = false;
+
+    while (true)
+    {
+        // Wait for whatever is left of the timeout
+        TickType_t remaining = portMAX_DELAY;
+        if (ticks != portMAX_DELAY)
+        {
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            if (elapsed >= ticks) return false;
+            remaining = ticks - elapsed;
+        }
+        if (xTaskNotifyWait(0, 0xFFFFFFFF, &value, remaining) != pdTRUE) return false;
+
+        // If this is the notification we're waiting for, tell the caller how it went
+        if ((value & ~I2C_NOTIFY_OK) == token)
+        {
+            if (p_is_done) *p_is_done = true;
+            return (value & I2C_NOTIFY_OK) != 0;
+        }
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// cancel() - Cancels a request that the engine hasn't started on yet
+//
+// Passed: token = The token that submit() returned
+//
+// Returns: 'true' if the request was cancelled, in which case the batch is free to be reused.  'false'
+//          if the engine has started on it or already finished it
+//=========================================================================================================
+bool CI2CEngine::cancel(i2c_token_t token)
+{
+    if (!remove_pending(token)) return false;
+
+    portENTER_CRITICAL(&stats_mux);
+    ++m_stats.cancelled;
+    portEXIT_CRITICAL(&stats_mux);
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// remove_pending() - Removes a token from the list of pending requests
+//
+// Returns: 'true' if the token was in the list
+//=========================================================================================================
+bool CI2CEngine::remove_pending(i2c_token_t token)
+{
+    bool status = false;
+
+    portENTER_CRITICAL(&stats_mux);
+    for (int i=0; i<I2C_ENGINE_QUEUE_DEPTH; ++i) if (m_pending[i] == token)
+    {
+        m_pending[i] = 0;
+        status = true;
+        break;
+    }
+    portEXIT_CRITICAL(&stats_mux);
+
+    return status;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get_stats() - Fetches a snapshot of the engine statistics
+//=========================================================================================================
+void CI2CEngine::get_stats(i2c_engine_stats_t* p_stats)
+{
+    portENTER_CRITICAL(&stats_mux);
+    *p_stats = m_stats;
+    portEXIT_CRITICAL(&stats_mux);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// service() - Performs a request and tells the submitter how it went
+//
+// On Entry: The engine task is holding the bus
+//=========================================================================================================
+void CI2CEngine::service(i2c_req_t& req)
+{
+    // Perform the batch
+    bool status = req.batch->execute(*m_bus);
+
+    // Keep track of how it went
+    portENTER_CRITICAL(&stats_mux);
+    if (status)
+        ++m_stats.completed;
+    else
+        ++m_stats.failed;
+    portEXIT_CRITICAL(&stats_mux);
+
+    // Tell the submitter
+    if (req.callback)
+        req.callback(req.batch, status, req.context);
+    else if (req.notify_task)
+        xTaskNotify(req.notify_task, req.token | (status ? I2C_NOTIFY_OK : 0), eSetValueWithOverwrite);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// task() - Waits for requests and performs them
+//
+// Once the engine has the bus, it performs every request that's waiting before releasing it, so a
+// burst of requests goes out back-to-back without a round trip through the mutex for each one
+//=========================================================================================================
+void CI2CEngine::task()
+{
+    i2c_req_t req;
+
+    while (true)
+    {
+        // Wait for a request to arrive
+        xQueueReceive(m_queue, &req, portMAX_DELAY);
+
+        // Hold the bus while we drain the queue.  If we can't get it, the requests will fail one
+        // by one (execute() will time out too), and their submitters will find out about it.  A 
+        // request that is no longer pending was cancelled, and is skipped
+        {
+            CI2CGuard guard(*m_bus);
+            do
+            {
+                if (remove_pending(req.token)) service(req);
+            }
+            while (xQueueReceive(m_queue, &req, 0) == pdTRUE);
+        }
+
+        // Keep track of the stack depth
+        StackMgr.record_hwm(TASK_IDX_I2C);
+    }
+}
+//=========================================================================================================
@@ -0,0 +1,124 @@
+//=========================================================================================================
+// i2c_engine.h - Defines a task that performs I2C transactions asynchronously
+//
+// Callers submit a CI2CBatch and carry on with their work.  The engine task performs the batch and
+// then either calls a completion callback or notifies the submitting task.  When several requests are
+// waiting, the engine performs them back-to-back without giving up the bus in between.
+//
+// A task that waits for its request gets a token from submit() and hands it to wait().  A wait that
+// times out leaves the request queued.  The task should then cancel() it: if cancel() returns 'false',
+// the engine has already started on the batch, and the task must wait() for it again before reusing
+// or freeing the batch.  A late notification for an earlier token never satisfies a later wait()
+//=========================================================================================================
+#pragma once
+#include "common.h"
+
+// The maximum number of requests that can be waiting for the engine
+#define I2C_ENGINE_QUEUE_DEPTH  16
+
+// A task is notified with the token of its request when it completes, with this bit set if the
+// batch succeeded
+#define I2C_NOTIFY_OK           0x80000000
+
+// Identifies a request that was submitted without a callback.  0 means the request was turned away
+typedef U32 i2c_token_t;
+
+class CI2C;
+class CI2CBatch;
+
+// A completion callback.  This runs in the engine task, and the bus is still locked when it's called
+typedef void (*i2c_done_cb_t)(CI2CBatch* p_batch, bool status, void* context);
+
+
+//=========================================================================================================
+// Describes a single request to the engine
+//=========================================================================================================
+struct i2c_req_t
+{
+    CI2CBatch*      batch;
+    i2c_done_cb_t   callback;
+    void*           context;
+    TaskHandle_t    notify_task;
+    i2c_token_t     token;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// Statistics about the engine
+//=========================================================================================================
+struct i2c_engine_stats_t
+{
+    U32     completed;          // The number of requests performed successfully
+    U32     failed;             // The number of requests that failed
+    U32     rejected;           // The number of requests turned away because the queue was full
+    U32     cancelled;          // The number of requests cancelled before they were performed
+    U32     peak_depth;         // The most requests that have ever been waiting at once
+};
+//=========================================================================================================
+
+
+class CI2CEngine
+{
+public:
+
+    // Call this once at startup to launch the engine task that services the specified bus
+    void    begin(CI2C* p_bus);
+
+    // Submits a batch.  When it's done, "callback" is called from the engine task.  Returns 'false'
+    // if the queue is full.  The batch must remain valid until the callback is called
+    bool    submit(CI2CBatch* p_batch, i2c_done_cb_t callback, void* context = nullptr);
+
+    // Submits a batch.  When it's done, the calling task is notified.  Returns the token to wait()
+    // on, or 0 if the queue is full.  The batch must remain valid until wait() returns 'true' for it,
+    // or it has been cancelled
+    i2c_token_t submit(CI2CBatch* p_batch);
+
+    // Called by the task that submitted a batch without a callback, to wait for it to finish.  Returns
+    // 'true' if the batch completed successfully before the timeout.  Pass "p_is_done" to find out
+    // whether the batch finished at all, as opposed to timing out
+    static bool wait(i2c_token_t token, U32 timeout_ms = portMAX_DELAY, bool* p_is_done = nullptr);
+
+    // Cancels a request that the engine hasn't started yet.  Returns 'true' if it was cancelled, and
+    // 'false' if it's being performed or has already finished
+    bool    cancel(i2c_token_t token);
+
+    // Fetches the engine statistics
+    void    get_stats(i2c_engine_stats_t* p_stats);
+
+public:
+
+    // This is the engine task.  It shouldn't be called externally
+    void    task();
+
+protected:
+
+    // Gives a request a token and adds it to the queue
+    bool    enqueue(i2c_req_t& req);
+
+    // Performs a request and tells the submitter how it went
+    void    service(i2c_req_t& req);
+
+    // Removes a token from the list of pending requests.  Returns 'false' if it wasn't there
+    bool    remove_pending(i2c_token_t token);
+
+    // The bus that this engine services
+    CI2C*           m_bus;
+
+    // Requests are waiting in this queue
+    QueueHandle_t   m_queue;
+
+    // The handle of the engine task
+    TaskHandle_t    m_task_handle;
+
+    // The tokens of the requests in the queue.  A request whose token has been removed from this list
+    // has been cancelled, and is skipped.  0 marks an unused slot
+    i2c_token_t     m_pending[I2C_ENGINE_QUEUE_DEPTH];
+
+    // The most recently issued token
+    i2c_token_t     m_last_token;
+
+    // Engine statistics
+    i2c_engine_stats_t m_stats;
+};
+//=========================================================================================================
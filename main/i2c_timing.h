@@ -0,0 +1,75 @@
+//=========================================================================================================
+// i2c_timing.h - Computes the timing registers of the I2C peripheral for a given bus clock
+//
+// The I2C peripheral counts every timing in cycles of its 80 MHz source clock.  These are the same
+// values that i2c_param_config() computes, but computing them ourselves lets us change the clock with
+// the i2c_set_xxx_timing() calls instead of reconfiguring the whole bus.  The timing registers are
+// only 10 or 14 bits wide, which puts a floor under the clock.
+//
+// This header needs only the standard headers, so that it can be tested on a host
+//=========================================================================================================
+#pragma once
+#include <stdint.h>
+
+// The clock that the I2C peripheral counts its timings in
+#define I2C_SOURCE_HZ   80000000
+
+// The largest values the ESP32's timing registers can hold
+#define I2C_MAX_PERIOD  0x3FFF          // SCL high and low periods, STOP hold
+#define I2C_MAX_TIMING  0x3FF           // START setup and hold, STOP setup, data sample and hold
+#define I2C_MAX_TIMEOUT 0xFFFFF
+
+// The slowest clock whose timings fit in those registers
+#define I2C_MIN_HZ      40000
+
+
+//=========================================================================================================
+// The timings of one bus clock, each in cycles of the source clock
+//=========================================================================================================
+struct i2c_timing_t
+{
+    int     scl_high;           // SCL high period
+    int     scl_low;            // SCL low period
+    int     start_setup;        // SCL high to SDA falling, for a (repeated) START
+    int     start_hold;         // SDA falling to SCL falling, for a START
+    int     stop_setup;         // SCL rising to SDA rising, for a STOP
+    int     stop_hold;          // Bus-free time after a STOP
+    int     data_sample;        // SCL rising to the point where SDA is sampled
+    int     data_hold;          // SCL falling to SDA changing
+    int     timeout;            // How long SCL may be held low before the transaction is abandoned
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// i2c_compute_timing() - Computes the timings for a bus clock the same way the ESP-IDF driver does:
+//                        a 50% duty cycle, data changing and being sampled in the middle of each half
+//                        cycle, and a timeout of 10 bus cycles
+//
+// Passed: hz       = The bus clock
+//         p_timing = The structure to fill in
+//
+// Returns: 'false' if the clock is 0, or so slow that its timings don't fit in the registers
+//=========================================================================================================
+inline bool i2c_compute_timing(uint32_t hz, i2c_timing_t* p_timing)
+{
+    if (hz == 0) return false;
+    int half_cycle = I2C_SOURCE_HZ / hz / 2;
+
+    p_timing->scl_high    = half_cycle;
+    p_timing->scl_low     = half_cycle;
+    p_timing->start_setup = half_cycle;
+    p_timing->start_hold  = half_cycle;
+    p_timing->stop_setup  = half_cycle;
+    p_timing->stop_hold   = half_cycle;
+    p_timing->data_sample = half_cycle / 2;
+    p_timing->data_hold   = half_cycle / 2;
+    p_timing->timeout     = half_cycle * 20;
+
+    // Every value has to fit in its register
+    return half_cycle > 0
+        && p_timing->scl_low     <= I2C_MAX_PERIOD
+        && p_timing->start_setup <= I2C_MAX_TIMING
+        && p_timing->timeout     <= I2C_MAX_TIMEOUT;
+}
+//=========================================================================================================
@@ -0,0 +1,292 @@
+//=========================================================================================================
+// kv_store.cpp - Implements a key/value store for named records in flash memory
+//=========================================================================================================
+#include <stdlib.h>
+#include "globals.h"
+
+
+//=========================================================================================================
+// index_callback() - Called by FlashIO.list() once for every blob in flash
+//=========================================================================================================
+static void index_callback(const char* nvs_namespace, const char* key, size_t length, void* context)
+{
+    ((CKVStore*)context)->add_to_index(nvs_namespace, key, length);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// init() - Builds the RAM index of every record in flash
+//=========================================================================================================
+void CKVStore::init()
+{
+    // Create the mutex that we will use to ensure thread-safe access to the index
+    m_mutex = xSemaphoreCreateMutex();
+
+    // Our index starts out empty
+    memset(m_index, 0, sizeof m_index);
+    m_count     = 0;
+    m_unindexed = 0;
+
+    // Add every blob in every namespace to the index
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    FlashIO.list(nullptr, index_callback, this);
+    xSemaphoreGive(m_mutex);
+
+    // Tell the engineer how many records we found
+    printf("KV store has %i records\n", m_count + m_unindexed);
+    if (m_unindexed) printf("*** KV index is full: %i records will be read straight from flash\n", m_unindexed);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// add_to_index() - Adds a record to the index
+//
+// On Entry: the caller is holding m_mutex
+//=========================================================================================================
+void CKVStore::add_to_index(const char* nvs_namespace, const char* key, size_t length)
+{
+    // If the index is full, we can't add another record.  get() will still find it in flash
+    if (m_count >= KV_MAX_ENTRIES)
+    {
+        ++m_unindexed;
+        return;
+    }
+
+    // Fill in the next free entry in the index
+    kv_entry_t* p_entry = m_index + m_count++;
+    strncpy(p_entry->nvs_namespace, nvs_namespace, KV_MAX_NAME_LEN);
+    strncpy(p_entry->key,           key,           KV_MAX_NAME_LEN);
+    p_entry->nvs_namespace[KV_MAX_NAME_LEN] = 0;
+    p_entry->key[KV_MAX_NAME_LEN]           = 0;
+    p_entry->size  = length;
+    p_entry->cache = nullptr;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// find() - Returns a pointer to the index entry for the specified record, or nullptr
+//
+// On Entry: the caller is holding m_mutex
+//=========================================================================================================
+kv_entry_t* CKVStore::find(const char* nvs_namespace, const char* key)
+{
+    for (int i=0; i<m_count; ++i)
+    {
+        kv_entry_t* p_entry = m_index + i;
+        if (strcmp(p_entry->key, key) == 0 && strcmp(p_entry->nvs_namespace, nvs_namespace) == 0) return p_entry;
+    }
+    return nullptr;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// is_writable() - Returns 'true' if the caller is allowed to create/modify/erase this record
+//
+// The default namespace belongs to CNVS, so it is read-only through this interface
+//=========================================================================================================
+bool CKVStore::is_writable(const char* nvs_namespace, const char* key)
+{
+    // Namespaces and keys must exist, and NVS limits them to 15 characters
+    if (nvs_namespace[0] == 0 || strlen(nvs_namespace) > KV_MAX_NAME_LEN) return false;
+    if (key[0]           == 0 || strlen(key)           > KV_MAX_NAME_LEN) return false;
+
+    // Nobody gets to scribble on the data structure that CNVS manages
+    return strcmp(nvs_namespace, FLASH_DEFAULT_NAMESPACE) != 0;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// size() - Returns the size of a record in bytes, or -1 if the record doesn't exist
+//=========================================================================================================
+int CKVStore::size(const char* nvs_namespace, const char* key)
+{
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    kv_entry_t* p_entry = find(nvs_namespace, key);
+    int result = p_entry ? (int)p_entry->size : -1;
+    xSemaphoreGive(m_mutex);
+    return result;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get() - Reads a record into the caller's buffer
+//
+// Passed: nvs_namespace = The namespace of the record
+//         key           = The name of the record
+//         buffer        = Where to store the record
+//         max_length    = The size of the buffer
+//         p_length      = If not nullptr, filled in with the size of the record
+//
+// Returns: 'true' if the record exists and fit into the buffer
+//=========================================================================================================
+bool CKVStore::get(const char* nvs_namespace, const char* key, void* buffer, size_t max_length, size_t* p_length)
+{
+    bool   status = false;
+    size_t length = 0;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // Find this record in the index.  CNVS writes the default namespace without telling us, so what
+    // the index says about those records can't be trusted
+    kv_entry_t* p_entry = nullptr;
+    if (strcmp(nvs_namespace, FLASH_DEFAULT_NAMESPACE) != 0) p_entry = find(nvs_namespace, key);
+
+    // If the record isn't in the index, it may still be in flash
+    if (p_entry == nullptr)
+    {
+        status = FlashIO.read_blob(nvs_namespace, key, buffer, max_length, &length);
+        goto done;
+    }
+
+    // If the record won't fit in the caller's buffer, we're done
+    if (p_entry->size > max_length) goto done;
+    length = p_entry->size;
+
+    // If we have this record cached, just hand the caller a copy
+    if (p_entry->cache)
+    {
+        memcpy(buffer, p_entry->cache, p_entry->size);
+        status = true;
+        goto done;
+    }
+
+    // Otherwise, fetch it from flash
+    status = FlashIO.read_blob(nvs_namespace, key, buffer, max_length);
+
+    // If this is a small record, cache it so we don't have to go back to flash next time
+    if (status && p_entry->size <= KV_MAX_CACHED_SIZE)
+    {
+        p_entry->cache = (U8*)malloc(p_entry->size ? p_entry->size : 1);
+        if (p_entry->cache) memcpy(p_entry->cache, buffer, p_entry->size);
+    }
+
+done:
+
+    // Tell the caller how big the record is
+    if (p_length) *p_length = status ? length : 0;
+
+    xSemaphoreGive(m_mutex);
+    return status;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// put() - Creates or replaces a record
+//=========================================================================================================
+bool CKVStore::put(const char* nvs_namespace, const char* key, const void* buffer, size_t length)
+{
+    bool status = false;
+
+    // Make sure the caller is allowed to write this record
+    if (!is_writable(nvs_namespace, key)) return false;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // Find this record in the index
+    kv_entry_t* p_entry = find(nvs_namespace, key);
+
+    // Write the record to flash
+    status = FlashIO.write_blob(nvs_namespace, key, buffer, length);
+    if (!status) goto done;
+
+    // If this record isn't in the index and there's no room to add it, get() will find it in flash
+    if (p_entry == nullptr && m_count >= KV_MAX_ENTRIES) goto done;
+
+    // If this is a new record, add it to the index
+    if (p_entry == nullptr)
+    {
+        add_to_index(nvs_namespace, key, length);
+        p_entry = m_index + m_count - 1;
+    }
+
+    // Throw away any stale cached copy of this record
+    free(p_entry->cache);
+    p_entry->cache = nullptr;
+
+    // Keep track of the new size of the record
+    p_entry->size = length;
+
+    // If this is a small record, cache it
+    if (length <= KV_MAX_CACHED_SIZE)
+    {
+        p_entry->cache = (U8*)malloc(length ? length : 1);
+        if (p_entry->cache) memcpy(p_entry->cache, buffer, length);
+    }
+
+done:
+    xSemaphoreGive(m_mutex);
+    return status;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// erase() - Deletes a record
+//=========================================================================================================
+bool CKVStore::erase(const char* nvs_namespace, const char* key)
+{
+    bool status = false;
+
+    // Make sure the caller is allowed to erase this record
+    if (!is_writable(nvs_namespace, key)) return false;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // Find this record in the index
+    kv_entry_t* p_entry = find(nvs_namespace, key);
+
+    // Erase the record from flash.  Even if it isn't in the index, it may be in flash
+    status = FlashIO.erase_blob(nvs_namespace, key);
+    if (!status || p_entry == nullptr) goto done;
+
+    // Throw away any cached copy of this record
+    free(p_entry->cache);
+
+    // Remove this entry from the index by moving the last entry into its place
+    *p_entry = m_index[--m_count];
+
+done:
+    xSemaphoreGive(m_mutex);
+    return status;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// for_each() - Calls the callback for every record in a namespace
+//
+// Passed: nvs_namespace = The namespace of interest, or nullptr for "every namespace"
+//         callback      = The routine to call for each record.  It must not call back into KV
+//         context       = Arbitrary pointer that is handed to the callback
+//
+// Returns: The number of records found
+//=========================================================================================================
+int CKVStore::for_each(const char* nvs_namespace, void (*callback)(const kv_entry_t*, void*), void* context)
+{
+    int count = 0;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    for (int i=0; i<m_count; ++i)
+    {
+        kv_entry_t* p_entry = m_index + i;
+
+        // If the caller is only interested in one namespace, skip the records in other namespaces
+        if (nvs_namespace && strcmp(p_entry->nvs_namespace, nvs_namespace) != 0) continue;
+
+        // Hand this record to the caller
+        callback(p_entry, context);
+        ++count;
+    }
+
+    xSemaphoreGive(m_mutex);
+    return count;
+}
+//=========================================================================================================
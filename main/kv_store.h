@@ -0,0 +1,99 @@
+//=========================================================================================================
+// kv_store.h - Defines a key/value store for named records in flash memory
+//
+// Records are NVS blobs, addressed by a namespace and a key (each 15 characters max).  An index of every
+// record and its size is built in RAM at boot, and small records are cached in RAM, so that most
+// lookups never have to touch flash.  A record that isn't in the index (because the index was full,
+// or because the record was written behind our back) is still read from flash; only size() and
+// for_each() are limited to the records in the index.  Records in the default namespace belong to
+// CNVS, which writes them directly, so they are always read from flash.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+
+// The maximum number of records the index can hold
+#define KV_MAX_ENTRIES     64
+
+// Records this size or smaller are cached in RAM after they're first read or written
+#define KV_MAX_CACHED_SIZE 64
+
+// NVS limits namespace and key names to 15 characters
+#define KV_MAX_NAME_LEN    15
+
+
+//=========================================================================================================
+// One of these exists in the RAM index for every record in flash
+//=========================================================================================================
+struct kv_entry_t
+{
+    char    nvs_namespace[KV_MAX_NAME_LEN + 1];
+    char    key[KV_MAX_NAME_LEN + 1];
+    U32     size;
+    U8*     cache;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CKVStore - Singleton class, manages named records in flash
+//=========================================================================================================
+class CKVStore
+{
+public:
+
+    // Call this once at startup (after FlashIO.begin()) to build the index
+    void    init();
+
+    // Returns the size of a record, or -1 if it doesn't exist
+    int     size(const char* nvs_namespace, const char* key);
+
+    // Reads a record into the caller's buffer.  Fails if the record doesn't exist or doesn't fit
+    bool    get(const char* nvs_namespace, const char* key, void* buffer, size_t max_length, size_t* p_length = nullptr);
+
+    // Creates or replaces a record
+    bool    put(const char* nvs_namespace, const char* key, const void* buffer, size_t length);
+
+    // Deletes a record
+    bool    erase(const char* nvs_namespace, const char* key);
+
+    // Calls the callback for every record in the specified namespace (or every namespace if nullptr)
+    int     for_each(const char* nvs_namespace, void (*callback)(const kv_entry_t*, void*), void* context);
+
+    // Typed convenience wrappers.  A "get" fails unless the record is exactly the size of the value
+    template <class T> bool get(const char* nvs_namespace, const char* key, T& value)
+    {
+        size_t length;
+        return get(nvs_namespace, key, &value, sizeof value, &length) && length == sizeof value;
+    }
+
+    template <class T> bool put(const char* nvs_namespace, const char* key, const T& value)
+    {
+        return put(nvs_namespace, key, &value, sizeof value);
+    }
+
+public:
+
+    // This is called by FlashIO.list() while the index is being built
+    void    add_to_index(const char* nvs_namespace, const char* key, size_t length);
+
+protected:
+
+    // Returns a pointer to the index entry for a record, or nullptr if there isn't one
+    kv_entry_t* find(const char* nvs_namespace, const char* key);
+
+    // Returns 'true' if the namespace and key are legal for a record we're allowed to modify
+    bool        is_writable(const char* nvs_namespace, const char* key);
+
+    // The index of every record in flash
+    kv_entry_t  m_index[KV_MAX_ENTRIES];
+
+    // The number of entries in m_index[] that are in use
+    int         m_count;
+
+    // The number of records found at boot that didn't fit in the index
+    int         m_unindexed;
+
+    // This is the handle to the mutex that ensures thread-safe access to the index
+    SemaphoreHandle_t   m_mutex;
+};
+//=========================================================================================================
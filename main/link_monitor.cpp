@@ -0,0 +1,213 @@
+//=========================================================================================================
+// link_monitor.cpp - Implements a background sampler that records the quality of our Wi-Fi link
+//=========================================================================================================
+#include "esp_wifi.h"
+#include "globals.h"
+
+// This protects the ring buffer, which is written by the timer and read by everyone else
+static portMUX_TYPE ring_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+//=========================================================================================================
+// timer_cb() - Called by the ESP timer once per sampling interval
+//=========================================================================================================
+static void timer_cb(void*)
+{
+    LinkMon.take_sample();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// init() - Creates the sampling timer and starts it
+//=========================================================================================================
+void CLinkMonitor::init()
+{
+    // The ring buffer starts out empty
+    m_head           = 0;
+    m_count          = 0;
+    m_pending_reason = 0;
+    m_prior_attempts = Network.reconnect_stats().attempts;
+
+    // Create the timer that takes our samples
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof timer_args);
+    timer_args.callback = timer_cb;
+    timer_args.name     = "linkmon";
+    esp_timer_create(&timer_args, &m_timer);
+
+    // And start sampling at the default rate
+    m_interval_ms = 0;
+    set_interval(LINKMON_DEFAULT_MS);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// set_interval() - Changes the sampling interval
+//=========================================================================================================
+void CLinkMonitor::set_interval(U32 interval_ms)
+{
+    // Don't let anyone sample so quickly that it bogs the system down
+    if (interval_ms < LINKMON_MIN_MS) interval_ms = LINKMON_MIN_MS;
+
+    // If nothing is changing, there's nothing to do
+    if (interval_ms == m_interval_ms) return;
+
+    // Restart the timer at the new rate
+    m_interval_ms = interval_ms;
+    esp_timer_stop(m_timer);
+    esp_timer_start_periodic(m_timer, (U64)interval_ms * 1000);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// note_disconnect() - Records a disconnect reason.  It will be attached to the next sample
+//=========================================================================================================
+void CLinkMonitor::note_disconnect(int reason)
+{
+    portENTER_CRITICAL(&ring_mux);
+    m_pending_reason = (U16)reason;
+    portEXIT_CRITICAL(&ring_mux);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// take_sample() - Samples the link and stores the result in the ring buffer
+//=========================================================================================================
+void CLinkMonitor::take_sample()
+{
+    wifi_ap_record_t ap;
+    link_sample_t    sample;
+
+    memset(&sample, 0, sizeof sample);
+    sample.time_ms = (U32)(esp_timer_get_time() / 1000);
+    sample.rssi    = LINKMON_NO_RSSI;
+
+    // If we're connected to an access point, find out what the link looks like
+    if (Network.wifi_status() == WIFI_CONNECTED && esp_wifi_sta_get_ap_info(&ap) == ESP_OK)
+    {
+        sample.rssi    = ap.rssi;
+        sample.channel = ap.primary;
+        if (ap.phy_11b) sample.phy |= LINKMON_PHY_11B;
+        if (ap.phy_11g) sample.phy |= LINKMON_PHY_11G;
+        if (ap.phy_11n) sample.phy |= LINKMON_PHY_11N;
+        if (ap.phy_lr ) sample.phy |= LINKMON_PHY_LR;
+    }
+
+    // Find out how many connection attempts have been made since the previous sample
+    U32 attempts   = Network.reconnect_stats().attempts;
+    U32 retries    = attempts - m_prior_attempts;
+    sample.retries = retries > 255 ? 255 : retries;
+    m_prior_attempts = attempts;
+
+    // Store the sample in the ring buffer, along with any disconnect reason that's pending
+    portENTER_CRITICAL(&ring_mux);
+    sample.disconnect_reason = m_pending_reason;
+    m_pending_reason = 0;
+    m_ring[m_head] = sample;
+    if (++m_head == LINKMON_RING_SIZE) m_head = 0;
+    if (m_count < LINKMON_RING_SIZE) ++m_count;
+    portEXIT_CRITICAL(&ring_mux);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// count() - Returns the number of samples in the ring buffer
+//=========================================================================================================
+int CLinkMonitor::count()
+{
+    return m_count;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get_sample() - Fetches a sample from the ring buffer
+//
+// Passed: index    = Which sample to fetch.  0 is the oldest
+//         p_sample = Where to store the sample
+//
+// Returns: 'false' if there is no such sample
+//=========================================================================================================
+bool CLinkMonitor::get_sample(int index, link_sample_t* p_sample)
+{
+    bool status = false;
+
+    portENTER_CRITICAL(&ring_mux);
+    if (index >= 0 && index < m_count)
+    {
+        int slot = m_head - m_count + index;
+        if (slot < 0) slot += LINKMON_RING_SIZE;
+        *p_sample = m_ring[slot];
+        status = true;
+    }
+    portEXIT_CRITICAL(&ring_mux);
+
+    return status;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get_stats() - Computes statistics over the samples in the ring buffer
+//
+// The percentiles come from a histogram of RSSI values, so no sorting (or memory) is needed
+//=========================================================================================================
+void CLinkMonitor::get_stats(link_stats_t* p_stats)
+{
+    U16 histogram[128];
+    link_sample_t sample;
+    S32 rssi_sum = 0;
+
+    memset(p_stats, 0, sizeof *p_stats);
+    memset(histogram, 0, sizeof histogram);
+    p_stats->rssi_min = p_stats->rssi_avg = p_stats->rssi_max = LINKMON_NO_RSSI;
+    p_stats->rssi_p10 = p_stats->rssi_p50 = p_stats->rssi_p90 = LINKMON_NO_RSSI;
+
+    // Walk through every sample in the ring buffer
+    int count = m_count;
+    for (int i=0; i<count && get_sample(i, &sample); ++i)
+    {
+        ++p_stats->samples;
+        p_stats->retries += sample.retries;
+        if (sample.disconnect_reason) ++p_stats->disconnects;
+
+        // Samples taken while we weren't connected don't count toward the RSSI statistics
+        if (sample.rssi == LINKMON_NO_RSSI || sample.rssi >= 0) continue;
+
+        // Keep track of the minimum and maximum
+        if (p_stats->connected == 0 || sample.rssi < p_stats->rssi_min) p_stats->rssi_min = sample.rssi;
+        if (p_stats->connected == 0 || sample.rssi > p_stats->rssi_max) p_stats->rssi_max = sample.rssi;
+
+        // Accumulate the average and the histogram
+        rssi_sum += sample.rssi;
+        ++histogram[-sample.rssi];
+        ++p_stats->connected;
+    }
+
+    // If we weren't connected for any of those samples, there are no RSSI statistics
+    if (p_stats->connected == 0) return;
+
+    // Compute the average
+    p_stats->rssi_avg = rssi_sum / (S32)p_stats->connected;
+
+    // Walk the histogram from the weakest RSSI to the strongest to find the percentiles
+    U32 p10 = (p_stats->connected * 10 + 99) / 100;
+    U32 p50 = (p_stats->connected * 50 + 99) / 100;
+    U32 p90 = (p_stats->connected * 90 + 99) / 100;
+    U32 seen = 0;
+    for (int i=127; i>0; --i)
+    {
+        if (histogram[i] == 0) continue;
+        U32 prior = seen;
+        seen += histogram[i];
+        if (prior < p10 && seen >= p10) p_stats->rssi_p10 = -i;
+        if (prior < p50 && seen >= p50) p_stats->rssi_p50 = -i;
+        if (prior < p90 && seen >= p90) p_stats->rssi_p90 = -i;
+    }
+}
+//=========================================================================================================
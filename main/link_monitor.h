@@ -0,0 +1,120 @@
+//=========================================================================================================
+// link_monitor.h - Defines a background sampler that records the quality of our Wi-Fi link
+//
+// A timer samples the link at a configurable rate and stores each sample in a fixed-size ring buffer,
+// so that the recent history of RF conditions is always available for correlating with throughput
+// problems.  Disconnect reasons reported by the network code are attached to the next sample.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+#include "esp_timer.h"
+
+// The number of samples the ring buffer holds
+#define LINKMON_RING_SIZE       300
+
+// The default sampling interval
+#define LINKMON_DEFAULT_MS      1000
+
+// The fastest sampling interval we allow
+#define LINKMON_MIN_MS          100
+
+// This is stored in the "rssi" field of a sample taken while we're not connected to an access point
+#define LINKMON_NO_RSSI         -127
+
+// These are the bits in the "phy" field of a sample
+#define LINKMON_PHY_11B         0x01
+#define LINKMON_PHY_11G         0x02
+#define LINKMON_PHY_11N         0x04
+#define LINKMON_PHY_LR          0x08
+
+
+//=========================================================================================================
+// One of these is recorded for each sample
+//=========================================================================================================
+struct link_sample_t
+{
+    U32     time_ms;            // Milliseconds since boot
+    S8      rssi;               // Signal strength, or LINKMON_NO_RSSI if we're not connected
+    U8      channel;            // The primary channel of our access point
+    U8      phy;                // LINKMON_PHY_xxx bits supported by the link
+    U8      retries;            // Connection attempts made since the previous sample
+    U16     disconnect_reason;  // The most recent disconnect reason since the previous sample, or 0
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// Summary statistics about the samples currently in the ring buffer
+//=========================================================================================================
+struct link_stats_t
+{
+    U32     samples;            // The number of samples in the ring buffer
+    U32     connected;          // How many of those were taken while we were connected
+    U32     disconnects;        // The number of disconnects recorded in the ring buffer
+    U32     retries;            // The number of connection attempts recorded in the ring buffer
+    S8      rssi_min;
+    S8      rssi_avg;
+    S8      rssi_max;
+    S8      rssi_p10;           // 10% of connected samples were at or below this
+    S8      rssi_p50;           // The median
+    S8      rssi_p90;           // 90% of connected samples were at or below this
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CLinkMonitor - Singleton class, samples and records the quality of the Wi-Fi link
+//=========================================================================================================
+class CLinkMonitor
+{
+public:
+
+    // Call this once at startup to begin sampling
+    void    init();
+
+    // Changes the sampling interval
+    void    set_interval(U32 interval_ms);
+
+    // Returns the sampling interval
+    U32     interval() {return m_interval_ms;}
+
+    // The network code calls this when we lose our connection or a connection attempt fails
+    void    note_disconnect(int reason);
+
+    // Returns the number of samples in the ring buffer
+    int     count();
+
+    // Fetches a sample.  Index 0 is the oldest sample in the ring buffer.  Returns 'false' if there
+    // is no such sample
+    bool    get_sample(int index, link_sample_t* p_sample);
+
+    // Computes statistics over the samples in the ring buffer
+    void    get_stats(link_stats_t* p_stats);
+
+public:
+
+    // This is called by the timer.  It shouldn't be called externally
+    void    take_sample();
+
+protected:
+
+    // The ring buffer of samples
+    link_sample_t       m_ring[LINKMON_RING_SIZE];
+
+    // The index where the next sample will be stored, and the number of samples in the ring
+    int                 m_head;
+    int                 m_count;
+
+    // The most recent disconnect reason since the last sample, or 0
+    U16                 m_pending_reason;
+
+    // The number of connection attempts the network code had made as of the previous sample
+    U32                 m_prior_attempts;
+
+    // The sampling interval
+    U32                 m_interval_ms;
+
+    // This timer fires once per sampling interval
+    esp_timer_handle_t  m_timer;
+};
+//=========================================================================================================
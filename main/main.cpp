@@ -17,41 +17,68 @@ static const char *EXE_TAG = "$$$>>>EXE_VERSION:" FW_VERSION;
 
 
 //=========================================================================================================
-// cpp_main() - Execution begins here, with the FreeRTOS kernel already running
+// These are the boot steps that cpp_main() hands to the boot sequencer
 //=========================================================================================================
-void cpp_main()
-{
-    // This is a compile-time check to ensure that the size of the NVS data structure hasn't
-    // been inadvertently changed
-    BUILD_BUG_ON(sizeof(NVS.data) != 1024);
 
-    // Initialze the TCP/IP stack.  This has to be done first because NVS.init() needs our MAC address    
+// Initialze the TCP/IP stack and the system event loop, and start the task that handles network events
+static void boot_netif()
+{
     esp_netif_init();
-
-    // We need a system event loop
     esp_event_loop_create_default();
+    Network.begin();
+}
 
-    // This is a high priorty task that manages flash read/writes for us
-    FlashIO.begin();
+// This is a high priorty task that manages flash read/writes for us
+static void boot_flashio()   {FlashIO.begin();}
 
-     // Initialize non-volatile storage in flash memory
-    NVS.init();
+// Initialize non-volatile storage in flash memory.  This needs our MAC address from the TCP/IP stack
+static void boot_nvs()       {NVS.init();}
 
-    // Start the GPIO ISR service that will handle all GPIO interrupts
-    gpio_install_isr_service(0);
+// Build the index of named records in flash
+static void boot_kv()        {KV.init();}
 
-    // Create the SSID we'll use in Wi-Fi AP mode
-    System.create_ssid();
+// Recover the event log and start the task that writes it to flash
+static void boot_eventlog()  {EventLog.init();}
 
-    // Tell any software watching the serial port what firmware version we are
-    printf("%s\n", EXE_TAG);
+// Map the read-only data tables into our address space
+static void boot_tables()    {DataTables.init();}
+
+// Create the empty scan cache.  The network consults it as soon as it starts
+static void boot_scancache() {ScanCache.init();}
+
+// Start the background Wi-Fi scans that keep the scan cache fresh
+static void boot_scan()      {ScanCache.start();}
+
+// Put the power-save policy from NVS into effect
+static void boot_power()     {PowerMgr.init();}
+
+// Start recording the quality of the Wi-Fi link
+static void boot_linkmon()   {LinkMon.init();}
 
-    // Initialize the provisioning button
-    ProvButton.init(PIN_PROV_BUTTON);
+// Start the GPIO ISR service that will handle all GPIO interrupts
+static void boot_gpio_isr()  {gpio_install_isr_service(0);}
 
-    // Configure the I2C bus.   This must be done before initializing I2C peripherals
+// Create the SSID we'll use in Wi-Fi AP mode
+static void boot_ssid()      {System.create_ssid();}
+
+// Initialize the provisioning button
+static void boot_button()    {ProvButton.init(PIN_PROV_BUTTON);}
+
+// Configure the I2C bus, start the task that performs I2C transactions asynchronously, and get 
+// the sensor scheduler and EEPROM driver ready.   This must be done before initializing I2C peripherals
+static void boot_i2c()
+{
     I2C.init(I2C_NUM_0, PIN_I2C_SDA, PIN_I2C_SCL);
+    I2CEngine.begin(&I2C);
+    Sensors.init();
+    Eeprom.init(&I2C);
+}
 
+//=========================================================================================================
+// boot_network() - Starts the Wi-Fi in either STA or AP mode
+//=========================================================================================================
+static void boot_network()
+{
     // Find out if we should start the Wi-Fi in "Access-Point" mode
     bool start_as_ap = ProvButton.is_pressed()       ||
                        NVS.data.network_ssid[0] == 0 ||
@@ -67,7 +94,43 @@ void cpp_main()
         Network.start_as_ap(AP_MODE_DEFAULT);
     else
         Network.start();
-    
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// cpp_main() - Execution begins here, with the FreeRTOS kernel already running
+//=========================================================================================================
+void cpp_main()
+{
+    // This is a compile-time check to ensure that the size of the NVS data structure hasn't
+    // been inadvertently changed
+    BUILD_BUG_ON(sizeof(NVS.data) != 1024);
+
+    // Tell any software watching the serial port what firmware version we are
+    printf("%s\n", EXE_TAG);
+
+    // Describe each boot step, along with the steps it can't start before.  Steps that don't depend
+    // on each other run concurrently.  "Deferred" steps aren't needed to get the network up, so 
+    // they are allowed to finish in the background.
+    U32 netif    = BootSeq.add("netif",    boot_netif);
+    U32 flashio  = BootSeq.add("flashio",  boot_flashio);
+    U32 nvs      = BootSeq.add("nvs",      boot_nvs,      netif | flashio);
+    U32 gpio_isr = BootSeq.add("gpio_isr", boot_gpio_isr);
+    U32 ssid     = BootSeq.add("ssid",     boot_ssid);
+    U32 button   = BootSeq.add("button",   boot_button,   gpio_isr);
+    U32 kv       = BootSeq.add("kv",       boot_kv,       nvs);
+                   BootSeq.add("eventlog", boot_eventlog, flashio, true);
+                   BootSeq.add("tables",   boot_tables,   0,       true);
+                   BootSeq.add("i2c",      boot_i2c);
+    U32 power    = BootSeq.add("power",    boot_power,    netif | nvs);
+    U32 cache    = BootSeq.add("cache",    boot_scancache);
+    U32 network  = BootSeq.add("network",  boot_network,  netif | nvs | kv | ssid | button | power | cache);
+                   BootSeq.add("scan",     boot_scan,     network, true);
+                   BootSeq.add("linkmon",  boot_linkmon,  netif,   true);
+
+    // Run the boot steps, and wait for every step that isn't deferred to complete
+    BootSeq.run();
 
     // Start the main periodic task
     xTaskCreatePinnedToCore(periodic_task, "main", 3 * 1024, nullptr, DEFAULT_TASK_PRI, NULL, TASK_CPU);
@@ -131,6 +194,12 @@ void do_periodic()
     {
         System.reboot(true);
     }
+
+    // Let the power-save mode step down as the command server goes quiet
+    PowerMgr.update();
+
+    // Keep the status we advertise over mDNS up to date
+    Network.update_mdns();
 }
 //=========================================================================================================
 
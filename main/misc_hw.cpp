@@ -60,7 +60,10 @@ void CDigitalOut::set(bool state)
 int CSystem::rssi()
 {
     wifi_ap_record_t wifidata;
-    esp_wifi_sta_get_ap_info(&wifidata);
+
+    // If we're not connected to an access point, there's no signal to report
+    if (esp_wifi_sta_get_ap_info(&wifidata) != ESP_OK) return LINKMON_NO_RSSI;
+
     return wifidata.rssi;
 }
 //=========================================================================================================
@@ -154,6 +157,13 @@ void CSystem::reboot(bool force_wifi_ap)
     // If the caller wants to start in Wi-Fi AP mode, make it so
     if (force_wifi_ap) NVRAM.start_wifi_ap = true;
 
+    // Record the reboot in the event log, and save any settings that haven't been saved yet.  These
+    // go in the urgent flash lane so that they don't wait behind background erases and writes
+    U8 is_ap = force_wifi_ap;
+    EventLog.append(EVTLOG_TYPE_REBOOT, &is_ap, sizeof is_ap);
+    EventLog.flush(FLASH_LANE_URGENT);
+    if (NVS.is_dirty()) NVS.write_to_flash(FLASH_LANE_URGENT);
+
     // Disconnect from the router.  We have to do this or some routers won't let us
     // reconnect right away
     esp_wifi_disconnect();
@@ -44,12 +44,15 @@ public:
     {
         has_current_time         = false;
         is_rebooting             = false;
+        ip_addr[0]               = 0;
+        ip6_link_local[0]        = 0;
+        ip6_global[0]            = 0;
     }
 
     // Create the SSID we'll broadcast in AP mode
     void    create_ssid();
 
-    // Fetches the RSSI of the router we're connected to
+    // Fetches the RSSI of the router we're connected to, or LINKMON_NO_RSSI if we're not connected
     int     rssi();
 
     // Reboots the system
@@ -73,5 +76,9 @@ public:
     // This is our IP address as an ASCII string
     char    ip_addr[16];
 
+    // These are our IPv6 link-local and global addresses as ASCII strings, or empty if we don't have one
+    char    ip6_link_local[40];
+    char    ip6_global[40];
+
 };
 //=========================================================================================================
@@ -12,25 +12,20 @@
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
-#include "lwip/apps/sntp.h"
 #include "globals.h"
 #include "mdns.h"
+#include "history.h"
 
 
 // These are the three kinds of ways we can start the WiFi
 enum wifi_start_t {WIFI_START_STA, WIFI_START_AP, WIFI_START_TEST};
 
-// Enumerates which event handler to use
-enum evt_handler_type_t {NO_HANDLER, MAIN_HANDLER, TEST_HANDLER};
-
 // This is defined in "ble_server.cpp"
 void ble_server_begin();
 
-// This will be true after the WiFi connection test completes
-static int wifi_test_status = 0;
-
-// If the Wifi-credentials test fails, this is the "disconnect reason"
-static int test_fail_reason = 0;
+// While testing Wi-Fi credentials or scanning in AP mode, this is the station interface that runs
+// alongside the AP
+static esp_netif_t* apsta_interface = nullptr;
 
 // This is the tag used for logging
 static const char* WIFI_TAG = "Network";
@@ -50,6 +45,49 @@ static int  bad_password_count = 0;
 // This specifies which event handler to use
 static evt_handler_type_t evt_handler_type = NO_HANDLER;
 
+// Every credentials test gets a new sequence number, and every event destined for the test event 
+// handler is stamped with it.  This is how events left over from an earlier test are recognized
+static volatile U32 test_seq = 0;
+
+// This protects the starting of a credentials test against two tasks starting one at once
+static portMUX_TYPE test_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// The first reconnection attempt after an outage is made after this many milliseconds.  The delay
+// doubles with each failed attempt, up to RECONNECT_MAX_MS, and is randomized by +/- 25%
+static const U32 RECONNECT_BASE_MS = 100;
+static const U32 RECONNECT_MAX_MS  = 30000;
+
+// This many reconnection attempts go straight to the cached access point before we fall back to
+// a full scan, in case the access point has moved to a different channel
+static const int FAST_RECONNECT_TRIES = 3;
+
+// This is the "disconnect reason" reported when the access point can't be found
+static const int REASON_NO_AP_FOUND = 201;
+
+// When our signal drops below this, we look for a better access point to roam to
+static const int ROAM_RSSI_THRESHOLD = -72;
+
+// We only roam to an access point that's at least this much stronger than the one we're on
+static const int ROAM_HYSTERESIS_DB = 8;
+
+// We never roam more often than this, so that we can't ping-pong between two access points
+static const U32 ROAM_MIN_INTERVAL_MS = 60000;
+
+// Scan results older than this aren't trusted when choosing a network
+static const U32 SCAN_MAX_AGE_MS = 2 * SCAN_INTERVAL_MS;
+
+// The mDNS service type that advertises our command server
+#define MDNS_SERVICE "_framework"
+
+// The number of provisioning clients that can be connected to our access point at once
+static const int AP_MAX_CLIENTS = 4;
+
+// In AP mode, we check for inactivity this often
+static const U32 AP_CHECK_MS = 5000;
+
+// We only move our access point to a quieter channel if it's quieter by at least this much
+static const int AP_CHANNEL_MARGIN = 20;
+
 
 //=========================================================================================================
 // safe_wifi_start() - performs an esp_wifi_start, stopping the wifi first if it's already running
@@ -91,277 +129,667 @@ void safe_wifi_stop()
 
 
 //=========================================================================================================
-// get_time_via_ntp() - Fetches the time from an NTP server on the internet
+// setup_mdns() - Start advertising our mDNS name and our command server over the network
+//
+// Fleet tools find us with a single query for MDNS_SERVICE.  The TXT records tell them our firmware
+// version and status without having to connect
 //=========================================================================================================
-void get_time_via_ntp()
-{
-    time_t now = 0;
-    struct tm timeinfo;
-
-    ESP_LOGI(WIFI_TAG, "Initializing SNTP");
-    sntp_stop();
-    sntp_setoperatingmode(SNTP_OPMODE_POLL);
-    sntp_setservername(0, (char*)"pool.ntp.org");
-    
-    // This runs in another thread, and will set up the system time when it obtains one via NTP
-    sntp_init();
+static bool is_mdns_started = false;
+static void setup_mdns()
+{  
+    // We only need to do this once.  mDNS follows our interfaces as they come and go
+    if (is_mdns_started) return;
 
-    // Initialize the timeinfo structure to all zeros
-    memset(&timeinfo, 0, sizeof timeinfo);
+    // Start mDNS and give ourselves a name
+    if (mdns_init() != ESP_OK) return;
+    mdns_hostname_set(System.ssid);
+    mdns_instance_name_set(System.ssid);
 
-    // We're going to wait up to 20 secondss to get fetch the time via NTP
-    for (int i=0; i<20; ++i)
+    // Advertise the command server
+    mdns_txt_item_t txt[] =
     {
-        // Wait a second while NTP does its thing in the background
-        msdelay(1000);
+        {"fw",     FW_VERSION},
+        {"status", Network.mdns_status()}
+    };
+    mdns_service_add(nullptr, MDNS_SERVICE, "_tcp", TCPServer.port(), txt, sizeof txt / sizeof txt[0]);
+    is_mdns_started = true;
+}
+//=========================================================================================================
 
-        // Fetch the current time (which we hope NTP has filled in for us)
-        time(&now);
 
-        // Break that out to the "timeinfo" structure
-        localtime_r(&now, &timeinfo);
 
-        // If NTP just updated our internal date/time structure, we know what time it is!
-        if (timeinfo.tm_year >= 100)
-        {
-            System.has_current_time = true;
-            printf("The current year is %i\n", timeinfo.tm_year + 1900);
-            break;
-        }
+
+//=========================================================================================================
+// get_credentials() - Fetches the credentials of one of the Wi-Fi networks stored in NVS
+//
+// Passed: index = 0 for the primary network, 1 thru NET_MAX_NETWORKS-1 for the alternates
+//
+// Returns: 'false' if there is no network stored at that index
+//=========================================================================================================
+static bool get_credentials(int index, const char** p_ssid, const char** p_pw, const char** p_user)
+{
+    // Network 0 is the primary network, which lives in the original NVS fields
+    if (index == 0)
+    {
+        *p_ssid = (const char*)NVS.data.network_ssid;
+        *p_pw   = NVS.data.network_pw;
+        *p_user = NVS.data.network_user;
+    }
+
+    // The others are the alternate networks
+    else if (index > 0 && index < NET_MAX_NETWORKS)
+    {
+        const net_cred_t& cred = NVS.data.alt_network[index - 1];
+        *p_ssid = (const char*)cred.ssid;
+        *p_pw   = cred.pw;
+        *p_user = cred.user;
     }
+
+    // Anything else isn't a network
+    else return false;
+
+    // A network without an SSID isn't configured
+    return (*p_ssid)[0] != 0;
 }
 //=========================================================================================================
 
 
 //=========================================================================================================
-// setup_mdns() - Start advertising our mDNS name over the network
+// network_ssid() - Returns the SSID of one of our stored networks, or an empty string
 //=========================================================================================================
-static void setup_mdns()
-{  
-   mdns_init();
-   mdns_hostname_set(System.ssid);
+static const char* network_ssid(int index)
+{
+    const char *ssid, *pw, *user;
+    return get_credentials(index, &ssid, &pw, &user) ? ssid : "";
 }
 //=========================================================================================================
 
 
+//=========================================================================================================
+// credentials_crc() - Returns a CRC of the SSID and password of one of our stored networks
+//=========================================================================================================
+static U32 credentials_crc(int index)
+{
+    const char *ssid, *pw, *user;
+    if (!get_credentials(index, &ssid, &pw, &user)) return 0;
+    U32 state = crc32_init();
+    state = crc32_update(state, ssid, strlen(ssid));
+    state = crc32_update(state, pw,   strlen(pw));
+    return crc32_final(state);
+}
+//=========================================================================================================
 
 
 //=========================================================================================================
-// event_handler() - This is the event handler that will be called by esp_wifi_start()
+// fill_sta_config() - Fills in a Wi-Fi configuration structure for connecting to the access point
+//
+// Passed: p_config      = The structure to fill in
+//         index         = Which of our stored networks to connect to
+//         use_cached_ap = If true, and NVRAM knows the BSSID and channel of the access point we were
+//                         most recently connected to with these credentials, connect straight to it
+//
+// Returns: 'true' if the configuration targets the cached access point
 //=========================================================================================================
-static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+static bool fill_sta_config(wifi_config_t* p_config, int index, bool use_cached_ap)
 {
-    switch (evt_handler_type)
-    {
-        case MAIN_HANDLER:        
-            Network.event_handler(event_base, event_id, event_data);
-            break;
+    const char *ssid, *pw, *user;
+
+    //  Fill in the WiFi configuration structure with our network SSID and password
+    memset(p_config, 0, sizeof(wifi_config_t));
+    if (!get_credentials(index, &ssid, &pw, &user)) return false;
+    strncpy((char*)p_config->sta.ssid,     ssid, sizeof p_config->sta.ssid);
+    strncpy((char*)p_config->sta.password, pw,   sizeof p_config->sta.password - 1);
 
-        case TEST_HANDLER:
-            Network.special_event_handler(event_base, event_id, event_data);
-            break;
+    // Let the access point send us 802.11k neighbor reports and 802.11v BSS-transition requests
+    p_config->sta.rm_enabled  = 1;
+    p_config->sta.btm_enabled = 1;
 
-        case NO_HANDLER:
-            break;
+    // In the lowest power mode, we wake up for every POWER_LISTEN_INTERVAL'th beacon
+    p_config->sta.listen_interval = POWER_LISTEN_INTERVAL;
+
+    // If we have to scan, check every channel and pick the strongest access point with this SSID
+    p_config->sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    p_config->sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+
+    // If we have a username, assume we're using WPA2/Enterprise
+    if (*user)
+    {
+        esp_wifi_sta_wpa2_ent_set_username((uint8_t *)user, strlen(user));
+        esp_wifi_sta_wpa2_ent_set_password((uint8_t *)pw,   strlen(pw));
     }
+
+    // If we don't know where the access point is, we're done.  The driver will scan for it
+    if (!use_cached_ap || !NVRAM.wifi_cache_valid || NVRAM.wifi_cred_crc != credentials_crc(index)) return false;
+
+    // Connect straight to the cached access point, skipping the scan of every channel
+    p_config->sta.bssid_set   = true;
+    p_config->sta.channel     = NVRAM.wifi_channel;
+    p_config->sta.scan_method = WIFI_FAST_SCAN;
+    memcpy(p_config->sta.bssid, NVRAM.wifi_bssid, sizeof NVRAM.wifi_bssid);
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// reconnect_timer_cb() - Called by the ESP timer when it's time to try reconnecting to the access point
+//=========================================================================================================
+static void reconnect_timer_cb(void*)
+{
+    net_event_t event;
+    memset(&event, 0, sizeof event);
+    event.type    = NET_EVT_RETRY;
+    event.handler = MAIN_HANDLER;
+    Network.inject_event(&event);
 }
 //=========================================================================================================
 
+
 //=========================================================================================================
-// event_handler() - The main event handler for network operations
+// test_timer_cb() - Called by the ESP timer when a Wi-Fi credentials test has taken too long
 //=========================================================================================================
-void CNetwork::event_handler(esp_event_base_t event_base, int32_t event_id, void* event_data)
+static void test_timer_cb(void*)
 {
+    net_event_t event;
+    memset(&event, 0, sizeof event);
+    event.type     = NET_EVT_TEST_TIMEOUT;
+    event.handler  = TEST_HANDLER;
+    event.test_seq = test_seq;
+    Network.inject_event(&event);
+}
+//=========================================================================================================
 
-    ip_event_got_ip_t*             got_ip_event;
-    wifi_event_sta_disconnected_t* disco_event;
 
-    int disconnect_reason = 0;
+//=========================================================================================================
+// ap_timer_cb() - Called by the ESP timer periodically while we're in AP mode
+//=========================================================================================================
+static void ap_timer_cb(void*)
+{
+    net_event_t event;
+    memset(&event, 0, sizeof event);
+    event.type = NET_EVT_AP_CHECK;
+    Network.inject_event(&event);
+}
+//=========================================================================================================
 
-    // If the system is rebooting, do absolutely nothing
-    if (System.is_rebooting) return;
 
-    // The number of times we will retry a failed WPA/Enterprise connection
-    int max_retries = 10;
+//=========================================================================================================
+// launch_task() - Just calls the task() method of our Network object
+//=========================================================================================================
+static void launch_task(void *pvParameters) {Network.task();}
+//=========================================================================================================
 
-    // Did we get a "Start connection" event?
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
+
+//=========================================================================================================
+// event_handler() - This is the event handler that will be called by the system event loop
+//
+// This does no work of its own.  It copies the event into our queue and returns, so that the event 
+// loop is never stalled.  The network task does the actual work.
+//=========================================================================================================
+static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+    net_event_t event;
+
+    // If the system is rebooting, throw this event away
+    if (System.is_rebooting) return;
+
+    // Scan results and provisioning clients coming and going are wanted no matter which event 
+    // handler is in use
+    memset(&event, 0, sizeof event);
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE)
     {
-        esp_wifi_connect();
+        event.type = NET_EVT_SCAN_DONE;
+        Network.inject_event(&event);
         return;
     }
-
-    // Did we get a "We've been assigned an IP address" event?
-    if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+    if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_AP_STACONNECTED || event_id == WIFI_EVENT_AP_STADISCONNECTED))
     {
-        // We now have zero consecutive failed connection attempts
-        failed_connection_attempts = 0;
+        event.type       = NET_EVT_AP_CLIENT;
+        event.is_joining = (event_id == WIFI_EVENT_AP_STACONNECTED);
+        Network.inject_event(&event);
+        return;
+    }
+
+    // If nobody wants events right now, throw this one away
+    if (evt_handler_type == NO_HANDLER) return;
 
-        // Save our IP address for posterity
-        got_ip_event = (ip_event_got_ip_t*) event_data;
-        strcpy(System.ip_addr, ip4addr_ntoa((const ip4_addr_t*)&got_ip_event->ip_info.ip));
-        
-        // Log our IP address
-        ESP_LOGI(WIFI_TAG, "got ip:%s", System.ip_addr);
+    // Remember which event handler (and which credentials test) this event should be delivered to
+    event.handler  = evt_handler_type;
+    event.test_seq = test_seq;
+
+    // Translate the system event into one of ours, copying the event data since it won't
+    // exist by the time the network task gets around to it
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
+    {
+        event.type = NET_EVT_STA_START;
+    }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
+    {
+        event.type = NET_EVT_STA_CONNECTED;
+        memcpy(&event.connected, event_data, sizeof event.connected);
+    }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
+    {
+        event.type = NET_EVT_STA_DISCONNECTED;
+        memcpy(&event.disconnected, event_data, sizeof event.disconnected);
+    }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_BSS_RSSI_LOW)
+    {
+        event.type = NET_EVT_RSSI_LOW;
+    }
+    else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+    {
+        event.type = NET_EVT_GOT_IP;
+        memcpy(&event.got_ip, event_data, sizeof event.got_ip);
+    }
+    else if (event_base == IP_EVENT && event_id == IP_EVENT_GOT_IP6)
+    {
+        event.type = NET_EVT_GOT_IP6;
+        memcpy(&event.got_ip6, event_data, sizeof event.got_ip6);
+    }
 
-        // Tell the outside world that we are connected to WiFi
-        m_wifi_status = WIFI_CONNECTED;
+    // If it's not an event we care about, ignore it
+    else return;
 
-        // At this point we know that we don't have a bad Wi-Fi password
-        bad_password_count = 0;
+    // Hand the event to the network task
+    Network.inject_event(&event);
+}
+//=========================================================================================================
 
-        // We are no long attempting our first connection
-        m_is_connecting_at_boot = false;
 
-        // Show the appropriate status on the status LED
-        //?WifiLED.show_new_status();
-        
-        // Initialize mDNS and broadcast our dns-name
-        setup_mdns();
+//=========================================================================================================
+// begin() - Creates the event queue and starts the network task.  Call this once at startup, before
+//           any other CNetwork methods
+//=========================================================================================================
+void CNetwork::begin()
+{
+    // This timer limits how long a Wi-Fi credentials test can take
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof timer_args);
+    timer_args.callback = test_timer_cb;
+    timer_args.name     = "wifi_test";
+    esp_timer_create(&timer_args, &m_test_timer);
+
+    // This timer drives the AP-mode supervisor
+    timer_args.callback = ap_timer_cb;
+    timer_args.name     = "ap_check";
+    esp_timer_create(&timer_args, &m_ap_timer);
+
+    // The system event loop and our timers write events into this queue
+    m_event_qh = xQueueCreate(NET_EVENT_QUEUE_SIZE, sizeof(net_event_t));
+
+    // And the network task reads them
+    xTaskCreatePinnedToCore(::launch_task, "network", 4096, nullptr, DEFAULT_TASK_PRI, NULL, TASK_CPU);
+}
+//=========================================================================================================
 
-        // Fetch the current time via an NTP server on the internet. 
-        #if USE_NTP
-        printf("$$$>>>NTP\n");
-        get_time_via_ntp();
-        #endif
 
-        // Start the servers
-        TCPServer.start();
+//=========================================================================================================
+// inject_event() - Places an event in the queue for the network task
+//
+// This is how the system event loop and our timers talk to the network task.  It's public so that
+// a test harness can drive the state machine with a scripted sequence of events.
+//
+// Returns: 'false' if the queue was full and the event was dropped
+//=========================================================================================================
+bool CNetwork::inject_event(const net_event_t* p_event)
+{
+    if (xQueueSend(m_event_qh, p_event, 0) == pdTRUE) return true;
+    ESP_LOGE(WIFI_TAG, "Network event queue full, event %i dropped", p_event->type);
+    return false;
+}
+//=========================================================================================================
 
-        // Output the specially formatted message that software can use to determine our IP address
-        printf("$$$>>>IP:%s\n", System.ip_addr);
 
-        // We're connected to the outside world
-        return;
-    }
+//=========================================================================================================
+// task() - Waits for network events and hands each one to the appropriate event handler
+//=========================================================================================================
+void CNetwork::task()
+{
+    net_event_t event;
 
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
+    while (true)
     {
+        // Wait for an event to arrive
+        xQueueReceive(m_event_qh, &event, portMAX_DELAY);
+
+        // If the system is rebooting, do absolutely nothing
+        if (System.is_rebooting) continue;
 
-        #define CONFAIL_BADPW  15     // Connection failed due to bad password
-        #define CONFAIL_WPA2   204    // Connection failed due to bad WPA2/Enterprise creds
+        // Background scans and the AP supervisor are handled the same way no matter which event
+        // handler is in use.  Everything else goes to the handler it was meant for
+        switch (event.type)
+        {
+            case NET_EVT_SCAN_START: start_scan(event.is_active_scan);   break;
+            case NET_EVT_SCAN_DONE:  on_scan_done();                     break;
+            case NET_EVT_AP_CLIENT:  on_ap_client(event.is_joining);     break;
+            case NET_EVT_AP_CHECK:   on_ap_check();                      break;
+            case NET_EVT_TEST_START: on_test_start(&event);              break;
+            default:
+                if (event.handler == TEST_HANDLER)
+                    special_event_handler(&event);
+                else
+                    event_handler(&event);
+        }
+
+        // Keep track of the stack depth
+        StackMgr.record_hwm(TASK_IDX_NETWORK);
+    }
+}
+//=========================================================================================================
 
-        // Get a pointer to the disconnection event data
-        disco_event = (wifi_event_sta_disconnected_t*) event_data;
 
-        // Fetch a code that indicates why the connection failed
-        disconnect_reason = disco_event->reason;
+//=========================================================================================================
+// set_status() - Changes the status of the Wi-Fi connection, logging the transition
+//=========================================================================================================
+void CNetwork::set_status(wifi_status_t new_status)
+{
+    static const char* status_name[] = {"AP_MODE", "CONNECTING", "CONNECTED", "STOPPED"};
 
-        // Log the reason that we got disconnected (potentially during our connection attempt)   
-        printf(">>> SYSTEM_EVENT_STA_DISCONNECTED: %i\n", disconnect_reason);
+    // If nothing is changing, there's nothing to do
+    if (new_status == m_wifi_status) return;
 
-        // Stop the servers
-        TCPServer.stop();
+    ESP_LOGI(WIFI_TAG, "Wi-Fi status %s -> %s", status_name[m_wifi_status], status_name[new_status]);
+    m_wifi_status = new_status;
 
-        // If we're still in STA mode, go ahead and try to reconnect to the access point
-        if (m_wifi_status != WIFI_AP_MODE && m_wifi_status != WIFI_STOPPED)
-        {
+    // Show the appropriate status on the status LED
+    //?WifiLED.show_new_status();
+}
+//=========================================================================================================
 
-            // Assume for the moment we will NOT be falling back to AP mode
-            fallback_to_ap_mode = false;
 
-            // If we failed a WPA2/Enterprise connection attempt too many times,
-            // we're going to fall back to AP mode
-            if (disconnect_reason == CONFAIL_WPA2 && ++failed_connection_attempts > max_retries)
-                fallback_to_ap_mode = true;
+//=========================================================================================================
+// event_handler() - The main event handler for network operations.  Runs in the network task
+//
+// This is the state machine for the STA connection:
+//
+//     CONNECTING --(GOT_IP)--------------> CONNECTED
+//     CONNECTED  --(DISCONNECTED)--------> CONNECTING  (a reconnect is scheduled)
+//     CONNECTING --(DISCONNECTED)--------> CONNECTING  (another reconnect is scheduled)
+//     CONNECTING --(RETRY)---------------> CONNECTING  (esp_wifi_connect() is called)
+//     any        --(bad password)--------> reboot into AP mode
+//
+// In AP_MODE and STOPPED, STA events are ignored
+//=========================================================================================================
+void CNetwork::event_handler(const net_event_t* p_event)
+{
+    switch (m_wifi_status)
+    {
+        // If we're not in STA mode, there's nothing for us to do
+        case WIFI_AP_MODE:
+        case WIFI_STOPPED:
+            return;
 
-            // If we had a bad password, we're going to fall back to AP mode
-            if (disconnect_reason == CONFAIL_BADPW)
+        // If we're trying to connect...
+        case WIFI_CONNECTING:
+            switch (p_event->type)
             {
-                ++bad_password_count;
-                fallback_to_ap_mode = true;
+                case NET_EVT_STA_START:        esp_wifi_connect();             return;
+                case NET_EVT_RETRY:            esp_wifi_connect();             return;
+                case NET_EVT_STA_CONNECTED:    on_sta_connected(p_event);      return;
+                case NET_EVT_GOT_IP:           on_got_ip(p_event);             return;
+                case NET_EVT_GOT_IP6:          on_got_ip6(p_event);            return;
+                case NET_EVT_STA_DISCONNECTED: on_disconnected(p_event);       return;
+                default:                                                       return;
             }
 
-            // If we've decided to fall back to Wi-Fi AP mode, make it so...
-            if (AP_MODE_ON_BAD_PW && fallback_to_ap_mode)
+        // If we're connected...
+        case WIFI_CONNECTED:
+            switch (p_event->type)
             {
-                System.reboot(true);
+                case NET_EVT_STA_CONNECTED:    on_sta_connected(p_event);      return;
+                case NET_EVT_GOT_IP:           on_got_ip(p_event);             return;
+                case NET_EVT_GOT_IP6:          on_got_ip6(p_event);            return;
+                case NET_EVT_STA_DISCONNECTED: on_disconnected(p_event);       return;
+                case NET_EVT_RSSI_LOW:         start_scan(true);               return;
+                default:                                                       return;
             }
+    }
+}
+//=========================================================================================================
 
-            // Otherwise, re-initialize and try to reconnect to the WiFi access point
-            else
-            {
-                m_wifi_status = WIFI_CONNECTING;
 
-                // Show the appropriate status on the status LED
-                //?WifiLED.show_new_status();
+//=========================================================================================================
+// on_sta_connected() - Called when we associate with an access point
+//=========================================================================================================
+void CNetwork::on_sta_connected(const net_event_t* p_event)
+{
+    // Remember where this access point is, so that we can reconnect to it without scanning
+    memcpy(NVRAM.wifi_bssid, p_event->connected.bssid, sizeof NVRAM.wifi_bssid);
+    NVRAM.wifi_channel     = p_event->connected.channel;
+    NVRAM.wifi_cred_crc    = credentials_crc(m_net_index);
+    NVRAM.wifi_cache_valid = true;
+
+    // Our IPv6 addresses are about to be assigned all over again
+    System.ip6_link_local[0] = 0;
+    System.ip6_global[0]     = 0;
+
+    // Give ourselves an IPv6 link-local address.  Once we have it, the router advertisements that 
+    // arrive will give us a global address too (SLAAC)
+    esp_netif_t* interface = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+    if (interface) esp_netif_create_ip6_linklocal(interface);
+}
+//=========================================================================================================
 
-                // Stop the TCP/IP stack
-                safe_wifi_stop();
 
-                // And restart the TCP/IP stack
-                safe_wifi_start();
+//=========================================================================================================
+// on_got_ip6() - Called when we've been assigned an IPv6 address, either link-local or global
+//=========================================================================================================
+void CNetwork::on_got_ip6(const net_event_t* p_event)
+{
+    esp_ip6_addr_t ip6 = p_event->got_ip6.ip6_info.ip;
 
-                // Log the fact that we are retrying a connection to the access point        
-                ESP_LOGI(WIFI_TAG,"retry to connect to the AP");
-            }
+    // Find out what kind of address this is.  Site-local and unique-local addresses are reachable
+    // beyond our link, so we treat them like global addresses
+    bool is_link_local = (esp_netif_ip6_get_addr_type(&ip6) == ESP_IP6_ADDR_IS_LINK_LOCAL);
 
-            return;
-        }
+    // Record the address in ASCII
+    char* dest = is_link_local ? System.ip6_link_local : System.ip6_global;
+    esp_ip6addr_ntoa(&ip6, dest, sizeof System.ip6_global);
 
+    // Display the address
+    ESP_LOGI(WIFI_TAG, "got ip6:%s", dest);
 
-        // We're done trying to handle the WiFi disconnect event
-        return;
-    }
+    // Output the specially formatted message that software can use to determine our IPv6 address
+    if (!is_link_local) printf("$$$>>>IP6:%s\n", dest);
 }
 //=========================================================================================================
 
 
+//=========================================================================================================
+// on_got_ip() - Called when we've been assigned an IP address
+//=========================================================================================================
+void CNetwork::on_got_ip(const net_event_t* p_event)
+{
+    // We now have zero consecutive failed connection attempts
+    failed_connection_attempts = 0;
+
+    // If we're recovering from an outage, keep track of how long it lasted
+    if (m_outage_start)
+    {
+        reconnect_stats_t& stats = m_reconnect_stats;
+        U32 elapsed_ms = (U32)((esp_timer_get_time() - m_outage_start) / 1000);
+        if (stats.count == 0 || elapsed_ms < stats.min_ms) stats.min_ms = elapsed_ms;
+        if (elapsed_ms > stats.max_ms) stats.max_ms = elapsed_ms;
+        if (m_is_fast_attempt) ++stats.fast_count;
+        stats.last_ms   = elapsed_ms;
+        stats.total_ms += elapsed_ms;
+        ++stats.count;
+        ESP_LOGI(WIFI_TAG, "Reconnected after %u ms (%i attempts)", elapsed_ms, m_retry_count);
+    }
+
+    // If we've just roamed to a new access point, keep track of how long the switch took
+    if (m_roam_state == ROAM_JOINING)
+    {
+        roam_stats_t& stats = m_roam_stats;
+        U32 elapsed_ms = (U32)((esp_timer_get_time() - m_roam_start) / 1000);
+        if (elapsed_ms > stats.max_ms) stats.max_ms = elapsed_ms;
+        stats.last_ms   = elapsed_ms;
+        stats.total_ms += elapsed_ms;
+        ++stats.count;
+        ESP_LOGI(WIFI_TAG, "Roamed to %s in %u ms", network_ssid(m_net_index), elapsed_ms);
+    }
+    m_roam_state = ROAM_IDLE;
+
+    // We're no longer in an outage
+    m_outage_start = 0;
+    m_retry_count  = 0;
+
+    // Ask the driver to tell us if our signal gets weak enough that we should think about roaming
+    esp_wifi_set_rssi_threshold(ROAM_RSSI_THRESHOLD);
+
+    // The driver resets the power-save mode when it connects, so put ours back into effect
+    PowerMgr.update(true);
+
+    // Save our IP address for posterity
+    strcpy(System.ip_addr, ip4addr_ntoa((const ip4_addr_t*)&p_event->got_ip.ip_info.ip));
+    
+    // Log our IP address
+    ESP_LOGI(WIFI_TAG, "got ip:%s", System.ip_addr);
+
+    // Tell the outside world that we are connected to WiFi
+    set_status(WIFI_CONNECTED);
+
+    // At this point we know that we don't have a bad Wi-Fi password
+    bad_password_count = 0;
+
+    // We are no long attempting our first connection
+    m_is_connecting_at_boot = false;
+
+    // Start the servers.  We do this first so that we're reachable the moment we have an address
+    TCPServer.start();
+
+    // Output the specially formatted message that software can use to determine our IP address
+    printf("$$$>>>IP:%s\n", System.ip_addr);
+
+    // Add this to the boot timeline
+    BootSeq.mark("IP");
+
+    // Initialize mDNS and broadcast our dns-name
+    setup_mdns();
+
+    // Start keeping our clock in sync with an NTP server on the internet.  This never blocks
+    #if USE_NTP
+    TimeSync.start();
+    #endif
+}
+//=========================================================================================================
+
 
 //=========================================================================================================
-// special_event_handler() - This is the event handler that will be called while testing WiFi credentials
+// on_disconnected() - Called when we lose our connection, or a connection attempt fails
 //=========================================================================================================
-void CNetwork::special_event_handler(esp_event_base_t event_base, int32_t event_id, void* event_data)
+void CNetwork::on_disconnected(const net_event_t* p_event)
 {
-    ip_event_got_ip_t*             got_ip_event;
-    wifi_event_sta_disconnected_t* disco_event;
+    #define CONFAIL_BADPW  15     // Connection failed due to bad password
+    #define CONFAIL_WPA2   204    // Connection failed due to bad WPA2/Enterprise creds
 
-    // If the system is rebooting, do absolutely nothing
-    if (System.is_rebooting) return;
+    // The number of times we will retry a failed WPA/Enterprise connection
+    const int max_retries = 10;
 
-    // Did we get a "Start connection" event?
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
+    // Fetch a code that indicates why the connection failed
+    int disconnect_reason = p_event->disconnected.reason;
+
+    // Log the reason that we got disconnected (potentially during our connection attempt)   
+    printf(">>> SYSTEM_EVENT_STA_DISCONNECTED: %i\n", disconnect_reason);
+
+    // If we dropped the connection on purpose to roam to a better access point, join it right away
+    if (m_roam_state == ROAM_LEAVING)
     {
+        TCPServer.stop();
+        set_status(WIFI_CONNECTING);
+        m_roam_state = ROAM_JOINING;
         esp_wifi_connect();
         return;
     }
 
-    // Did we get a "We've been assigned an IP address" event?
-    if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+    // If we couldn't join the access point we were roaming to, go back to the network and access point
+    // we just left, and reconnect the usual way.  The first attempts go straight to the cached access
+    // point, so make sure that's the old one
+    if (m_roam_state == ROAM_JOINING)
     {
-        // Save our IP address for posterity
-        got_ip_event = (ip_event_got_ip_t*) event_data;
-        strcpy(System.ip_addr, ip4addr_ntoa((const ip4_addr_t*)&got_ip_event->ip_info.ip));
-        
-        // Log our IP address
-        ESP_LOGI(WIFI_TAG, "got ip:%s", System.ip_addr);
+        ESP_LOGW(WIFI_TAG, "Roam to %s failed (%i)", network_ssid(m_net_index), disconnect_reason);
+        ++m_roam_stats.failures;
+        m_roam_state = ROAM_IDLE;
+        m_net_index  = m_roam_prev_index;
+        memcpy(NVRAM.wifi_bssid, m_roam_prev_bssid, sizeof NVRAM.wifi_bssid);
+        NVRAM.wifi_channel     = m_roam_prev_channel;
+        NVRAM.wifi_cred_crc    = credentials_crc(m_net_index);
+        NVRAM.wifi_cache_valid = true;
+    }
+
+    // Record the reason in the link-quality history
+    LinkMon.note_disconnect(disconnect_reason);
+
+    // Stop the servers
+    TCPServer.stop();
+
+    // Assume for the moment we will NOT be falling back to AP mode
+    fallback_to_ap_mode = false;
+
+    // If we failed a WPA2/Enterprise connection attempt too many times,
+    // we're going to fall back to AP mode
+    if (disconnect_reason == CONFAIL_WPA2 && ++failed_connection_attempts > max_retries)
+        fallback_to_ap_mode = true;
 
-        // The Wi-Fi credentials test has passed
-        wifi_test_status = 1;
+    // If we had a bad password, we're going to fall back to AP mode
+    if (disconnect_reason == CONFAIL_BADPW)
+    {
+        ++bad_password_count;
+        fallback_to_ap_mode = true;
+    }
 
-        // We're connected to the outside world
+    // If we've decided to fall back to Wi-Fi AP mode, make it so...
+    if (AP_MODE_ON_BAD_PW && fallback_to_ap_mode)
+    {
+        System.reboot(true);
         return;
     }
 
+    // Otherwise, we're trying to reconnect to the WiFi access point
+    set_status(WIFI_CONNECTING);
+
+    // The Wi-Fi stays started; we just schedule another call to esp_wifi_connect()
+    schedule_reconnect(disconnect_reason);
+}
+//=========================================================================================================
+
+
 
-    // Did we just get a disconnection event?
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
+//=========================================================================================================
+// special_event_handler() - This is the event handler that will be called while testing WiFi credentials
+//=========================================================================================================
+void CNetwork::special_event_handler(const net_event_t* p_event)
+{
+    // If this event is left over from a test that has already finished, ignore it
+    if (!m_is_testing || p_event->test_seq != test_seq) return;
+
+    switch (p_event->type)
     {
-        #define CONFAIL_BADPW  15     // Connection failed due to bad password
-        #define CONFAIL_WPA2   204    // Connection failed due to bad WPA2/Enterprise creds
+        // Did we get a "Start connection" event?
+        case NET_EVT_STA_START:
+            esp_wifi_connect();
+            return;
 
-        // Get a pointer to the disconnection event data
-        disco_event = (wifi_event_sta_disconnected_t*) event_data;
+        // Did we get a "We've been assigned an IP address" event?  If so, the test has passed
+        case NET_EVT_GOT_IP:
+            ESP_LOGI(WIFI_TAG, "test got ip:%s", ip4addr_ntoa((const ip4_addr_t*)&p_event->got_ip.ip_info.ip));
+            finish_wifi_test(0);
+            return;
 
-        // And the connection attempt failed
-        if (wifi_test_status == 0) 
-        {
-            wifi_test_status = -1;
-            test_fail_reason = disco_event->reason;
-        }
+        // Did we just get a disconnection event?  If so, the connection attempt failed
+        case NET_EVT_STA_DISCONNECTED:
+            finish_wifi_test(p_event->disconnected.reason);
+            return;
 
-        // We're done trying to handle the WiFi disconnect event
-        return;
+        // Did the test take too long?
+        case NET_EVT_TEST_TIMEOUT:
+            finish_wifi_test(WIFI_TEST_FAIL_TIMEOUT);
+            return;
+
+        // We don't care about any other events
+        default:
+            return;
     }
 }
 //=========================================================================================================
@@ -396,12 +824,20 @@ void initialize_wifi(wifi_start_t how, evt_handler_type_t handler_type)
         esp_netif_destroy(interface);
     }
 
+    // If a credentials test or scan left a station interface alongside the access point, tear that down too
+    if (apsta_interface)
+    {
+        esp_netif_destroy(apsta_interface);
+        apsta_interface = nullptr;
+    }
+
     // If we haven't yet registered to receive events...
     if (!events_registered)
     {
         // Register for the events we want
         esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID,    &::event_handler, nullptr, nullptr);
         esp_event_handler_instance_register(IP_EVENT,   IP_EVENT_STA_GOT_IP, &::event_handler, nullptr, nullptr);
+        esp_event_handler_instance_register(IP_EVENT,   IP_EVENT_GOT_IP6,    &::event_handler, nullptr, nullptr);
 
         // Keep track of the fact that we've registered for the events we want to handle
         events_registered = true;
@@ -436,7 +872,13 @@ void initialize_wifi(wifi_start_t how, evt_handler_type_t handler_type)
 void CNetwork::stop()
 {
     // We've stopped the Wi-Fi
-    m_wifi_status = WIFI_STOPPED;
+    set_status(WIFI_STOPPED);
+
+    // Don't make any more reconnection attempts
+    if (m_reconnect_timer) esp_timer_stop(m_reconnect_timer);
+
+    // And don't supervise an access point that's no longer running
+    esp_timer_stop(m_ap_timer);
     
     // Show the appropriate status on the status LED
     //?WifiLED.show_new_status();
@@ -454,7 +896,10 @@ void CNetwork::stop()
 void CNetwork::start()
 {
     // We are now trying to connect to the WiFi access point
-    m_wifi_status = WIFI_CONNECTING;
+    set_status(WIFI_CONNECTING);
+
+    // We're no longer an access point, so there's nothing to supervise
+    esp_timer_stop(m_ap_timer);
 
     // Show the appropriate status on the status LED
     //?WifiLED.show_new_status();
@@ -465,27 +910,36 @@ void CNetwork::start()
     // Initalize basic wifi settings
     initialize_wifi(WIFI_START_STA, MAIN_HANDLER);
 
-    // Tell the logger what credentials we're trying to connect with
-    ESP_LOGI(WIFI_TAG, "Connecting to SSID %s\n", NVS.data.network_ssid);
-
-    //  Fill in the WiFi configuration structure with our network SSID and password
-    wifi_config_t wifi_config;
-    memset(&wifi_config, 0, sizeof wifi_config);
-    strcpy((char*)wifi_config.sta.ssid,  (char*)NVS.data.network_ssid);
-    strcpy((char*)wifi_config.sta.password, NVS.data.network_pw);
-    
+    // Create the timer that paces our reconnection attempts
+    if (m_reconnect_timer == nullptr)
+    {
+        esp_timer_create_args_t timer_args;
+        memset(&timer_args, 0, sizeof timer_args);
+        timer_args.callback = reconnect_timer_cb;
+        timer_args.name     = "reconnect";
+        esp_timer_create(&timer_args, &m_reconnect_timer);
+    }
 
-    // Create convenient pointers to the username and (decrypted) password to feed to the router
-    const char* user = NVS.data.network_user;
-    const char* pass = (char*)wifi_config.sta.password;
+    // We haven't made any reconnection attempts, and we aren't roaming
+    m_retry_count  = 0;
+    m_outage_start = 0;
+    m_roam_state   = ROAM_IDLE;
 
-    // If we have a username stored in NVS, assume we're using WPA2/Enterprise. 
-    if (*user)
+    // If we were most recently connected to one of our stored networks, start with that one, since
+    // we can connect straight to its access point.  Otherwise, start with the primary network
+    m_net_index = 0;
+    for (int i=0; i<NET_MAX_NETWORKS; ++i)
     {
-        esp_wifi_sta_wpa2_ent_set_username((uint8_t *)user, strlen(user));
-        esp_wifi_sta_wpa2_ent_set_password((uint8_t *)pass, strlen(pass));
+        if (NVRAM.wifi_cache_valid && credentials_crc(i) && NVRAM.wifi_cred_crc == credentials_crc(i)) m_net_index = i;
     }
 
+    // Tell the logger what credentials we're trying to connect with
+    ESP_LOGI(WIFI_TAG, "Connecting to SSID %s\n", network_ssid(m_net_index));
+
+    //  Fill in the WiFi configuration structure, connecting straight to the cached AP if we know it
+    wifi_config_t wifi_config;
+    m_is_fast_attempt = fill_sta_config(&wifi_config, m_net_index, true);
+    if (m_is_fast_attempt) ESP_LOGI(WIFI_TAG, "Fast connect on channel %i", wifi_config.sta.channel);
 
     // Begin the connection attempt.  This will end up executing in a different thread    
     esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
@@ -498,76 +952,278 @@ void CNetwork::start()
 
 
 //=========================================================================================================
-// wifi_test_fail_reason() - Returns the reason for the router rejecting our connection attempt
+// schedule_reconnect() - Arranges for a reconnection attempt after a jittered exponential backoff
 //
-//      15 = Bad Password
-//     201 = Bad SSID
-//     204 = Bad WPA2 credentials
+// Passed: disconnect_reason = The reason the previous connection (or connection attempt) failed
 //=========================================================================================================
-U8 CNetwork::wifi_test_fail_code()
+void CNetwork::schedule_reconnect(int disconnect_reason)
 {
-    return (U8) test_fail_reason;
-}
-//=========================================================================================================
+    wifi_config_t wifi_config;
+
+    // If this is the start of an outage, remember when it started
+    if (m_outage_start == 0) m_outage_start = esp_timer_get_time();
+
+    // If the cached access point has disappeared, there's no point in trying it again
+    if (m_is_fast_attempt && disconnect_reason == REASON_NO_AP_FOUND && m_retry_count < FAST_RECONNECT_TRIES)
+    {
+        m_retry_count = FAST_RECONNECT_TRIES;
+    }
+
+    // Once we give up on the cached access point, try the strongest of our stored networks that
+    // recent scans have seen, and after that, take turns trying each of our stored networks
+    if (m_retry_count == FAST_RECONNECT_TRIES)
+    {
+        int best = select_network(nullptr);
+        if (best >= 0) m_net_index = best;
+    }
+    else if (m_retry_count > FAST_RECONNECT_TRIES) m_net_index = next_network(m_net_index);
+
+    // The first few attempts go straight to the cached access point.  After that, scan every channel
+    m_is_fast_attempt = fill_sta_config(&wifi_config, m_net_index, m_retry_count < FAST_RECONNECT_TRIES);
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+
+    // Double the delay with every attempt, up to the maximum
+    U32 delay_ms = RECONNECT_MAX_MS;
+    if (m_retry_count < 16) delay_ms = RECONNECT_BASE_MS << m_retry_count;
+    if (delay_ms > RECONNECT_MAX_MS) delay_ms = RECONNECT_MAX_MS;
+
+    // Randomize the delay by +/- 25% so that a roomful of devices don't all retry in lockstep
+    delay_ms = delay_ms * 3 / 4 + esp_random() % (delay_ms / 2 + 1);
+
+    // Keep track of how many attempts we've made
+    ++m_retry_count;
+    ++m_reconnect_stats.attempts;
+
+    // Log the fact that we are retrying a connection to the access point        
+    ESP_LOGI(WIFI_TAG, "retry %i to connect to the AP in %u ms%s", m_retry_count, delay_ms, m_is_fast_attempt ? " (fast)" : "");
+
+    // And start the timer
+    esp_timer_stop(m_reconnect_timer);
+    esp_timer_start_once(m_reconnect_timer, (U64)delay_ms * 1000);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// wifi_test_fail_reason() - Returns the reason for the router rejecting our connection attempt
+//
+//      15 = Bad Password
+//     201 = Bad SSID
+//     204 = Bad WPA2 credentials
+//     250 = Timed out (WIFI_TEST_FAIL_TIMEOUT)
+//=========================================================================================================
+U8 CNetwork::wifi_test_fail_code()
+{
+    return (U8) m_test_fail_code;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// start_wifi_test() - Asks the network task to attempt a connection to the Wi-Fi access point with the
+//                     credentials in NVS, and returns immediately
+//
+// Passed: timeout_ms = The maximum amount of time the test is allowed to take
+//         callback   = Called (from the network task) when the test finishes
+//         context    = Arbitrary pointer that is handed to the callback
+//
+// Returns: 'false' if the test couldn't be started, in which case the callback isn't called
+//
+// This can be called from any task.  The Wi-Fi state belongs to the network task, so all we do here
+// is claim the test and post an event; on_test_start() does the real work
+//=========================================================================================================
+bool CNetwork::start_wifi_test(U32 timeout_ms, wifi_test_cb_t callback, void* context)
+{
+    net_event_t event;
 
+    // Only one test can be running at a time.  Claim this one and give it a new sequence number
+    portENTER_CRITICAL(&test_mux);
+    bool is_busy = m_is_testing;
+    if (!is_busy)
+    {
+        m_is_testing = true;
+        ++test_seq;
+    }
+    portEXIT_CRITICAL(&test_mux);
+    if (is_busy) return false;
+
+    // Hand the request to the network task
+    memset(&event, 0, sizeof event);
+    event.type                  = NET_EVT_TEST_START;
+    event.test_seq              = test_seq;
+    event.test_start.timeout_ms = timeout_ms;
+    event.test_start.callback   = callback;
+    event.test_start.context    = context;
+    if (inject_event(&event)) return true;
+
+    // If the queue was full, the test never started
+    m_is_testing = false;
+    return false;
+}
+//=========================================================================================================
 
 
 //=========================================================================================================
-// test_wifi_credentials() - Starts a connection to the local WiFi access-point (i.e., a WiFi router)
+// on_test_start() - Starts a Wi-Fi credentials test.  Runs in the network task
+//
+// If we're in AP mode, the test runs in APSTA mode so that clients connected to our access point
+// stay connected.  The radio has only one channel, so when the station joins the network being 
+// tested, our access point follows it to that network's channel.  (rechannel_ap() normally puts the
+// access point there ahead of time.)  If we're not in AP mode, the Wi-Fi is started in STA mode for 
+// the test and stopped afterwards
 //=========================================================================================================
-bool CNetwork::test_wifi_credentials()
+void CNetwork::on_test_start(const net_event_t* p_event)
 {
-    // We're about to test a Wi-Fi connection
-    wifi_test_status = 0;
+    wifi_config_t wifi_config;
+
+    // Keep track of who to tell when the test is done
+    m_test_callback  = p_event->test_start.callback;
+    m_test_context   = p_event->test_start.context;
+    m_test_fail_code = 0;
 
     // If we don't have an SSID, pretend this is a bad SSID
     if (NVS.data.network_ssid[0] == 0)
     {
-        test_fail_reason = 201;        
-        return false;
+        m_test_fail_code = 201;
+        m_is_testing = false;
+        if (m_test_callback) m_test_callback(false, m_test_fail_code, m_test_context);
+        return;
     }
 
-    // We are now trying to connect to the WiFi access point
-    m_wifi_status = WIFI_CONNECTING;
+    // A background scan would get in the way of the connection attempt
+    if (m_is_scanning)
+    {
+        esp_wifi_scan_stop();
+        m_is_scanning   = false;
+        m_is_scan_apsta = false;
+    }
 
-    // Initalize basic wifi settings
-    initialize_wifi(WIFI_START_TEST, TEST_HANDLER);
+    // Find out whether we'll be running the test alongside our access point
+    m_is_test_apsta = (m_wifi_status == WIFI_AP_MODE);
 
     // Tell the logger what credentials we're trying to connect with
-    ESP_LOGI(WIFI_TAG, "Testing WiFi connection to SSID %s\n", NVS.data.network_ssid);
+    ESP_LOGI(WIFI_TAG, "Testing WiFi connection to SSID %s%s\n", NVS.data.network_ssid, m_is_test_apsta ? " (APSTA)" : "");
 
-    //  Fill in the WiFi configuration structure with our network SSID and password
-    wifi_config_t wifi_config;
-    memset(&wifi_config, 0, sizeof wifi_config);
-    strcpy((char*)wifi_config.sta.ssid,  (char*)NVS.data.network_ssid);
-    strcpy((char*) wifi_config.sta.password, NVS.data.network_pw);
-    
-    // Create convenient pointers to the username and (decrypted) password to feed to the router
-    const char* user = NVS.data.network_user;
-    const char* pass = (char*)wifi_config.sta.password;
+    // If we're an access point, add a station interface alongside it
+    if (m_is_test_apsta)
+    {
+        evt_handler_type = NO_HANDLER;
+        if (apsta_interface == nullptr) apsta_interface = esp_netif_create_default_wifi_sta();
+        esp_wifi_set_mode(WIFI_MODE_APSTA);
 
-    // If we have a username stored in NVS, assume we're using WPA2/Enterprise. 
-    if (*user)
+        // If we know the network is on another channel, our clients are about to be moved there
+        int channel = home_channel();
+        if (channel && channel != m_ap_channel)
+        {
+            ESP_LOGW(WIFI_TAG, "Access point will follow %s from channel %i to %i", NVS.data.network_ssid, m_ap_channel, channel);
+            m_ap_channel = channel;
+        }
+    }
+
+    // Otherwise, set up the Wi-Fi in STA mode just for this test
+    else
     {
-        esp_wifi_sta_wpa2_ent_set_username((uint8_t *)user, strlen(user));
-        esp_wifi_sta_wpa2_ent_set_password((uint8_t *)pass, strlen(pass));
+        if (m_reconnect_timer) esp_timer_stop(m_reconnect_timer);
+        set_status(WIFI_CONNECTING);
+        initialize_wifi(WIFI_START_TEST, NO_HANDLER);
     }
 
+    //  Fill in the WiFi configuration structure with our primary network's credentials
+    fill_sta_config(&wifi_config, 0, false);
+
+    // From here on, events go to the test event handler
+    evt_handler_type = TEST_HANDLER;
+
     // Begin the connection attempt.  This will end up executing in a different thread    
     esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
-    safe_wifi_start();
+    if (m_is_test_apsta)
+        esp_wifi_connect();
+    else
+        safe_wifi_start();
+
+    // And make sure the test can't run forever.  If the timer of an earlier test already fired, its
+    // event carries that test's sequence number and will be ignored
+    esp_timer_stop(m_test_timer);
+    esp_timer_start_once(m_test_timer, (U64)p_event->test_start.timeout_ms * 1000);
+}
+//=========================================================================================================
 
-    // Wait for the test to finish
-    while (wifi_test_status == 0) msdelay(500);
 
-    // Make sure we disconnect from the router
-    safe_wifi_stop();
+//=========================================================================================================
+// finish_wifi_test() - Ends a Wi-Fi credentials test and reports the result.  Runs in the network task
+//
+// Passed: fail_code = 0 if the test passed, otherwise the reason it failed
+//=========================================================================================================
+void CNetwork::finish_wifi_test(int fail_code)
+{
+    // We're no longer interested in events from this test
+    evt_handler_type = NO_HANDLER;
+    esp_timer_stop(m_test_timer);
+    m_test_fail_code = fail_code;
+
+    // If we were running alongside our access point, drop the station side and stay an access point
+    if (m_is_test_apsta)
+    {
+        esp_wifi_disconnect();
+        esp_wifi_set_mode(WIFI_MODE_AP);
+    }
+
+    // Otherwise, stop the Wi-Fi entirely
+    else
+    {
+        safe_wifi_stop();
+        set_status(WIFI_STOPPED);
+    }
+
+    // The test is over
+    m_is_testing = false;
+
+    // Tell whoever started the test how it went
+    ESP_LOGI(WIFI_TAG, "Wi-Fi test %s (%i)", fail_code ? "failed" : "passed", fail_code);
+    if (m_test_callback) m_test_callback(fail_code == 0, fail_code, m_test_context);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// blocking_test_cb() - Used by test_wifi_credentials() to find out when the test is done
+//=========================================================================================================
+struct blocking_test_t {SemaphoreHandle_t sem; bool passed;};
+static void blocking_test_cb(bool passed, int fail_code, void* context)
+{
+    blocking_test_t* p_test = (blocking_test_t*)context;
+    p_test->passed = passed;
+    xSemaphoreGive(p_test->sem);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// test_wifi_credentials() - Tests the Wi-Fi credentials in NVS, and waits for the result
+//
+// Passed: timeout_ms = The maximum amount of time the test is allowed to take
+//
+// Returns: 'true' if we were able to connect and get an IP address
+//
+// This must not be called from the network task
+//=========================================================================================================
+bool CNetwork::test_wifi_credentials(U32 timeout_ms)
+{
+    blocking_test_t test;
+
+    // Create the semaphore our callback will signal when the test is done
+    test.sem    = xSemaphoreCreateBinary();
+    test.passed = false;
 
-    // Wait for the disconnect to complete
-    msdelay(250);
+    // Start the test, and if it starts, wait for it to complete
+    if (start_wifi_test(timeout_ms, blocking_test_cb, &test))
+    {
+        xSemaphoreTake(test.sem, portMAX_DELAY);
+    }
 
     // Tell the caller whether or not these wifi-credentials are good
-    return (wifi_test_status == 1);
+    vSemaphoreDelete(test.sem);
+    return test.passed;
 }
 //=========================================================================================================
 
@@ -595,7 +1251,7 @@ void CNetwork::start_as_ap(ap_mode_t reason)
     stop();
 
     // We're launching as an access point, not as a station on some other access point
-    m_wifi_status = WIFI_AP_MODE;
+    set_status(WIFI_AP_MODE);
 
     // Keep track of why we're in AP mode
     m_ap_mode_reason = reason;
@@ -609,14 +1265,19 @@ void CNetwork::start_as_ap(ap_mode_t reason)
     // Tell the logger what credentials we're trying to connect with
     ESP_LOGI(WIFI_TAG, "Starting WiFi Access Point\n");
 
+    // If the network we've been configured for is nearby, start on its channel.  Otherwise, start on
+    // the quietest channel
+    int channel = home_channel();
+    if (channel == 0) channel = choose_ap_channel(nullptr);
+
     //  Fill in the WiFi configuration structure
     wifi_config_t wifi_config;
     memset(&wifi_config, 0, sizeof wifi_config);
     strcpy((char*)wifi_config.ap.ssid, System.ssid);
-    wifi_config.ap.channel         = 1;
+    wifi_config.ap.channel         = channel;
     wifi_config.ap.authmode        = WIFI_AUTH_OPEN;
     wifi_config.ap.ssid_hidden     = 0;
-    wifi_config.ap.max_connection  = 1;
+    wifi_config.ap.max_connection  = AP_MAX_CLIENTS;
     wifi_config.ap.beacon_interval = 100;
 
     // Begin the connection attempt.  This will end up executing in a different thread    
@@ -638,18 +1299,210 @@ void CNetwork::start_as_ap(ap_mode_t reason)
     // Keep track of what time (in microseconds since boot) that we launched AP mode
     m_last_activity_time = esp_timer_get_time();
 
+    // Nobody is connected to our access point yet, and it hasn't moved to a quieter channel
+    m_ap_channel      = wifi_config.ap.channel;
+    m_ap_clients      = 0;
+    m_is_ap_rechanneled = false;
+    ESP_LOGI(WIFI_TAG, "Access point is on channel %i", m_ap_channel);
+
+    // Start the supervisor that will expire AP mode if nobody uses it
+    esp_timer_start_periodic(m_ap_timer, (U64)AP_CHECK_MS * 1000);
+
     // Output the specially formatted message that software can use to determine our SSID
     printf("$$$>>>SSID:%s\n", wifi_config.ap.ssid);
 }
 //=========================================================================================================
 
 
+//=========================================================================================================
+// choose_ap_channel() - Finds the least congested of the non-overlapping channels (1, 6 and 11)
+//
+// Passed: p_score = If not nullptr, the congestion score of every channel is stored here, indexed
+//                   by channel number
+//
+// Returns: The channel to use.  If we haven't scanned yet, this is channel 1
+//
+// Each access point in the scan cache adds to the congestion score of its own channel and, to a 
+// lesser degree, the channels that overlap it.  Stronger access points add more
+//=========================================================================================================
+static int channel_score[15];
+static void score_ap(const scan_entry_t* p_entry, U32 age_ms, void* context)
+{
+    int weight = p_entry->rssi + 100;
+    if (weight <= 0) return;
+    for (int channel = 1; channel <= 13; ++channel)
+    {
+        int distance = channel > p_entry->channel ? channel - p_entry->channel : p_entry->channel - channel;
+        if (distance < 5) channel_score[channel] += weight * (5 - distance) / 5;
+    }
+}
+
+int CNetwork::choose_ap_channel(int* p_score)
+{
+    static const int candidate[] = {1, 6, 11};
+    int best = candidate[0];
+
+    // Score every channel
+    memset(channel_score, 0, sizeof channel_score);
+    ScanCache.for_each(score_ap, nullptr);
+
+    // And find the quietest of the candidates
+    for (int channel : candidate) if (channel_score[channel] < channel_score[best]) best = channel;
+
+    if (p_score) memcpy(p_score, channel_score, sizeof channel_score);
+    return best;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// home_channel() - Returns the channel of the network we've been configured for, or 0 if we have no
+//                  network or haven't seen it in a scan
+//
+// In APSTA mode the ESP32 has a single radio, so the access point must share the channel of whatever
+// network the station joins.  Putting our access point there in the first place means that testing
+// the credentials doesn't move it out from under its clients
+//=========================================================================================================
+int CNetwork::home_channel()
+{
+    scan_entry_t entry;
+    const char* ssid = network_ssid(0);
+    if (ssid[0] == 0 || !ScanCache.find(ssid, &entry)) return 0;
+    return entry.channel;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// rechannel_ap() - If we're an access point and nobody has connected yet, moves our access point to 
+//                  the channel of the network we've been configured for or, if we haven't seen that
+//                  network, to a channel that a scan shows is much quieter than ours
+//
+// This runs in the network task.  Our access point has to start before we can scan, so this is how
+// it ends up on the right channel
+//=========================================================================================================
+void CNetwork::rechannel_ap()
+{
+    int score[15];
+    wifi_config_t wifi_config;
+
+    // Only move an access point that nobody is using
+    if (m_wifi_status != WIFI_AP_MODE || m_ap_clients > 0) return;
+
+    // If the network we've been configured for is nearby, that's the channel we want
+    int channel = home_channel();
+
+    // Otherwise, find the quietest channel.  We only do that once, and only if it's much quieter
+    if (channel == 0)
+    {
+        if (m_is_ap_rechanneled) return;
+        channel = choose_ap_channel(score);
+        if (score[channel] + AP_CHANNEL_MARGIN > score[m_ap_channel]) return;
+    }
+
+    // If we're already there, we're done
+    if (channel == m_ap_channel) return;
+
+    // Move to the new channel
+    ESP_LOGI(WIFI_TAG, "Moving access point from channel %i to %i", m_ap_channel, channel);
+    if (esp_wifi_get_config(WIFI_IF_AP, &wifi_config) != ESP_OK) return;
+    wifi_config.ap.channel = channel;
+    if (esp_wifi_set_config(WIFI_IF_AP, &wifi_config) != ESP_OK) return;
+    m_ap_channel = channel;
+    m_is_ap_rechanneled = true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// on_ap_client() - Called in the network task when a client joins or leaves our access point
+//=========================================================================================================
+void CNetwork::on_ap_client(bool is_joining)
+{
+    if (is_joining)
+        ++m_ap_clients;
+    else if (m_ap_clients > 0)
+        --m_ap_clients;
+
+    ESP_LOGI(WIFI_TAG, "Access point has %i client(s)", m_ap_clients);
+
+    // A client coming or going counts as activity
+    register_activity();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// on_ap_check() - Called in the network task periodically while we're in AP mode.  If nobody has 
+//                 used the access point for a while, returns to STA mode
+//=========================================================================================================
+void CNetwork::on_ap_check()
+{
+    // If we're not in AP mode (or we're testing credentials), there's nothing to supervise
+    if (m_wifi_status != WIFI_AP_MODE || m_is_testing) return;
+
+    // If AP mode never expires, or we have no network to return to, stay in AP mode
+    U32 timeout_ms = NVS.data.ap_timeout_min * 60000;
+    if (timeout_ms == 0 || NVS.data.network_ssid[0] == 0) return;
+
+    // As long as a client is connected, or there's been recent activity, stay in AP mode
+    if (m_ap_clients > 0 || idle_ms() < timeout_ms) return;
+
+    // Otherwise, go back to being a station
+    printf(">>> AP mode expired after %u minutes of inactivity\n", NVS.data.ap_timeout_min);
+    start();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// mdns_status() - Returns the status that we advertise in our mDNS TXT record
+//=========================================================================================================
+const char* CNetwork::mdns_status()
+{
+    switch (m_wifi_status)
+    {
+        case WIFI_AP_MODE:    return "ap";
+        case WIFI_CONNECTING: return "connecting";
+        case WIFI_STOPPED:    return "stopped";
+        default:              return TCPServer.has_client() ? "busy" : "ready";
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// update_mdns() - If our status has changed, updates the TXT record that we advertise over mDNS
+//
+// Call this periodically.  It does nothing unless the status has actually changed, so it doesn't
+// generate any multicast traffic in the steady state
+//=========================================================================================================
+void CNetwork::update_mdns()
+{
+    static const char* advertised = nullptr;
+
+    // If mDNS isn't running, there's nothing to update
+    if (!is_mdns_started) return;
+
+    // If our status hasn't changed since the last time we advertised it, we're done
+    const char* status = mdns_status();
+    if (status == advertised) return;
+
+    // Tell the world about our new status
+    if (mdns_service_txt_item_set(MDNS_SERVICE, "_tcp", "status", status) == ESP_OK) advertised = status;
+}
+//=========================================================================================================
+
+
 //=========================================================================================================
 // register_activity() - Notify this object that activity has taken place on the TCP port
 //=========================================================================================================
 void CNetwork::register_activity()
 {
     m_last_activity_time = esp_timer_get_time();
+
+    // If the radio is dozing, wake it up so that the rest of the conversation is quick
+    PowerMgr.on_activity();
 }
 //=========================================================================================================
 
@@ -662,76 +1515,221 @@ bool CNetwork::is_bad_password() {return (bad_password_count >= 2);}
 
 
 //=========================================================================================================
-// scan_wifi_networks() - Scans for Wi-Fi access points, and reports each one found via a callback
+// request_scan() - Asks the network task to start a background scan
+//
+// Passed: is_active = true for an active scan (finds hidden networks), false for a passive one
 //=========================================================================================================
-void CNetwork::scan_wifi_networks(void (*callback)(const wifi_scan_rec_t*))
+void CNetwork::request_scan(bool is_active)
 {
-    uint16_t count;
-    wifi_scan_config_t scan_conf; 
-    wifi_scan_rec_t ap;
-    esp_err_t ret;
+    net_event_t event;
+    memset(&event, 0, sizeof event);
+    event.type           = NET_EVT_SCAN_START;
+    event.is_active_scan = is_active;
+    inject_event(&event);
+}
+//=========================================================================================================
 
-    // We're going to perform a very basic scan for WiFi networks
-    memset(&scan_conf, 0, sizeof scan_conf);
 
-    // We want to see hidden networks
-    scan_conf.scan_type   = WIFI_SCAN_TYPE_ACTIVE;
-    scan_conf.show_hidden = true;
+//=========================================================================================================
+// start_scan() - Starts a background scan.  Runs in the network task
+//
+// The scan doesn't block.  When it completes, the driver sends a SCAN_DONE event
+//=========================================================================================================
+void CNetwork::start_scan(bool is_active)
+{
+    wifi_scan_config_t scan_conf;
 
-    // Start up the Wi-Fi in STA mode
-    initialize_wifi(WIFI_START_STA, NO_HANDLER);
+    // If a scan is already running, or we're in the middle of a connection attempt or a credentials
+    // test, don't disturb it.  The next periodic scan will catch up
+    if (m_is_scanning || m_is_testing) return;
+    if (m_wifi_status != WIFI_CONNECTED && m_wifi_status != WIFI_AP_MODE) return;
 
-    // Start wi-fi event handling
-    safe_wifi_start();
+    // The driver can only scan when the station side of the radio is running, so if we're an access
+    // point, add a station interface alongside it for the duration of the scan
+    m_is_scan_apsta = (m_wifi_status == WIFI_AP_MODE);
+    if (m_is_scan_apsta)
+    {
+        if (apsta_interface == nullptr) apsta_interface = esp_netif_create_default_wifi_sta();
+        esp_wifi_set_mode(WIFI_MODE_APSTA);
+    }
 
-    // Start the scan  (this call will block)
-    ret = esp_wifi_scan_start(&scan_conf, true);
+    // Start the scan
+    ScanCache.get_scan_config(&scan_conf, is_active);
+    esp_err_t ret = esp_wifi_scan_start(&scan_conf, false);
     if (ret)
     {
         ESP_LOGE(WIFI_TAG, "esp_wifi_scan_start() returned %d", (int) ret);
+        if (m_is_scan_apsta) esp_wifi_set_mode(WIFI_MODE_AP);
         return;
     }
 
-    // How many wifi networks did we find?
-    ret = esp_wifi_scan_get_ap_num(&count);
-    if (ret)
+    // A scan is now running
+    m_is_scanning = true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// on_scan_done() - Called in the network task when a background scan completes
+//=========================================================================================================
+void CNetwork::on_scan_done()
+{
+    // Hand the results to the scan cache
+    ScanCache.on_scan_done();
+    m_is_scanning = false;
+
+    // If we added a station interface to scan, go back to being just an access point.  (Unless a
+    // credentials test has started in the meantime, in which case it will do that when it's done)
+    if (m_is_scan_apsta && !m_is_testing && m_wifi_status == WIFI_AP_MODE) esp_wifi_set_mode(WIFI_MODE_AP);
+    m_is_scan_apsta = false;
+
+    // Now that we have fresh scan results, find out if there's a better access point for us
+    evaluate_roam();
+
+    // Or, if we're an access point, a quieter channel
+    rechannel_ap();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// select_network() - Finds the strongest of our stored networks in the scan cache
+//
+// Passed: p_entry = If not nullptr, the scan cache record of that network is stored here
+//
+// Returns: The index of the stored network, or -1 if recent scans haven't seen any of them
+//=========================================================================================================
+int CNetwork::select_network(scan_entry_t* p_entry)
+{
+    scan_entry_t entry, best_entry;
+    int best = -1;
+
+    // Find out what time it is
+    U32 now_ms = (U32)(esp_timer_get_time() / 1000);
+
+    // Look up each of our stored networks in the scan cache.  On a tie, the earlier network wins
+    for (int i=0; i<NET_MAX_NETWORKS; ++i)
     {
-        ESP_LOGE(WIFI_TAG, "esp_wifi_scan_get_ap() returned %d", (int) ret);
-        return;
+        const char* ssid = network_ssid(i);
+        if (ssid[0] == 0 || !ScanCache.find(ssid, &entry)) continue;
+        if (now_ms - entry.last_seen_ms > SCAN_MAX_AGE_MS) continue;
+        if (best < 0 || entry.rssi > best_entry.rssi)
+        {
+            best       = i;
+            best_entry = entry;
+        }
     }
 
-    // Allocate memory to hold all of the access-point records
-    wifi_ap_record_t* ap_info = new wifi_ap_record_t[count];
+    // Hand the caller the scan record of the network we chose
+    if (best >= 0 && p_entry) *p_entry = best_entry;
+    return best;
+}
+//=========================================================================================================
 
-    // Fetch all of the access-point records into the memory we just allocated
-    ret = esp_wifi_scan_get_ap_records(&count, ap_info);
-    if (ret)
+
+//=========================================================================================================
+// next_network() - Returns the index of the next stored network after the specified one
+//=========================================================================================================
+int CNetwork::next_network(int index)
+{
+    for (int i=1; i<=NET_MAX_NETWORKS; ++i)
     {
-        ESP_LOGE(WIFI_TAG, "esp_wifi_scan_get_ap() returned %d", (int) ret);
+        int candidate = (index + i) % NET_MAX_NETWORKS;
+        if (network_ssid(candidate)[0]) return candidate;
     }
 
-    // Loop through each Wi-Fi access point we just found...
-    for (int i=0; i<count; ++i)
+    // If we get here, there are no stored networks at all
+    return 0;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// evaluate_roam() - If our signal is weak and one of our stored networks has a much stronger access
+//                   point nearby, roams to it.  Runs in the network task
+//=========================================================================================================
+void CNetwork::evaluate_roam()
+{
+    wifi_ap_record_t current;
+    scan_entry_t     candidate;
+
+    // We only roam when we're connected and not already in the middle of a roam
+    if (m_wifi_status != WIFI_CONNECTED || m_roam_state != ROAM_IDLE) return;
+
+    // Find out how strong our current access point is
+    if (esp_wifi_sta_get_ap_info(&current) != ESP_OK) return;
+
+    // The low-signal event fires only once per threshold, so re-arm it
+    esp_wifi_set_rssi_threshold(ROAM_RSSI_THRESHOLD);
+
+    // If our signal is fine, stay where we are
+    if (current.rssi >= ROAM_RSSI_THRESHOLD) return;
+
+    // If we roamed recently, don't roam again yet
+    S64 now = esp_timer_get_time();
+    if (m_last_roam_time && now - m_last_roam_time < (S64)ROAM_MIN_INTERVAL_MS * 1000) return;
+
+    // Find the strongest of our stored networks
+    int index = select_network(&candidate);
+    if (index < 0) return;
+
+    // If that's the access point we're already on, or it isn't much better, stay where we are
+    if (memcmp(candidate.bssid, current.bssid, sizeof current.bssid) == 0) return;
+    if (candidate.rssi < current.rssi + ROAM_HYSTERESIS_DB) return;
+
+    ESP_LOGI(WIFI_TAG, "Roaming from %s (%i dBm) to %s on channel %u (%i dBm)", 
+             (char*)current.ssid, current.rssi, candidate.ssid, candidate.channel, candidate.rssi);
+
+    // Remember where we are, in case we can't join the new access point and have to come back
+    m_roam_prev_index   = m_net_index;
+    m_roam_prev_channel = current.primary;
+    memcpy(m_roam_prev_bssid, current.bssid, sizeof m_roam_prev_bssid);
+
+    // Point the driver straight at the new access point
+    wifi_config_t wifi_config;
+    m_net_index = index;
+    fill_sta_config(&wifi_config, index, false);
+    wifi_config.sta.bssid_set   = true;
+    wifi_config.sta.channel     = candidate.channel;
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    memcpy(wifi_config.sta.bssid, candidate.bssid, sizeof candidate.bssid);
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+
+    // And leave the old one.  When the disconnect event arrives, on_disconnected() joins the new one
+    m_roam_state     = ROAM_LEAVING;
+    m_roam_start     = now;
+    m_last_roam_time = now;
+    esp_wifi_disconnect();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// scan_wifi_networks() - Reports each Wi-Fi access point in the scan cache via a callback
+//
+// This never scans or blocks; the results come from the most recent background scans
+//=========================================================================================================
+static void scan_report(const scan_entry_t* p_entry, U32 age_ms, void* context)
+{
+    wifi_scan_rec_t ap;
+    auto callback = (void (*)(const wifi_scan_rec_t*))context;
+
+    // If we have a callback, use it, otherwise just display the name
+    if (callback)
     {
-        // Get a handy reference to the SSID of this Wi-Fi access point
-        char* ssid = (char*) ap_info[i].ssid;
-        
-        // If the SSID is blank, ignore it
-        if (ssid[0] == 0) continue;
-        
-        // If we have a callback, use it, otherwise just display the name
-        if (callback)
-        {
-            ap.ssid     = ssid;
-            ap.rssi     = ap_info[i].rssi;
-            ap.authmode = ap_info[i].authmode;
-            callback(&ap);
-        }
-        else
-            ESP_LOGI(WIFI_TAG, ">>> Wifi Scan found \"%s\"", ssid);
+        ap.ssid     = p_entry->ssid;
+        ap.rssi     = p_entry->rssi;
+        ap.authmode = p_entry->authmode;
+        ap.channel  = p_entry->channel;
+        ap.age_ms   = age_ms;
+        callback(&ap);
     }
+    else
+        ESP_LOGI(WIFI_TAG, ">>> Wifi Scan found \"%s\"", p_entry->ssid);
+}
 
-    // Free the memory we allocated
-    delete[] ap_info;
+void CNetwork::scan_wifi_networks(void (*callback)(const wifi_scan_rec_t*))
+{
+    ScanCache.for_each(scan_report, (void*)callback);
 }
 //=========================================================================================================
@@ -7,13 +7,17 @@
 //
 //=========================================================================================================
 #pragma once
+#include "common.h"
 #include "esp_system.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
+#include "esp_netif.h"
 #include "esp_log.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
+#include "esp_timer.h"
+#include "scan_cache.h"
 
 enum ap_mode_t
 {
@@ -30,12 +34,101 @@ enum wifi_status_t
     WIFI_STOPPED        // All Wi-Fi access has been stopped.  No longer in STA nor AP mode
 };
 
+// Enumerates which event handler to use
+enum evt_handler_type_t {NO_HANDLER, MAIN_HANDLER, TEST_HANDLER};
+
+// These are the events that drive the network state machine
+enum net_event_type_t
+{
+    NET_EVT_STA_START,          // The Wi-Fi has started in STA mode
+    NET_EVT_STA_CONNECTED,      // We've associated with an access point
+    NET_EVT_STA_DISCONNECTED,   // We've lost our connection, or a connection attempt failed
+    NET_EVT_GOT_IP,             // We've been assigned an IP address
+    NET_EVT_GOT_IP6,            // We've been assigned an IPv6 address
+    NET_EVT_RETRY,              // It's time for another attempt to connect to the access point
+    NET_EVT_TEST_START,         // Someone has asked for a Wi-Fi credentials test
+    NET_EVT_TEST_TIMEOUT,       // A Wi-Fi credentials test has taken too long
+    NET_EVT_SCAN_START,         // It's time for a background scan
+    NET_EVT_SCAN_DONE,          // A background scan has completed
+    NET_EVT_RSSI_LOW,           // The signal from our access point has dropped below the roaming threshold
+    NET_EVT_AP_CLIENT,          // A client has joined or left our access point
+    NET_EVT_AP_CHECK            // It's time to check whether AP mode has expired
+};
+
+// These are the stages of roaming from one access point to another
+enum roam_state_t
+{
+    ROAM_IDLE,      // We're not roaming
+    ROAM_LEAVING,   // We've asked to be disconnected from the old access point
+    ROAM_JOINING    // We're connecting to the new access point
+};
+
+// When a Wi-Fi credentials test finishes, one of these is called from the network task
+typedef void (*wifi_test_cb_t)(bool passed, int fail_code, void* context);
+
+// The network task receives one of these for each event.  The event data is a copy, so it remains
+// valid after the system event loop has moved on
+struct net_event_t
+{
+    net_event_type_t    type;
+    evt_handler_type_t  handler;
+    U32                 test_seq;   // For TEST_HANDLER events, the credentials test it belongs to
+    union
+    {
+        wifi_event_sta_connected_t    connected;
+        wifi_event_sta_disconnected_t disconnected;
+        ip_event_got_ip_t             got_ip;
+        ip_event_got_ip6_t            got_ip6;
+        bool                          is_active_scan;
+        bool                          is_joining;
+        struct
+        {
+            U32             timeout_ms;
+            wifi_test_cb_t  callback;
+            void*           context;
+        } test_start;
+    };
+};
+
+// This is the number of events that can be waiting for the network task
+#define NET_EVENT_QUEUE_SIZE 16
+
+// This is the default amount of time a Wi-Fi credentials test is allowed to take
+#define WIFI_TEST_TIMEOUT_MS 15000
+
+// This is reported by wifi_test_fail_code() when a Wi-Fi credentials test times out
+#define WIFI_TEST_FAIL_TIMEOUT 250
+
 // This is reported by scan_wifi_networks()
 struct wifi_scan_rec_t
 {
     const char* ssid;
     S16         rssi;
     S16         authmode;
+    U8          channel;
+    U32         age_ms;     // How long ago this access point was last seen
+};
+
+// Statistics about how long it takes us to reconnect after losing the Wi-Fi connection
+struct reconnect_stats_t
+{
+    U32     count;          // The number of outages we've recovered from
+    U32     fast_count;     // How many of those were recovered by connecting straight to the cached AP
+    U32     attempts;       // The total number of connection attempts
+    U32     last_ms;        // The duration of the most recent outage
+    U32     min_ms;         // The shortest outage
+    U32     max_ms;         // The longest outage
+    U64     total_ms;       // The sum of all outages
+};
+
+// Statistics about roaming from one access point to another
+struct roam_stats_t
+{
+    U32     count;          // The number of successful roams
+    U32     failures;       // The number of roams where we couldn't join the new access point
+    U32     last_ms;        // How long the most recent roam took, from leaving the old AP to getting an IP
+    U32     max_ms;         // The longest roam
+    U64     total_ms;       // The sum of all roams
 };
 
 
@@ -48,51 +141,157 @@ public:
     {
         m_ap_mode_reason = AP_MODE_DEFAULT;
         m_wifi_status = WIFI_CONNECTING;
+        m_reconnect_timer = nullptr;
+        m_retry_count = 0;
+        m_outage_start = 0;
+        memset(&m_reconnect_stats, 0, sizeof m_reconnect_stats);
+        m_is_testing = false;
+        m_is_test_apsta = false;
+        m_test_fail_code = 0;
+        m_test_callback = nullptr;
+        m_test_context = nullptr;
+        m_test_timer = nullptr;
+        m_is_scanning = false;
+        m_is_scan_apsta = false;
+        m_net_index = 0;
+        m_roam_state = ROAM_IDLE;
+        m_roam_start = 0;
+        m_last_roam_time = 0;
+        m_roam_prev_index = 0;
+        m_roam_prev_channel = 0;
+        memset(m_roam_prev_bssid, 0, sizeof m_roam_prev_bssid);
+        memset(&m_roam_stats, 0, sizeof m_roam_stats);
+        m_ap_timer = nullptr;
+        m_ap_channel = 1;
+        m_ap_clients = 0;
+        m_is_ap_rechanneled = false;
     }
 
+    // Call this once at startup to create the network task
+    void    begin();
+
     // Start a connection to an existing network
     void    start();
 
-    // Attempts to connect to Wi-Fi, then returns to AP mode
-    bool    test_wifi_credentials();
+    // Asks the network task to attempt a connection to Wi-Fi and returns immediately.  The callback is
+    // called when the attempt succeeds, fails, or times out.  If we're in AP mode, the AP stays up 
+    // during the test, but it moves to the channel of the network being tested.  Returns 'false' if 
+    // a test is already running
+    bool    start_wifi_test(U32 timeout_ms, wifi_test_cb_t callback, void* context);
+
+    // Attempts to connect to Wi-Fi and waits for the result.  Must not be called from the network task
+    bool    test_wifi_credentials(U32 timeout_ms = WIFI_TEST_TIMEOUT_MS);
 
-    // If test_wifi_credentials() returned false, this is why
+    // Returns 'true' while a Wi-Fi credentials test is running
+    bool    is_testing_wifi() {return m_is_testing;}
+
+    // If a Wi-Fi credentials test failed, this is why
     unsigned char wifi_test_fail_code();
 
     // Configures the WiFi to be an access point
     void    start_as_ap(ap_mode_t reason);
 
-    // Call this to get a list of wifi networks
+    // Call this to get a list of wifi networks from the scan cache.  Never blocks
     void    scan_wifi_networks(void (*callback)(const wifi_scan_rec_t*));
 
+    // Asks the network task to start a background scan
+    void    request_scan(bool is_active);
+
     // Stops all network access
     void    stop();
     
     // Register activity to reset the AP-mode expiration timer
     void    register_activity();
 
+    // Returns the number of milliseconds since the most recent activity on the command server
+    U32     idle_ms() {return (U32)((esp_timer_get_time() - m_last_activity_time) / 1000);}
+
     // Call this to retrieve the current status of the Wi-Fi connection
     wifi_status_t wifi_status() {return m_wifi_status;}
 
     // Call this to find out why we're in AP mode
     ap_mode_t     ap_mode_reason() {return m_ap_mode_reason;}
 
+    // Call this periodically to keep the status in our mDNS TXT record up to date
+    void    update_mdns();
+
+    // Returns the status that we advertise over mDNS
+    const char* mdns_status();
+
+    // In AP mode, these return our channel and the number of connected clients
+    int     ap_channel() {return m_ap_channel;}
+    int     ap_clients() {return m_ap_clients;}
+
     // Call this to find out if we've failed to connect to Wi-Fi due to bad password
     bool    is_bad_password();
 
-public:
+    // Returns statistics about how quickly we reconnect after an outage
+    const reconnect_stats_t& reconnect_stats() {return m_reconnect_stats;}
 
-    // This is the event handler called by the system WiFi stack
-    void event_handler(esp_event_base_t event_base, int32_t event_id, void* event_data);
+    // Returns statistics about roaming between access points
+    const roam_stats_t& roam_stats() {return m_roam_stats;}
 
-    // This is the event handler we use when testing the WiFi credentials
-    void special_event_handler(esp_event_base_t event_base, int32_t event_id, void* event_data);
+    // Returns the index of the stored network we're using (0 = the primary network)
+    int     net_index() {return m_net_index;}
+
+public:
+
+    // Places an event in the queue for the network task.  Returns 'false' if the queue is full
+    bool    inject_event(const net_event_t* p_event);
 
     // This is the code that runs in it's own task and should not be called externally
     void    task();
 
 protected:
 
+    // This is the main event handler.  It runs in the network task
+    void    event_handler(const net_event_t* p_event);
+
+    // This is the event handler we use when testing the WiFi credentials
+    void    special_event_handler(const net_event_t* p_event);
+
+    // These handle individual events for event_handler()
+    void    on_sta_connected(const net_event_t* p_event);
+    void    on_got_ip(const net_event_t* p_event);
+    void    on_got_ip6(const net_event_t* p_event);
+    void    on_disconnected(const net_event_t* p_event);
+
+    // Changes the status of the Wi-Fi connection
+    void    set_status(wifi_status_t new_status);
+
+    // Arranges for a reconnection attempt after an exponential backoff delay
+    void    schedule_reconnect(int disconnect_reason);
+
+    // Starts a Wi-Fi credentials test, and ends one and calls the completion callback
+    void    on_test_start(const net_event_t* p_event);
+    void    finish_wifi_test(int fail_code);
+
+    // Starts a background scan, and handles its completion
+    void    start_scan(bool is_active);
+    void    on_scan_done();
+
+    // Returns the index of the strongest stored network in the scan cache, or -1
+    int     select_network(scan_entry_t* p_entry);
+
+    // Returns the index of the next stored network after the specified one
+    int     next_network(int index);
+
+    // Roams to a better access point if our signal is weak and there's a much stronger one around
+    void    evaluate_roam();
+
+    // Returns the least congested channel for our access point according to the scan cache
+    int     choose_ap_channel(int* p_score);
+
+    // Returns the channel of the network we've been configured for, or 0 if we haven't seen it
+    int     home_channel();
+
+    // Moves our access point to a quieter channel if nobody is using it yet
+    void    rechannel_ap();
+
+    // The AP supervisor.  These track provisioning clients and expire AP mode after inactivity
+    void    on_ap_client(bool is_joining);
+    void    on_ap_check();
+
     // true if we are trying to connected immediately after bootup.
     // false once we have succesfully connected at least once
     bool    m_is_connecting_at_boot;
@@ -106,4 +305,72 @@ protected:
     // The time (in "microseconds since boot") that we saw most recent 
     // network activity
     uint64_t      m_last_activity_time;
+
+    // This timer fires when it's time for the next reconnection attempt
+    esp_timer_handle_t m_reconnect_timer;
+
+    // The number of reconnection attempts since the connection was lost
+    int           m_retry_count;
+
+    // The time (in "microseconds since boot") that the connection was lost, or 0 if we're connected
+    int64_t       m_outage_start;
+
+    // True if the current connection attempt is going straight to the cached access point
+    bool          m_is_fast_attempt;
+
+    // Reconnection statistics
+    reconnect_stats_t m_reconnect_stats;
+
+    // The system event loop and our timers write events into this queue for the network task
+    QueueHandle_t m_event_qh;
+
+    // True from the moment a Wi-Fi credentials test is requested until it finishes
+    volatile bool m_is_testing;
+
+    // True if the current credentials test is running alongside our access point
+    bool          m_is_test_apsta;
+
+    // The reason the most recent credentials test failed, or 0 if it passed
+    int           m_test_fail_code;
+
+    // Who to tell when the current credentials test finishes
+    wifi_test_cb_t m_test_callback;
+    void*         m_test_context;
+
+    // This timer fires when a credentials test has taken too long
+    esp_timer_handle_t m_test_timer;
+
+    // True while a background scan is running
+    bool          m_is_scanning;
+
+    // True if the station interface was added alongside our access point for the current scan
+    bool          m_is_scan_apsta;
+
+    // The index of the stored network we're connected (or trying to connect) to
+    int           m_net_index;
+
+    // Where we are in the process of roaming, when it started, and when we last roamed
+    roam_state_t  m_roam_state;
+    int64_t       m_roam_start;
+    int64_t       m_last_roam_time;
+
+    // The stored network, access point and channel we were on when the current roam started
+    int           m_roam_prev_index;
+    U8            m_roam_prev_bssid[6];
+    U8            m_roam_prev_channel;
+
+    // Roaming statistics
+    roam_stats_t  m_roam_stats;
+
+    // This timer drives the AP supervisor while we're in AP mode
+    esp_timer_handle_t m_ap_timer;
+
+    // The channel our access point is on, and whether it's been moved to a quieter one.  When the 
+    // network we've been configured for is nearby, the access point goes to its channel instead,
+    // because the radio has only one channel and joining that network would drag it there anyway
+    int           m_ap_channel;
+    bool          m_is_ap_rechanneled;
+
+    // The number of clients connected to our access point
+    int           m_ap_clients;
 };
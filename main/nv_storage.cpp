@@ -7,8 +7,15 @@
 #include "common.h"
 #include "globals.h"
 
-// This is the key-name (within the namespace) that the IDF NVS system stores our data structure under
-static const char* KEY_NAME = "data";
+// This is the key-name that older firmware stored our data structure under
+static const char* LEGACY_KEY_NAME = "data";
+
+// We keep two copies of our data structure (an "A/B" pair) and alternate between them on writes,
+// so that a write that gets interrupted by a power failure can never destroy our only good copy
+static const char* SLOT_KEY_NAME[2] = {"data_a", "data_b"};
+
+// This is scratch space for examining the second slot.  It's static to keep it off the task stack
+static nvsdata_t slot_image;
 
 // If this value is in the "data_present" field, we know our structure contains data
 const U32 DATA_PRESENT_MARKER = 0xDEEDBAAF;
@@ -16,11 +23,16 @@ const U32 DATA_PRESENT_MARKER = 0xDEEDBAAF;
 //=========================================================================================================
 // This should be incremented any time a field gets added to the nvsdata_t structure
 //=========================================================================================================
-const int CURRENT_STRUCT_VERSION = 1;
+const int CURRENT_STRUCT_VERSION = 6;
 //--------------------------------------------------------------------------------------------------------
 // Ver  FW_REV  Description
 //--------------------------------------------------------------------------------------------------------
 //   1   1000   Initial creation
+//   2   1000   Added "generation" for A/B slot selection
+//   3   1000   Added "ntp_server"
+//   4   1000   Added "alt_network[]"
+//   5   1000   Added "power_policy"
+//   6   1000   Added "ap_timeout_min"
 //--------------------------------------------------------------------------------------------------------
 //=========================================================================================================
 
@@ -43,22 +55,115 @@ void CNVS::init()
     // If an error occured during the operations above, log it
     ESP_ERROR_CHECK(status);
 
-    // Read the structure that holds our NV data into RAM
-    read_from_flash();
+    // Read the structure that holds our NV data into RAM.  After a warm reboot, NVRAM usually
+    // tells us which slot is newest, and we can skip reading the other one
+    if (!read_hinted_slot()) read_from_flash();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// is_valid() - Returns 'true' if the specified structure has our "data present" marker and a good CRC
+//=========================================================================================================
+bool CNVS::is_valid(nvsdata_t* p_data)
+{
+    // If the "data present" marker isn't there, this structure was never written
+    if (p_data->present_flag != DATA_PRESENT_MARKER) return false;
+
+    // Save the existing CRC
+    U32 old_crc = p_data->crc;
+
+    // The CRC is always computed with the CRC field set to 0
+    p_data->crc = 0;
+    U32 new_crc = crc32(p_data, sizeof(nvsdata_t));
+
+    // Restore the CRC in the structure to its original value
+    p_data->crc = old_crc;
+
+    // Tell the caller whether the CRCs match
+    return old_crc == new_crc;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// read_hinted_slot() - Reads only the slot that NVRAM says was most recently written
+//
+// Returns: 'true' if that slot holds valid data with the generation number NVRAM expects
+//=========================================================================================================
+bool CNVS::read_hinted_slot()
+{
+    int slot = NVRAM.nvs_slot;
+
+    // If NVRAM doesn't know which slot is newest (i.e., this is a cold boot), we can't help
+    if (slot != 0 && slot != 1) return false;
+
+    // Read in that slot
+    memset(&data, 0, sizeof data);
+    FlashIO.read(SLOT_KEY_NAME[slot], (char*)&data);
+
+    // If it's not intact, or isn't the copy we expect, the caller will have to read both slots
+    if (!is_valid(&data) || data.generation != NVRAM.nvs_generation) return false;
+
+    // This slot holds the newest good copy
+    m_active_slot = slot;
+
+    // Initialize any uninitialized fields in our data structure
+    init_default_data();
+    return true;
 }
 //=========================================================================================================
 
 
 //=========================================================================================================
 // read_from_flash() - Reads the structure that holds our NV data into RAM
+//
+// Both slots are read, and the valid copy with the highest generation number wins.  If neither slot
+// is valid, we fall back to the single copy that older firmware stored under LEGACY_KEY_NAME
 //=========================================================================================================
 void CNVS::read_from_flash()
 {
-    // Just for safety, clear out the existing data structure
-    memset(&data, 0, sizeof data);
+    // Just for safety, clear out the existing data structure and our scratch copy
+    memset(&data,       0, sizeof data);
+    memset(&slot_image, 0, sizeof slot_image);
+
+    // Read in both copies of our NVS data structure from flash 
+    FlashIO.read(SLOT_KEY_NAME[0], (char*)&data);
+    FlashIO.read(SLOT_KEY_NAME[1], (char*)&slot_image);
 
-    // Read in our NVS data structure from flash 
-    FlashIO.read(KEY_NAME, (char*)&data);
+    // Find out which of the two copies are intact
+    bool a_is_valid = is_valid(&data);
+    bool b_is_valid = is_valid(&slot_image);
+
+    // If either copy was written but is corrupted (i.e., a torn write), say so
+    if (!a_is_valid && data.present_flag       == DATA_PRESENT_MARKER) printf("NVS slot A is corrupt\n");
+    if (!b_is_valid && slot_image.present_flag == DATA_PRESENT_MARKER) printf("NVS slot B is corrupt\n");
+
+    // Presume for the moment that slot A is the newest good copy
+    m_active_slot = 0;
+
+    // If slot B is good and newer than slot A (or slot A is bad), use slot B
+    if (b_is_valid && (!a_is_valid || slot_image.generation > data.generation))
+    {
+        memcpy(&data, &slot_image, sizeof data);
+        m_active_slot = 1;
+    }
+
+    // If neither slot holds a good copy, see if there is data from older firmware
+    else if (!a_is_valid)
+    {
+        m_active_slot = -1;
+        memset(&data, 0, sizeof data);
+        FlashIO.read(LEGACY_KEY_NAME, (char*)&data);
+        if (!is_valid(&data)) memset(&data, 0, sizeof data);
+    }
+
+    // Tell the next warm boot which slot is newest
+    if (m_active_slot >= 0)
+    {
+        NVRAM.nvs_slot       = m_active_slot;
+        NVRAM.nvs_generation = data.generation;
+    }
 
     // Initialize any uninitialized fields in our data structure
     init_default_data();
@@ -91,6 +196,30 @@ void CNVS::init_default_data()
     //
     //-----------------------------------------------------------------------------------------------
 
+    // An empty NTP server name means "use the default server"
+    if (data.struct_version < 3)
+    {
+        memset(data.ntp_server, 0, sizeof data.ntp_server);
+    }
+
+    // There are no alternate Wi-Fi networks until someone configures them
+    if (data.struct_version < 4)
+    {
+        memset(data.alt_network, 0, sizeof data.alt_network);
+    }
+
+    // The power-save mode is chosen automatically unless someone says otherwise
+    if (data.struct_version < 5)
+    {
+        data.power_policy = 0;
+    }
+
+    // AP mode expires after 15 minutes of inactivity
+    if (data.struct_version < 6)
+    {
+        data.ap_timeout_min = 15;
+    }
+
     // Indicate that the data structure is of the most recent format
     data.struct_version = CURRENT_STRUCT_VERSION;
 }
@@ -100,15 +229,33 @@ void CNVS::init_default_data()
 
 //=========================================================================================================
 // write_to_flash() - Writes the RAM structure that holds our NV data into flash memory
+//
+// Passed: lane = The FlashIO priority lane to perform the write in
 //=========================================================================================================
-void CNVS::write_to_flash()
+void CNVS::write_to_flash(flash_lane_t lane)
 {
+    // We always overwrite the older of the two slots, leaving the newest good copy untouched
+    int slot = (m_active_slot == 0) ? 1 : 0;
+
+    // This copy is newer than any copy already in flash
+    ++data.generation;
+
     // Compute a new CRC for the data
     data.crc = 0;
     data.crc = crc32(&data, sizeof data);
 
+    // Until this write is complete, the next warm boot can't trust NVRAM to know which slot is newest
+    NVRAM.nvs_slot = -1;
+
     // And write our NVS structure to flash memory
-    FlashIO.write(KEY_NAME, (char*)&data, sizeof data);
+    FlashIO.write(SLOT_KEY_NAME[slot], (char*)&data, sizeof data, lane);
+
+    // The slot we just wrote is now the newest good copy
+    m_active_slot = slot;
+
+    // Tell the next warm boot which slot is newest
+    NVRAM.nvs_slot       = slot;
+    NVRAM.nvs_generation = data.generation;
 }
 //=========================================================================================================
 
@@ -3,6 +3,7 @@
 //=========================================================================================================
 #pragma once
 #include "common.h"
+#include "flash_io.h"
 
 
 //=========================================================================================================
@@ -18,8 +19,14 @@ public:
     // Read our data structure from flash memory
     void        read_from_flash();
 
-    // Write our data structure to flash memory
-    void        write_to_flash();
+    // Write our data structure to flash memory.  Use FLASH_LANE_URGENT for a last-gasp save
+    void        write_to_flash(flash_lane_t lane = FLASH_LANE_NORMAL);
+
+    // Returns 'true' if "data" has been changed since it was last read from or written to flash
+    bool        is_dirty() {return !is_valid(&data);}
+
+    // Returns the slot (0 or 1) that "data" was loaded from/written to, or -1 if neither
+    int         active_slot() {return m_active_slot;}
 
     // This structure contains the actual data fields that we read/write to/from NVS
     nvsdata_t   data;
@@ -29,5 +36,14 @@ protected:
     // This initializes our "data" structure to default values
     void        init_default_data();
 
+    // Returns 'true' if the structure has a valid marker and CRC
+    bool        is_valid(nvsdata_t* p_data);
+
+    // Reads only the slot that NVRAM says is newest.  Returns 'false' if that can't be trusted
+    bool        read_hinted_slot();
+
+    // The slot that holds the newest valid copy of our data.  Writes go to the other one.
+    int         m_active_slot;
+
 };
 //=========================================================================================================
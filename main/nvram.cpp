@@ -6,7 +6,7 @@
 #include "common.h"
 
 // We will look for this string in NVRAM to determine whether we have data there
-#define MAGIC_KEY "**nvram**"
+#define MAGIC_KEY "**nvram3**"
 
 //=========================================================================================================
 // Constructor() - Initializes our data, but only on the first boot after power-up
@@ -21,6 +21,13 @@ CNVRAM::CNVRAM()
 
     // We aren't going to force Wi-Fi to start in access-point mode
     start_wifi_ap = false;
+
+    // We don't yet know which NVS slot holds the newest data
+    nvs_slot = -1;
+    nvs_generation = 0;
+
+    // We don't know of an access point to reconnect to
+    wifi_cache_valid = false;
 }
 //=========================================================================================================
 
@@ -14,6 +14,20 @@ public:
     // This will be true if Wi-Fi should start in access-point mode
     bool    start_wifi_ap;
 
+    // The NVS slot (0 or 1) that was most recently written, or -1 if we don't know
+    int     nvs_slot;
+
+    // The generation number of the data in that slot
+    unsigned int nvs_generation;
+
+    // The access point we were most recently connected to.  This lets us reconnect without a scan
+    bool          wifi_cache_valid;
+    unsigned char wifi_bssid[6];
+    unsigned char wifi_channel;
+
+    // The CRC of the SSID and password that go with the cached access point
+    unsigned int  wifi_cred_crc;
+
 protected:
 
     // This will contain a "magic string" if this object has already been initialized
@@ -0,0 +1,193 @@
+//=========================================================================================================
+// power_mgr.cpp - Implements the policy that chooses the Wi-Fi power-save mode (and CPU clock)
+//=========================================================================================================
+#include "esp_wifi.h"
+#include "esp_pm.h"
+#include "globals.h"
+
+// The estimated current draw and added command latency of each mode.  The current figures are typical
+// values for an ESP32 associated with an idle access point; the latency is how long an incoming
+// packet can wait at the access point for us to wake up
+static const power_mode_info_t mode_table[POWER_MODE_COUNT] =
+{
+    {"full",     115, 0},
+    {"balanced",  30, POWER_BEACON_MS},
+    {"low",       20, POWER_BEACON_MS * POWER_LISTEN_INTERVAL}
+};
+
+// The names of the policies, in the same order as power_policy_t
+static const char* policy_names[POWER_POLICY_COUNT] = {"auto", "full", "balanced", "low"};
+
+// If dynamic frequency scaling is available, we hold this lock to keep the CPU at full speed
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t cpu_lock;
+#endif
+
+
+//=========================================================================================================
+// init() - Reads the policy from NVS and puts it into effect
+//=========================================================================================================
+void CPowerMgr::init()
+{
+    // Create the mutex that serializes mode changes
+    m_mutex = xSemaphoreCreateMutex();
+
+    // Fetch the policy from NVS, making sure it's sane
+    m_policy = (power_policy_t)NVS.data.power_policy;
+    if (m_policy >= POWER_POLICY_COUNT) m_policy = POWER_POLICY_AUTO;
+
+    // We haven't spent any time in any mode yet
+    memset(m_residency_ms, 0, sizeof m_residency_ms);
+    m_switch_count = 0;
+    m_mode_start   = esp_timer_get_time();
+    m_mode         = POWER_MODE_FULL;
+
+    // If power management is compiled in, let the CPU clock drop when nobody needs it to be fast.  The
+    // floor is 80 MHz because below that the APB clock drops too, and the I2C timings assume 80 MHz
+    #if CONFIG_PM_ENABLE
+    esp_pm_config_esp32_t pm_config;
+    pm_config.max_freq_mhz       = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+    pm_config.min_freq_mhz       = 80;
+    pm_config.light_sleep_enable = false;
+    if (esp_pm_configure(&pm_config) != ESP_OK) ESP_LOGE("Power", "Can't configure frequency scaling");
+    esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "power_mgr", &cpu_lock);
+    esp_pm_lock_acquire(cpu_lock);
+    #endif
+
+    // And start out in whatever mode the policy calls for
+    update(true);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// choose_mode() - Decides which mode we should be in right now
+//=========================================================================================================
+power_mode_t CPowerMgr::choose_mode()
+{
+    // Power save only works in STA mode.  Any other time, the radio stays on
+    if (Network.wifi_status() != WIFI_CONNECTED) return POWER_MODE_FULL;
+
+    // If the policy forces a mode, that's the mode we're in
+    switch (m_policy)
+    {
+        case POWER_POLICY_FULL:     return POWER_MODE_FULL;
+        case POWER_POLICY_BALANCED: return POWER_MODE_BALANCED;
+        case POWER_POLICY_LOW:      return POWER_MODE_LOW;
+        default:                    break;
+    }
+
+    // Otherwise, the longer the command server has been quiet, the deeper we sleep
+    U32 idle_ms = Network.idle_ms();
+    if (idle_ms < POWER_ACTIVE_MS)   return POWER_MODE_FULL;
+    if (idle_ms < POWER_BALANCED_MS) return POWER_MODE_BALANCED;
+    return POWER_MODE_LOW;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// apply() - Switches to a new mode
+//
+// On Entry: the caller is holding m_mutex
+//=========================================================================================================
+void CPowerMgr::apply(power_mode_t mode)
+{
+    static const wifi_ps_type_t ps_type[POWER_MODE_COUNT] = {WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM};
+
+    // Keep track of how long we spent in the mode we're leaving
+    S64 now = esp_timer_get_time();
+    m_residency_ms[m_mode] += (U32)((now - m_mode_start) / 1000);
+    m_mode_start = now;
+
+    // Tell the radio.  If we're not in STA mode, this fails harmlessly and we'll try again later
+    esp_wifi_set_ps(ps_type[mode]);
+
+    // At full power, keep the CPU at full speed too
+    #if CONFIG_PM_ENABLE
+    if (mode == POWER_MODE_FULL && m_mode != POWER_MODE_FULL) esp_pm_lock_acquire(cpu_lock);
+    if (mode != POWER_MODE_FULL && m_mode == POWER_MODE_FULL) esp_pm_lock_release(cpu_lock);
+    #endif
+
+    // If the mode is actually changing, keep track of that
+    if (mode != m_mode)
+    {
+        ESP_LOGI("Power", "Power mode %s -> %s", mode_table[m_mode].name, mode_table[mode].name);
+        m_mode = mode;
+        ++m_switch_count;
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// update() - Switches modes if the policy calls for a different one.  Call this periodically
+//
+// Passed: force = true to tell the radio the mode even if it hasn't changed.  The driver resets the
+//                 power-save mode each time it connects, so the network code forces an update then
+//=========================================================================================================
+void CPowerMgr::update(bool force)
+{
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    power_mode_t mode = choose_mode();
+    if (force || mode != m_mode) apply(mode);
+    xSemaphoreGive(m_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// on_activity() - Called each time a command arrives
+//
+// This is called for every command, so it does nothing unless we need to wake up
+//=========================================================================================================
+void CPowerMgr::on_activity()
+{
+    if (m_policy == POWER_POLICY_AUTO && m_mode != POWER_MODE_FULL) update();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// set_policy() - Changes the policy, saves it in NVS, and puts it into effect
+//=========================================================================================================
+void CPowerMgr::set_policy(power_policy_t policy)
+{
+    m_policy = policy;
+    NVS.data.power_policy = policy;
+    NVS.write_to_flash();
+    update();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// mode_info() - Returns the name, estimated current draw and added latency of a mode
+//=========================================================================================================
+const power_mode_info_t& CPowerMgr::mode_info(power_mode_t mode)
+{
+    return mode_table[mode];
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// policy_name() - Returns the name of a policy
+//=========================================================================================================
+const char* CPowerMgr::policy_name(power_policy_t policy)
+{
+    return policy_names[policy];
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// residency_ms() - Returns the number of milliseconds spent in a mode since boot
+//=========================================================================================================
+U32 CPowerMgr::residency_ms(power_mode_t mode)
+{
+    U32 result = m_residency_ms[mode];
+    if (mode == m_mode) result += (U32)((esp_timer_get_time() - m_mode_start) / 1000);
+    return result;
+}
+//=========================================================================================================
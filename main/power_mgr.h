@@ -0,0 +1,125 @@
+//=========================================================================================================
+// power_mgr.h - Defines the policy that chooses the Wi-Fi power-save mode (and CPU clock)
+//
+// When a command arrives on the TCP server, we switch to full power so that the conversation that
+// follows is snappy.  As the command server goes quiet, we step down through modem-sleep modes that
+// save more power but add more latency to the next command.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+
+// In the automatic policy, we stay at full power for this long after the most recent command...
+#define POWER_ACTIVE_MS         10000
+
+// ...and then in the "balanced" mode for this long before dropping to the "low" mode
+#define POWER_BALANCED_MS       (2 * 60 * 1000)
+
+// In the "low" mode, the station wakes up for every Nth beacon.  Most access points send a DTIM with
+// every beacon, so this keeps our wake-ups DTIM-aligned
+#define POWER_LISTEN_INTERVAL   3
+
+// The nominal beacon interval of an access point, in milliseconds (100 TU)
+#define POWER_BEACON_MS         102
+
+
+//=========================================================================================================
+// These are the power modes, from the most power-hungry to the least
+//=========================================================================================================
+enum power_mode_t
+{
+    POWER_MODE_FULL,        // No power save.  The radio is always on
+    POWER_MODE_BALANCED,    // Modem sleep, waking for every DTIM
+    POWER_MODE_LOW,         // Modem sleep, waking every POWER_LISTEN_INTERVAL beacons
+    POWER_MODE_COUNT
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// These are the policies that can be stored in NVS.  "Auto" picks a mode based on activity, the
+// others force a particular mode
+//=========================================================================================================
+enum power_policy_t
+{
+    POWER_POLICY_AUTO,
+    POWER_POLICY_FULL,
+    POWER_POLICY_BALANCED,
+    POWER_POLICY_LOW,
+    POWER_POLICY_COUNT
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// Describes one of the power modes
+//=========================================================================================================
+struct power_mode_info_t
+{
+    const char* name;
+    U16         current_ma;     // Estimated average current draw while connected and idle
+    U16         latency_ms;     // Estimated worst-case latency added to an incoming command
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CPowerMgr - Singleton class, manages the Wi-Fi power-save mode
+//=========================================================================================================
+class CPowerMgr
+{
+public:
+
+    // Call this once at startup, after NVS has been initialized
+    void    init();
+
+    // Call this periodically to let the policy step down as the command server goes quiet.  Pass
+    // true to re-apply the mode even if it hasn't changed
+    void    update(bool force = false);
+
+    // Called when a command arrives, so that we can switch to full power immediately
+    void    on_activity();
+
+    // Changes the policy and saves it in NVS
+    void    set_policy(power_policy_t policy);
+
+    // Returns the current policy and mode
+    power_policy_t  policy() {return m_policy;}
+    power_mode_t    mode()   {return m_mode;}
+
+    // Returns information about one of the power modes
+    const power_mode_info_t& mode_info(power_mode_t mode);
+
+    // Returns the name of a policy
+    const char*     policy_name(power_policy_t policy);
+
+    // Returns the number of milliseconds spent in a mode since boot
+    U32     residency_ms(power_mode_t mode);
+
+    // Returns the number of times we've switched modes
+    U32     switch_count() {return m_switch_count;}
+
+protected:
+
+    // Decides which mode we should be in right now
+    power_mode_t    choose_mode();
+
+    // Switches to a new mode
+    void    apply(power_mode_t mode);
+
+    // The policy and the mode that's currently in effect
+    power_policy_t  m_policy;
+    power_mode_t    m_mode;
+
+    // The time (in microseconds since boot) that we entered the current mode
+    S64             m_mode_start;
+
+    // The total time spent in each mode before the current one started, in milliseconds
+    U32             m_residency_ms[POWER_MODE_COUNT];
+
+    // The number of times we've switched modes
+    U32             m_switch_count;
+
+    // Serializes mode changes between the periodic task and the TCP server
+    SemaphoreHandle_t m_mutex;
+};
+//=========================================================================================================
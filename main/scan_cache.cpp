@@ -0,0 +1,242 @@
+//=========================================================================================================
+// scan_cache.cpp - Implements a cache of the Wi-Fi access points we've seen in recent scans
+//=========================================================================================================
+#include "globals.h"
+
+
+//=========================================================================================================
+// now_ms() - Returns the number of milliseconds since power-up
+//=========================================================================================================
+static U32 now_ms() {return (U32)(esp_timer_get_time() / 1000);}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// timer_cb() - Called by the ESP timer each time it's time for a background scan
+//=========================================================================================================
+static void timer_cb(void*)
+{
+    Network.request_scan(ScanCache.next_is_active());
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// init() - Creates the empty cache
+//
+// The network looks things up in the cache as soon as it starts, so this must run before it does
+//=========================================================================================================
+void CScanCache::init()
+{
+    // Create the mutex that we will use to ensure thread-safe access to the pool
+    m_mutex = xSemaphoreCreateMutex();
+
+    // The cache starts out empty
+    m_count        = 0;
+    m_scan_count   = 0;
+    m_last_scan_ms = 0;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// start() - Creates the timer that drives background scans, and asks for the first one
+//=========================================================================================================
+void CScanCache::start()
+{
+    // Create the timer that periodically asks for a background scan
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof timer_args);
+    timer_args.callback = timer_cb;
+    timer_args.name     = "wifi_scan";
+    esp_timer_create(&timer_args, &m_timer);
+    esp_timer_start_periodic(m_timer, (U64)SCAN_INTERVAL_MS * 1000);
+
+    // And fill the cache as soon as the network lets us
+    refresh(true);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// refresh() - Asks the network task to start a scan right away
+//=========================================================================================================
+void CScanCache::refresh(bool is_active)
+{
+    Network.request_scan(is_active);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get_scan_config() - Fills in the configuration for a scan
+//
+// Passive scans just listen for beacons, so they don't disturb anyone.  Active scans send probe
+// requests, which is the only way to find hidden networks
+//=========================================================================================================
+void CScanCache::get_scan_config(wifi_scan_config_t* p_config, bool is_active)
+{
+    memset(p_config, 0, sizeof *p_config);
+    p_config->show_hidden = true;
+
+    if (is_active)
+    {
+        p_config->scan_type            = WIFI_SCAN_TYPE_ACTIVE;
+        p_config->scan_time.active.min = 50;
+        p_config->scan_time.active.max = 120;
+    }
+    else
+    {
+        p_config->scan_type         = WIFI_SCAN_TYPE_PASSIVE;
+        p_config->scan_time.passive = 120;
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// on_scan_done() - Fetches the results of a completed scan and merges them into the cache
+//
+// This runs in the network task
+//=========================================================================================================
+void CScanCache::on_scan_done()
+{
+    U16 count = SCAN_MAX_RECORDS;
+
+    // Fetch the records into our fixed buffer.  This also frees the driver's copy of the results
+    if (esp_wifi_scan_get_ap_records(&count, m_raw) != ESP_OK) count = 0;
+
+    // Find out what time it is
+    U32 now = now_ms();
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+    // Merge each record into the cache
+    for (int i=0; i<count; ++i) merge(m_raw + i, now);
+
+    // Throw away any records that we haven't seen in a long time
+    for (int i=0; i<m_count;)
+    {
+        if (now - m_pool[i].last_seen_ms > SCAN_EXPIRE_MS)
+            m_pool[i] = m_pool[--m_count];
+        else
+            ++i;
+    }
+
+    // Keep track of when this scan completed
+    ++m_scan_count;
+    m_last_scan_ms = now;
+
+    xSemaphoreGive(m_mutex);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// merge() - Merges a single access-point record into the cache
+//
+// On Entry: the caller is holding m_mutex
+//=========================================================================================================
+void CScanCache::merge(const wifi_ap_record_t* p_ap, U32 now)
+{
+    scan_entry_t* p_entry = nullptr;
+    const char* ssid = (const char*)p_ap->ssid;
+
+    // If the SSID is blank, ignore it
+    if (ssid[0] == 0) return;
+
+    // Look for this SSID in the cache
+    for (int i=0; i<m_count; ++i) if (strcmp(m_pool[i].ssid, ssid) == 0)
+    {
+        p_entry = m_pool + i;
+        break;
+    }
+
+    // If we already have this SSID, only replace it if this is the same access point, a stronger one,
+    // or the one we have wasn't seen in this scan
+    if (p_entry)
+    {
+        bool is_same_ap = memcmp(p_entry->bssid, p_ap->bssid, sizeof p_entry->bssid) == 0;
+        if (!is_same_ap && p_ap->rssi < p_entry->rssi && p_entry->last_seen_ms == now) return;
+    }
+
+    // Otherwise, if there's room in the pool, add a new entry
+    else if (m_count < SCAN_CACHE_SIZE) p_entry = m_pool + m_count++;
+
+    // Otherwise the pool is full, so replace the weakest entry if this one is stronger
+    else
+    {
+        p_entry = m_pool;
+        for (int i=1; i<m_count; ++i) if (m_pool[i].rssi < p_entry->rssi) p_entry = m_pool + i;
+        if (p_ap->rssi <= p_entry->rssi) return;
+    }
+
+    // Fill in the entry
+    strncpy(p_entry->ssid, ssid, sizeof p_entry->ssid - 1);
+    p_entry->ssid[sizeof p_entry->ssid - 1] = 0;
+    memcpy(p_entry->bssid, p_ap->bssid, sizeof p_entry->bssid);
+    p_entry->rssi         = p_ap->rssi;
+    p_entry->channel      = p_ap->primary;
+    p_entry->authmode     = p_ap->authmode;
+    p_entry->last_seen_ms = now;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// for_each() - Calls the callback for every record in the cache
+//
+// Passed: callback = The routine to call for each record.  It must not call back into ScanCache
+//         context  = Arbitrary pointer that is handed to the callback
+//
+// Returns: The number of records in the cache
+//=========================================================================================================
+int CScanCache::for_each(void (*callback)(const scan_entry_t*, U32 age_ms, void*), void* context)
+{
+    U32 now = now_ms();
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    int count = m_count;
+    for (int i=0; i<count; ++i) callback(m_pool + i, now - m_pool[i].last_seen_ms, context);
+    xSemaphoreGive(m_mutex);
+
+    return count;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// find() - Looks up an SSID in the cache
+//
+// Passed: ssid    = The SSID we're looking for
+//         p_entry = If the SSID is found, a copy of its record is stored here
+//
+// Returns: 'true' if the SSID is in the cache
+//=========================================================================================================
+bool CScanCache::find(const char* ssid, scan_entry_t* p_entry)
+{
+    bool found = false;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    for (int i=0; i<m_count; ++i) if (strcmp(m_pool[i].ssid, ssid) == 0)
+    {
+        *p_entry = m_pool[i];
+        found = true;
+        break;
+    }
+    xSemaphoreGive(m_mutex);
+
+    return found;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// age_ms() - Returns the number of milliseconds since the most recent scan completed, or -1
+//=========================================================================================================
+S32 CScanCache::age_ms()
+{
+    if (m_scan_count == 0) return -1;
+    return (S32)(now_ms() - m_last_scan_ms);
+}
+//=========================================================================================================
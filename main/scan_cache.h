@@ -0,0 +1,112 @@
+//=========================================================================================================
+// scan_cache.h - Defines a cache of the Wi-Fi access points we've seen in recent scans
+//
+// A timer periodically asks the network task to run a background scan (mostly passive, with an active
+// scan every few rounds to find hidden networks).  The results are merged into a fixed pool of
+// records, one per SSID, so nobody ever has to wait for a scan and no memory is allocated per scan.
+// Records that haven't been seen in a while are dropped.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+#include "esp_wifi.h"
+#include "esp_timer.h"
+
+// The maximum number of distinct SSIDs the cache can hold
+#define SCAN_CACHE_SIZE         32
+
+// The maximum number of raw records we fetch from the driver after each scan
+#define SCAN_MAX_RECORDS        32
+
+// We start a background scan this often
+#define SCAN_INTERVAL_MS        (60 * 1000)
+
+// Every Nth background scan is an active scan, the rest are passive
+#define SCAN_ACTIVE_EVERY       4
+
+// A record that hasn't been seen in a scan for this long is dropped from the cache
+#define SCAN_EXPIRE_MS          (5 * 60 * 1000)
+
+
+//=========================================================================================================
+// One of these exists in the cache for each SSID we've seen.  If an SSID is served by more than one
+// access point, this describes the strongest one
+//=========================================================================================================
+struct scan_entry_t
+{
+    char    ssid[33];
+    U8      bssid[6];
+    S8      rssi;
+    U8      channel;
+    U8      authmode;
+    U32     last_seen_ms;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CScanCache - Singleton class, manages the cache of scan results
+//=========================================================================================================
+class CScanCache
+{
+public:
+
+    // Call this once at startup, before the network starts, to create the empty cache
+    void    init();
+
+    // Call this once the network is up to start the background scans
+    void    start();
+
+    // Asks the network task to start a scan right away
+    void    refresh(bool is_active);
+
+    // Calls the callback for every record in the cache.  The age of the record is in milliseconds.
+    // Returns the number of records
+    int     for_each(void (*callback)(const scan_entry_t*, U32 age_ms, void*), void* context);
+
+    // Returns 'true' and fills in *p_entry if the specified SSID is in the cache
+    bool    find(const char* ssid, scan_entry_t* p_entry);
+
+    // Returns the number of milliseconds since the last scan completed, or -1 if there hasn't been one
+    S32     age_ms();
+
+    // Returns the number of scans that have completed
+    U32     scan_count() {return m_scan_count;}
+
+public:
+
+    // These are called by the network task.  They shouldn't be called externally
+
+    // Returns the configuration for the next scan
+    void    get_scan_config(wifi_scan_config_t* p_config, bool is_active);
+
+    // Returns 'true' if the next periodic scan should be an active one
+    bool    next_is_active() {return m_scan_count % SCAN_ACTIVE_EVERY == 0;}
+
+    // Fetches the results of a completed scan from the driver and merges them into the cache
+    void    on_scan_done();
+
+protected:
+
+    // Merges a single access-point record into the cache
+    void    merge(const wifi_ap_record_t* p_ap, U32 now_ms);
+
+    // The cache of records, one per SSID
+    scan_entry_t        m_pool[SCAN_CACHE_SIZE];
+
+    // The number of entries in m_pool that are in use
+    int                 m_count;
+
+    // The raw records from the driver land here before being merged into the pool
+    wifi_ap_record_t    m_raw[SCAN_MAX_RECORDS];
+
+    // The number of scans that have completed, and when the most recent one did
+    U32                 m_scan_count;
+    U32                 m_last_scan_ms;
+
+    // This timer fires each time it's time for a background scan
+    esp_timer_handle_t  m_timer;
+
+    // Protects the pool
+    SemaphoreHandle_t   m_mutex;
+};
+//=========================================================================================================
@@ -0,0 +1,384 @@
+//=========================================================================================================
+// sensor_sched.cpp - Implements a scheduler that samples I2C sensors periodically
+//=========================================================================================================
+#include "globals.h"
+
+// This protects the sensor table, which is shared by the timer task, the I2C engine, and readers
+// of statistics
+static portMUX_TYPE sched_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+//=========================================================================================================
+// timer_cb() - Called by the ESP timer when the next sensor is due
+//=========================================================================================================
+static void timer_cb(void*)
+{
+    Sensors.on_timer();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// done_cb() - Called by the I2C engine when a batch has been performed
+//=========================================================================================================
+static void done_cb(CI2CBatch* p_batch, bool status, void* context)
+{
+    Sensors.on_batch_done(status);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// init() - Creates the timer that drives the scheduler
+//=========================================================================================================
+void CSensorSched::init()
+{
+    // No sensors have been registered, and no batch is on the bus
+    m_count      = 0;
+    m_batch_mask = 0;
+    m_due_mask   = 0;
+    m_is_busy    = false;
+
+    // Create the timer that fires when the next sensor is due
+    esp_timer_create_args_t timer_args;
+    memset(&timer_args, 0, sizeof timer_args);
+    timer_args.callback = timer_cb;
+    timer_args.name     = "sensors";
+    esp_timer_create(&timer_args, &m_timer);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// add() - Registers a sensor
+//
+// Passed: i2c_address = The 7-bit address of the device
+//         reg         = The register to read
+//         reg_len     = The number of bytes in the register address (0 = the device has no registers)
+//         length      = The number of bytes to read, up to SENSOR_MAX_BYTES
+//         period_ms   = How often to read the sensor
+//
+// Returns: The ID of the sensor, or -1 if there's no room or the recipe is invalid
+//=========================================================================================================
+int CSensorSched::add(int i2c_address, int reg, int reg_len, int length, U32 period_ms)
+{
+    // Make sure the recipe is sane
+    if (i2c_address < 0 || i2c_address >= I2C_ADDRESS_COUNT) return -1;
+    if (length < 1 || length > SENSOR_MAX_BYTES || reg_len < 0 || reg_len > 2 || period_ms == 0) return -1;
+
+    portENTER_CRITICAL(&sched_mux);
+
+    // If there's no room for another sensor, tell the caller
+    if (m_count == SENSOR_MAX)
+    {
+        portEXIT_CRITICAL(&sched_mux);
+        return -1;
+    }
+
+    // Fill in the new sensor.  Its first sample is due right away
+    int id = m_count;
+    sensor_t& sensor = m_sensor[id];
+    memset(&sensor, 0, sizeof sensor);
+    sensor.address   = i2c_address;
+    sensor.reg       = reg;
+    sensor.reg_len   = reg_len;
+    sensor.length    = length;
+    sensor.period_us = period_ms * 1000;
+    sensor.next_due  = esp_timer_get_time();
+    ++m_count;
+
+    portEXIT_CRITICAL(&sched_mux);
+
+    // Make sure the timer fires in time for the new sensor
+    schedule_next();
+    return id;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// schedule_next() - Re-arms the timer to fire at the earliest deadline
+//=========================================================================================================
+void CSensorSched::schedule_next()
+{
+    S64 earliest = 0;
+
+    // Find the earliest deadline.  If a batch is on the bus, its completion will call us again
+    portENTER_CRITICAL(&sched_mux);
+    bool is_busy = m_is_busy;
+    for (int i=0; i<m_count; ++i)
+    {
+        if (i == 0 || m_sensor[i].next_due < earliest) earliest = m_sensor[i].next_due;
+    }
+    int count = m_count;
+    portEXIT_CRITICAL(&sched_mux);
+
+    if (count == 0 || is_busy) return;
+
+    // Arm the timer for that deadline
+    S64 delay = earliest - esp_timer_get_time();
+    if (delay < 0) delay = 0;
+    esp_timer_stop(m_timer);
+    esp_timer_start_once(m_timer, delay);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// on_timer() - Called when one or more sensors are due.  Submits a batch that reads all of them
+//
+// This runs in the ESP timer task, so it never touches the bus itself
+//=========================================================================================================
+void CSensorSched::on_timer()
+{
+    U32 due_mask = 0;
+    S64 now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&sched_mux);
+
+    // If the previous batch is still on the bus, we'll be called again when it's done
+    if (m_is_busy)
+    {
+        portEXIT_CRITICAL(&sched_mux);
+        return;
+    }
+
+    // Find every sensor that's due now, or will be in a moment
+    for (int i=0; i<m_count; ++i)
+    {
+        sensor_t& sensor = m_sensor[i];
+        if (sensor.next_due > now + SENSOR_MERGE_US) continue;
+
+        // This sample is for the most recent deadline.  If we've fallen more than a full period
+        // behind, the deadlines in between have been missed
+        sensor.deadline = sensor.next_due;
+        while (sensor.deadline + sensor.period_us <= now)
+        {
+            sensor.deadline += sensor.period_us;
+            ++sensor.stats.missed;
+        }
+        sensor.next_due = sensor.deadline + sensor.period_us;
+        due_mask |= (1 << i);
+    }
+
+    // If nothing is due after all, we're done
+    if (due_mask == 0)
+    {
+        portEXIT_CRITICAL(&sched_mux);
+        schedule_next();
+        return;
+    }
+
+    m_is_busy = true;
+    m_due_mask = due_mask;
+
+    // Sensors that failed last time are read on their own, so that they can't take the others down
+    // with them.  If every sensor that's due is failing, the batch might as well read them all
+    U32 batch_mask = due_mask;
+    for (int i=0; i<m_count; ++i) if (m_sensor[i].is_failing) batch_mask &= ~(1 << i);
+    if (batch_mask == 0) batch_mask = due_mask;
+    portEXIT_CRITICAL(&sched_mux);
+
+    // If a different set of sensors is in the batch this time, build a new one.  Otherwise the batch we
+    // built last time can be performed again as-is.  Before ESP-IDF 4.4, building a batch means a
+    // heap allocation for every command in it, so in the steady state, when the same sensors come due
+    // together every time, we never rebuild
+    if (batch_mask != m_batch_mask)
+    {
+        m_batch.reset();
+        for (int i=0; i<m_count; ++i) if (batch_mask & (1 << i))
+        {
+            sensor_t& sensor = m_sensor[i];
+            if (sensor.reg_len)
+                m_batch.read_reg(sensor.address, sensor.reg, sensor.reg_len, sensor.stage, sensor.length);
+            else
+                m_batch.read(sensor.address, sensor.stage, sensor.length);
+        }
+        m_batch_mask = batch_mask;
+    }
+
+    // Hand the batch to the I2C engine
+    if (I2CEngine.submit(&m_batch, done_cb)) return;
+
+    // If its queue is full, none of the sensors could be read.  That's no fault of the sensors, so
+    // they aren't marked as failing
+    portENTER_CRITICAL(&sched_mux);
+    for (int i=0; i<m_count; ++i) if (due_mask & (1 << i)) ++m_sensor[i].stats.errors;
+    m_is_busy = false;
+    portEXIT_CRITICAL(&sched_mux);
+    schedule_next();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// on_batch_done() - Timestamps and publishes the results of a batch
+//
+// Passed: status = 'true' if the batch was performed successfully
+//
+// This runs in the I2C engine task, with the bus locked.  If a batch of several sensors
+// failed, we don't know which of them didn't answer, so each of them is read again on its own.  The
+// sensors that were left out of the batch are read on their own too
+//=========================================================================================================
+void CSensorSched::on_batch_done(bool status)
+{
+    // Find out when the batch started on the bus
+    S64 start_time = esp_timer_get_time() - m_batch.bus_us();
+
+    // Did the batch have more than one sensor in it?
+    bool is_merged = (m_batch_mask & (m_batch_mask - 1)) != 0;
+
+    for (int i=0; i<m_count; ++i) if (m_due_mask & (1 << i))
+    {
+        bool in_batch = (m_batch_mask & (1 << i)) != 0;
+
+        // If the batch read this sensor, or the batch was this sensor alone, we know how it went
+        if (in_batch && (status || !is_merged))
+        {
+            publish(i, status, start_time);
+            continue;
+        }
+
+        // Otherwise, read it on its own
+        S64 own_start_time;
+        bool own_status = read_one(i, &own_start_time);
+        publish(i, own_status, own_start_time);
+    }
+
+    // The bus is free for the next batch
+    portENTER_CRITICAL(&sched_mux);
+    m_is_busy = false;
+    portEXIT_CRITICAL(&sched_mux);
+
+    // And wait for the next sensor to come due
+    schedule_next();
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// read_one() - Reads a single sensor in a transaction of its own
+//
+// Passed: id           = The sensor to read
+//         p_start_time = Filled in with the time the transaction started on the bus
+//
+// Returns: 'true' if the read succeeded
+//
+// On Entry: the caller is holding the bus.  This only runs when a sensor is failing, so the cost
+//           of building a batch for it doesn't matter
+//=========================================================================================================
+bool CSensorSched::read_one(int id, S64* p_start_time)
+{
+    sensor_t& sensor = m_sensor[id];
+
+    m_single.reset();
+    if (sensor.reg_len)
+        m_single.read_reg(sensor.address, sensor.reg, sensor.reg_len, sensor.stage, sensor.length);
+    else
+        m_single.read(sensor.address, sensor.stage, sensor.length);
+
+    bool status = m_single.execute(I2C);
+    *p_start_time = esp_timer_get_time() - m_single.bus_us();
+    return status;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// publish() - Publishes a sample, or records an error, for a sensor that was due
+//
+// Passed: id         = The sensor
+//         status     = 'true' if the sensor was read successfully
+//         start_time = When the read started on the bus
+//=========================================================================================================
+void CSensorSched::publish(int id, bool status, S64 start_time)
+{
+    sensor_t& sensor = m_sensor[id];
+
+    // Keep track of how late this sample was
+    U32 jitter_us = start_time > sensor.deadline ? (U32)(start_time - sensor.deadline) : 0;
+
+    // If the read failed, there's nothing to publish
+    if (!status)
+    {
+        portENTER_CRITICAL(&sched_mux);
+        ++sensor.stats.errors;
+        sensor.is_failing = true;
+        portEXIT_CRITICAL(&sched_mux);
+        return;
+    }
+
+    // Write the sample into the buffer that readers aren't looking at...
+    U32 seq = sensor.seq + 1;
+    sensor_sample_t& sample = sensor.buffer[seq & 1];
+    sample.time_us = start_time;
+    sample.seq     = seq;
+    memcpy(sample.data, sensor.stage, sensor.length);
+
+    // ...and then publish it
+    __sync_synchronize();
+    sensor.seq = seq;
+
+    // Keep track of statistics
+    portENTER_CRITICAL(&sched_mux);
+    ++sensor.stats.samples;
+    sensor.stats.jitter_us_total += jitter_us;
+    if (jitter_us > sensor.stats.jitter_us_max) sensor.stats.jitter_us_max = jitter_us;
+    sensor.is_failing = false;
+    portEXIT_CRITICAL(&sched_mux);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// read() - Fetches the most recent sample from a sensor without blocking
+//
+// The writer only ever writes into the buffer that "seq" doesn't select, then bumps "seq".  If "seq"
+// changes while we're copying, the writer may have started on the buffer we're copying, so we
+// simply copy again
+//=========================================================================================================
+bool CSensorSched::read(int id, sensor_sample_t* p_sample)
+{
+    if (id < 0 || id >= m_count) return false;
+    sensor_t& sensor = m_sensor[id];
+
+    while (true)
+    {
+        U32 seq = sensor.seq;
+        if (seq == 0) return false;
+        __sync_synchronize();
+        *p_sample = sensor.buffer[seq & 1];
+        __sync_synchronize();
+        if (sensor.seq == seq) return true;
+    }
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get_stats() - Fetches the statistics for a sensor
+//=========================================================================================================
+bool CSensorSched::get_stats(int id, sensor_stats_t* p_stats)
+{
+    if (id < 0 || id >= m_count) return false;
+
+    portENTER_CRITICAL(&sched_mux);
+    *p_stats = m_sensor[id].stats;
+    portEXIT_CRITICAL(&sched_mux);
+    return true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get_recipe() - Returns the read recipe of a sensor
+//=========================================================================================================
+void CSensorSched::get_recipe(int id, int* p_address, int* p_reg, int* p_length, U32* p_period_ms)
+{
+    const sensor_t& sensor = m_sensor[id];
+    *p_address   = sensor.address;
+    *p_reg       = sensor.reg;
+    *p_length    = sensor.length;
+    *p_period_ms = sensor.period_us / 1000;
+}
+//=========================================================================================================
@@ -0,0 +1,146 @@
+//=========================================================================================================
+// sensor_sched.h - Defines a scheduler that samples I2C sensors periodically
+//
+// Each sensor is registered with a read recipe (device address, register, length) and a sampling
+// period.  When sensors come due at about the same time, their reads are merged into a single I2C
+// batch and handed to the I2C engine.  The driver abandons a batch at the first device that doesn't
+// answer, so when a merged batch fails, each sensor in it is read on its own to find out which one
+// failed.  A sensor that failed is left out of merged batches, and read on its own, until it answers
+// again.  Each result is timestamped and published into a double
+// buffer guarded by a sequence counter, so consumers can read the latest sample at any time
+// without taking the bus mutex or blocking the scheduler.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+#include "esp_timer.h"
+#include "i2c_batch.h"
+
+// The maximum number of sensors that can be registered
+#define SENSOR_MAX              8
+
+// The most bytes a single sensor read can return
+#define SENSOR_MAX_BYTES        16
+
+// Sensors that come due within this many microseconds of each other are read in the same batch
+#define SENSOR_MERGE_US         2000
+
+
+//=========================================================================================================
+// A single sample from a sensor
+//=========================================================================================================
+struct sensor_sample_t
+{
+    S64     time_us;                    // esp_timer_get_time() when the batch started on the bus
+    U32     seq;                        // Increments with every sample.  0 = no sample yet
+    U8      data[SENSOR_MAX_BYTES];     // The bytes read from the sensor
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// Statistics about a sensor
+//=========================================================================================================
+struct sensor_stats_t
+{
+    U32     samples;            // The number of samples published
+    U32     missed;             // The number of deadlines that passed without a sample being taken
+    U32     errors;             // The number of reads that failed
+    U32     jitter_us_max;      // The latest any sample has started after its deadline
+    U64     jitter_us_total;
+};
+//=========================================================================================================
+
+
+class CSensorSched
+{
+public:
+
+    // Call this once at startup, after the I2C engine has been started
+    void    init();
+
+    // Registers a sensor.  Every "period_ms", "length" bytes are read from register "reg" (which is
+    // "reg_len" bytes long) of the device at "i2c_address".  Returns the sensor ID, or -1 if the
+    // sensor can't be registered
+    int     add(int i2c_address, int reg, int reg_len, int length, U32 period_ms);
+
+    // Returns the number of registered sensors
+    int     count() {return m_count;}
+
+    // Fetches the most recent sample from a sensor.  This never blocks.  Returns 'false' if there
+    // is no such sensor or it hasn't been sampled yet
+    bool    read(int id, sensor_sample_t* p_sample);
+
+    // Fetches the statistics for a sensor
+    bool    get_stats(int id, sensor_stats_t* p_stats);
+
+    // Returns the recipe of a sensor
+    void    get_recipe(int id, int* p_address, int* p_reg, int* p_length, U32* p_period_ms);
+
+public:
+
+    // These are called by the timer and the I2C engine.  They shouldn't be called externally
+    void    on_timer();
+    void    on_batch_done(bool status);
+
+protected:
+
+    // Re-arms the timer for the earliest deadline
+    void    schedule_next();
+
+    // Reads a single sensor in a transaction of its own.  The caller must be holding the bus
+    bool    read_one(int id, S64* p_start_time);
+
+    // Publishes a sample, or records an error, for a sensor that was due
+    void    publish(int id, bool status, S64 start_time);
+
+    // Everything we know about a registered sensor
+    struct sensor_t
+    {
+        // The read recipe
+        U8      address;
+        U16     reg;
+        U8      reg_len;
+        U8      length;
+        U32     period_us;
+
+        // The next time this sensor is due to be sampled, and the deadline it's being sampled for
+        S64     next_due;
+        S64     deadline;
+
+        // The I2C engine reads directly into this buffer
+        U8      stage[SENSOR_MAX_BYTES];
+
+        // True if the most recent read of this sensor failed
+        bool    is_failing;
+
+        // The published samples.  The one that "seq" selects is the latest
+        sensor_sample_t     buffer[2];
+        volatile U32        seq;
+
+        // Statistics
+        sensor_stats_t      stats;
+    };
+
+    // The registered sensors
+    sensor_t        m_sensor[SENSOR_MAX];
+    int             m_count;
+
+    // The batch that is being built, or is on the bus
+    CI2CBatch       m_batch;
+
+    // A bitmap of the sensors in that batch
+    U32             m_batch_mask;
+
+    // A bitmap of every sensor that is due.  The ones that aren't in the batch are read on their own
+    U32             m_due_mask;
+
+    // The batch that reads a single sensor
+    CI2CBatch       m_single;
+
+    // True while a batch is on the bus
+    bool            m_is_busy;
+
+    // This timer fires when the next sensor is due
+    esp_timer_handle_t m_timer;
+};
+//=========================================================================================================
@@ -9,6 +9,8 @@ enum task_idx_t
     TASK_IDX_MAIN = 0,
     TASK_IDX_PROV_BUTTON,
     TASK_IDX_TCP_SERVER,
+    TASK_IDX_NETWORK,
+    TASK_IDX_I2C,
     TASK_IDX_COUNT
 };
 
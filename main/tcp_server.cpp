@@ -1,6 +1,8 @@
 //=========================================================================================================
 // tcp_server.cpp() - Implements our TCP command server
 //=========================================================================================================
+#include <stdlib.h>
+#include "esp_timer.h"
 #include "globals.h"
 #include "history.h"
 
@@ -72,15 +74,31 @@ bool CTCPServer::handle_reboot()
 // handle_time() - Reports the current time and optionally sets the current time
 //
 // If a parameter is supplied, it should be in HH:MM:SS format, in Coordinated Universal Time
+//
+//      time sync    - Reports the state of NTP synchronization:
+//                     state, server, syncs, steps, slews, last offset, max offset (usecs), age (secs)
 //========================================================================================================= 
 bool CTCPServer::handle_time()
 {
+    static const char* state_name[] = {"stopped", "waiting", "slewing", "synced"};
     const char* token;
     char buffer[64];
+    timesync_stats_t stats;
 
-    // Fetch the next token, if it exists, assume it's an ASCII representation of the time
+    // Fetch the next token, if it exists
     if (get_next_token(&token))
     {
+        // Is the user asking about NTP synchronization?
+        if token_is("sync")
+        {
+            TimeSync.get_stats(&stats);
+            int age = stats.sync_count ? (int)((esp_timer_get_time() - stats.last_sync_us) / 1000000) : -1;
+            return pass("%s %s %u %u %u %lld %lld %i", state_name[TimeSync.state()], TimeSync.server(),
+                        stats.sync_count, stats.step_count, stats.slew_count,
+                        stats.last_offset_us, stats.max_offset_us, age);
+        }
+
+        // Otherwise, assume it's an ASCII representation of the time
         // Convert that token into hours, minutes, seconds
         if (!System.set_time(token)) return fail_syntax();
     }
@@ -136,6 +154,12 @@ bool CTCPServer::handle_nvget()
         return pass("%i 0x%08X 0x%08X", ok, old_crc, new_crc);
     }
 
+    // Is the user asking which A/B slot our data lives in?
+    if token_is("slot")
+    {
+        return pass("%i %u", NVS.active_slot(), NVS.data.generation);
+    }
+
     // Is the user asking for the network SSID?
     if  token_is("ssid")
     {
@@ -148,12 +172,38 @@ bool CTCPServer::handle_nvget()
         return pass("\"%s\"", NVS.data.network_user);
     }
 
+    // Is the user asking for the NTP server?
+    if token_is("ntp")
+    {
+        return pass("\"%s\"", NVS.data.ntp_server);
+    }
+
+    // Is the user asking how many minutes of inactivity it takes for AP mode to expire?
+    if token_is("aptimeout")
+    {
+        return pass("%u", NVS.data.ap_timeout_min);
+    }
+
+    // Is the user asking for the list of Wi-Fi networks we know about?  Network 0 is the primary
+    if token_is("nets")
+    {
+        replyf(" 0 \"%s\" \"%s\"", NVS.data.network_ssid, NVS.data.network_user);
+        for (int i=1; i<NET_MAX_NETWORKS; ++i)
+        {
+            const net_cred_t& cred = NVS.data.alt_network[i-1];
+            replyf(" %i \"%s\" \"%s\"", i, cred.ssid, cred.user);
+        }
+        return pass();
+    }
+
 
     // Is the user asking for a general dump of everything in nv-storage?
     if token_is("")
     {
         replyf(" ssid:       \"%s\"", NVS.data.network_ssid);
         replyf(" netuser:    \"%s\"", NVS.data.network_user);
+        replyf(" ntp:        \"%s\"", NVS.data.ntp_server);
+        replyf(" aptimeout:  %u", NVS.data.ap_timeout_min);
         return pass();
     }
 
@@ -195,6 +245,48 @@ bool CTCPServer::handle_nvset()
         return pass();
     }
 
+    // Is the user setting the NTP server?  This takes effect the next time we get an IP address
+    if token_is("ntp")
+    {
+        safe_copy(NVS.data.ntp_server, value);
+        NVS.write_to_flash();
+        return pass();
+    }
+
+    // Is the user setting how many minutes of inactivity it takes for AP mode to expire?  0 = never
+    if token_is("aptimeout")
+    {
+        NVS.data.ap_timeout_min = atoi(value);
+        NVS.write_to_flash();
+        return pass();
+    }
+
+    // Is the user setting the credentials of an alternate Wi-Fi network?  This looks like 
+    // "nvset net <1 thru NET_MAX_NETWORKS-1> <ssid> [password] [user]".  An empty SSID erases it
+    if token_is("net")
+    {
+        const char *ssid, *pw, *user;
+        int index = atoi(value);
+        if (index < 1 || index >= NET_MAX_NETWORKS) return fail_syntax();
+        if (!get_next_token(&ssid)) return fail_syntax();
+        get_next_token(&pw);
+        get_next_token(&user);
+
+        // Ensure that we don't exceed the maximum allowed lengths
+        net_cred_t& cred = NVS.data.alt_network[index-1];
+        if (strlen(ssid) >= sizeof cred.ssid || strlen(pw) >= sizeof cred.pw || strlen(user) >= sizeof cred.user)
+        {
+            return fail_unsupp();
+        }
+
+        memset(&cred, 0, sizeof cred);
+        safe_copy(cred.ssid, ssid);
+        safe_copy(cred.pw,   pw);
+        safe_copy(cred.user, user);
+        NVS.write_to_flash();
+        return pass();
+    }
+
     // Is the user setting the network password?
     if token_is("netpw")
     {
@@ -226,6 +318,26 @@ bool CTCPServer::handle_rssi()
 
 
 
+//========================================================================================================= 
+// scan_callback() - Reports a single access point for the "wifi scan" command
+//========================================================================================================= 
+static void scan_callback(const scan_entry_t* p_entry, U32 age_ms, void* context)
+{
+    ((CTCPServer*)context)->report_scan_entry(p_entry, age_ms);
+}
+//========================================================================================================= 
+
+
+//========================================================================================================= 
+// report_scan_entry() - Reports the RSSI, channel, auth-mode, age, and SSID of an access point
+//========================================================================================================= 
+void CTCPServer::report_scan_entry(const scan_entry_t* p_entry, U32 age_ms)
+{
+    replyf(" %4i %3u %2u %7u %s", p_entry->rssi, p_entry->channel, p_entry->authmode, age_ms, p_entry->ssid);
+}
+//========================================================================================================= 
+
+
 //========================================================================================================= 
 // handle_wifi() - Handles Wi-Fi management commands
 //========================================================================================================= 
@@ -242,6 +354,121 @@ bool CTCPServer::handle_wifi()
         return pass("%i", System.rssi());
     }
 
+    // Is the user asking for our IP addresses?  This reports IPv4, IPv6 link-local, and IPv6 global
+    if token_is("ip")
+    {
+        replyf(" ipv4:       %s", System.ip_addr);
+        replyf(" link-local: %s", System.ip6_link_local);
+        replyf(" global:     %s", System.ip6_global);
+        return pass();
+    }
+
+    // Is the user asking how quickly we recover from outages?
+    if token_is("reconnect")
+    {
+        const reconnect_stats_t& stats = Network.reconnect_stats();
+        replyf(" outages:  %u", stats.count);
+        replyf(" fast:     %u", stats.fast_count);
+        replyf(" attempts: %u", stats.attempts);
+        replyf(" last ms:  %u", stats.last_ms);
+        replyf(" min ms:   %u", stats.min_ms);
+        replyf(" avg ms:   %u", stats.count ? (U32)(stats.total_ms / stats.count) : 0);
+        replyf(" max ms:   %u", stats.max_ms);
+        return pass();
+    }
+
+    // Is the user asking for the link-quality history?  This looks like "wifi history [count]" to
+    // stream the most recent samples, oldest first, or "wifi history rate <ms>" to set the sample rate
+    if token_is("history")
+    {
+        link_sample_t sample;
+        int count = LINKMON_RING_SIZE;
+        if (get_next_token(&token))
+        {
+            if token_is("rate")
+            {
+                if (!get_next_token(&token)) return pass("%u", LinkMon.interval());
+                LinkMon.set_interval(strtoul(token, nullptr, 0));
+                return pass("%u", LinkMon.interval());
+            }
+            count = atoi(token);
+        }
+
+        // Figure out which sample to start with
+        int first = LinkMon.count() - count;
+        if (first < 0) first = 0;
+
+        // Stream out the samples
+        replyf(" %10s %4s %3s %3s %3s %6s", "ms", "rssi", "ch", "phy", "try", "reason");
+        for (int i=first; LinkMon.get_sample(i, &sample); ++i)
+        {
+            replyf(" %10u %4i %3u %3X %3u %6u", sample.time_ms, sample.rssi, sample.channel, sample.phy,
+                   sample.retries, sample.disconnect_reason);
+        }
+        return pass();
+    }
+
+    // Is the user asking for statistics about the link-quality history?
+    if token_is("stats")
+    {
+        link_stats_t stats;
+        LinkMon.get_stats(&stats);
+        replyf(" samples:     %u", stats.samples);
+        replyf(" interval ms: %u", LinkMon.interval());
+        replyf(" connected:   %u", stats.connected);
+        replyf(" disconnects: %u", stats.disconnects);
+        replyf(" retries:     %u", stats.retries);
+        replyf(" rssi min:    %i", stats.rssi_min);
+        replyf(" rssi avg:    %i", stats.rssi_avg);
+        replyf(" rssi max:    %i", stats.rssi_max);
+        replyf(" rssi p10:    %i", stats.rssi_p10);
+        replyf(" rssi p50:    %i", stats.rssi_p50);
+        replyf(" rssi p90:    %i", stats.rssi_p90);
+        return pass();
+    }
+
+    // Is the user asking how roaming between access points is going?
+    if token_is("roam")
+    {
+        const roam_stats_t& stats = Network.roam_stats();
+        replyf(" network:  %i", Network.net_index());
+        replyf(" roams:    %u", stats.count);
+        replyf(" failures: %u", stats.failures);
+        replyf(" last ms:  %u", stats.last_ms);
+        replyf(" avg ms:   %u", stats.count ? (U32)(stats.total_ms / stats.count) : 0);
+        replyf(" max ms:   %u", stats.max_ms);
+        return pass();
+    }
+
+    // Is the user asking for the access points we've seen?  These come from the scan cache, so this
+    // never waits for a scan.  "wifi scan refresh" starts an active scan in the background
+    if token_is("scan")
+    {
+        if (get_next_token(&token))
+        {
+            if (!token_is("refresh")) return fail_syntax();
+            ScanCache.refresh(true);
+            return pass();
+        }
+        S32 age_ms = ScanCache.age_ms();
+        if (age_ms < 0) return fail("NOSCAN");
+        replyf(" scan age ms: %i", age_ms);
+        ScanCache.for_each(scan_callback, this);
+        return pass();
+    }
+
+    // Is the user asking us to test the Wi-Fi credentials in NVS?  The access point stays
+    // up during the test, so this is only allowed in AP mode (it would drop a STA connection).
+    // The access point moves to the channel of the network being tested, if it isn't there already
+    if token_is("test")
+    {
+        U32 timeout_ms = WIFI_TEST_TIMEOUT_MS;
+        if (Network.wifi_status() != WIFI_AP_MODE) return fail("NOTAP");
+        if (get_next_token(&token)) timeout_ms = strtoul(token, nullptr, 0);
+        if (Network.test_wifi_credentials(timeout_ms)) return pass();
+        return fail("%u", Network.wifi_test_fail_code());
+    }
+
     // If we get here, we didn't understand the sub-command
     return fail_syntax();
 }
@@ -267,6 +494,571 @@ bool CTCPServer::handle_stack()
 
 
 
+//========================================================================================================= 
+// kv_ls_callback() - Reports a single record for the "kv ls" command
+//========================================================================================================= 
+static void kv_ls_callback(const kv_entry_t* p_entry, void* context)
+{
+    ((CTCPServer*)context)->report_kv_entry(p_entry);
+}
+//========================================================================================================= 
+
+
+//========================================================================================================= 
+// report_kv_entry() - Reports the namespace, key, and size of a record in the key/value store
+//========================================================================================================= 
+void CTCPServer::report_kv_entry(const kv_entry_t* p_entry)
+{
+    replyf(" %-15s %-15s %6u", p_entry->nvs_namespace, p_entry->key, p_entry->size);
+}
+//========================================================================================================= 
+
+
+//========================================================================================================= 
+// handle_kv() - Handles commands that manage the key/value store
+//
+//      kv ls    [<namespace>]
+//      kv get   <namespace> <key>
+//      kv put   <namespace> <key> <value>
+//      kv erase <namespace> <key>
+//========================================================================================================= 
+bool CTCPServer::handle_kv()
+{
+    const char *token, *nvs_namespace, *key, *value;
+
+    // Fetch the sub-command
+    get_next_token(&token);
+
+    // Are we listing the records in the store?
+    if token_is("ls")
+    {
+        get_next_token(&nvs_namespace);
+        int count = KV.for_each(nvs_namespace[0] ? nvs_namespace : nullptr, kv_ls_callback, this);
+        return pass("%i", count);
+    }
+
+    // Every other sub-command requires a namespace and a key
+    if (!get_next_token(&nvs_namespace)) return fail_syntax();
+    if (!get_next_token(&key))           return fail_syntax();
+
+    // Is the user asking to read a record?
+    if token_is("get")
+    {
+        // Find out how big the record is
+        int size = KV.size(nvs_namespace, key);
+        if (size < 0) return fail("NOTFOUND");
+
+        // Allocate a buffer large enough to hold it, plus a terminating nul-byte
+        U8* buffer = (U8*)calloc(size + 1, 1);
+        if (buffer == nullptr) return fail("NOMEM");
+
+        // Fetch the record
+        bool ok = KV.get(nvs_namespace, key, buffer, size);
+
+        // Find out whether this record is printable text
+        bool is_text = ok && size < 150;
+        for (int i=0; is_text && i<size; ++i) is_text = (buffer[i] >= 32 && buffer[i] < 127);
+
+        // Text is reported in quotes, anything else is reported as lines of hex
+        if (ok && is_text) pass("\"%s\"", buffer);
+        else if (ok)
+        {
+            reply_hex(buffer, size);
+            pass("%i", size);
+        }
+        else fail("READ");
+
+        // Free the memory we allocated
+        free(buffer);
+        return ok;
+    }
+
+    // Is the user asking to store a record?
+    if token_is("put")
+    {
+        if (!get_next_token(&value)) return fail_syntax();
+        return KV.put(nvs_namespace, key, value, strlen(value)) ? pass() : fail("WRITE");
+    }
+
+    // Is the user asking to delete a record?
+    if token_is("erase")
+    {
+        return KV.erase(nvs_namespace, key) ? pass() : fail("NOTFOUND");
+    }
+
+    // If we get here, we didn't understand the sub-command
+    return fail_syntax();
+}
+//========================================================================================================= 
+
+
+
+//========================================================================================================= 
+// reply_hex() - Replies with a block of binary data as lines of hex, 32 bytes per line
+//========================================================================================================= 
+void CTCPServer::reply_hex(const U8* data, int length)
+{
+    char line[70];
+
+    for (int i=0; i<length; i += 32)
+    {
+        char* p = line;
+        for (int j=i; j<length && j<i+32; ++j) p += sprintf(p, "%02X", data[j]);
+        replyf(" %s", line);
+    }
+}
+//========================================================================================================= 
+
+
+//========================================================================================================= 
+// log_dump_callback() - Reports a single record for the "log dump" command
+//========================================================================================================= 
+static void log_dump_callback(const evtlog_rec_t* p_rec, const U8* payload, void* context)
+{
+    ((CTCPServer*)context)->report_log_record(p_rec, payload);
+}
+//========================================================================================================= 
+
+
+//========================================================================================================= 
+// report_log_record() - Reports the timestamp, type, and length of an event-log record, then its payload
+//========================================================================================================= 
+void CTCPServer::report_log_record(const evtlog_rec_t* p_rec, const U8* payload)
+{
+    replyf("%u %u %u", p_rec->timestamp, p_rec->type, p_rec->length);
+    reply_hex(payload, p_rec->length);
+}
+//========================================================================================================= 
+
+
+//========================================================================================================= 
+// handle_log() - Handles commands that manage the event log
+//
+//      log stats
+//      log dump
+//      log write <text>
+//      log flush
+//      log erase
+//========================================================================================================= 
+bool CTCPServer::handle_log()
+{
+    const char* token;
+
+    // If there is no event log partition, none of these commands make sense
+    if (!EventLog.is_available()) return fail_unsupp();
+
+    // Fetch the sub-command
+    get_next_token(&token);
+
+    // Is the user asking for statistics?
+    if (token[0] == 0 || token_is("stats"))
+    {
+        replyf(" appended: %u", EventLog.records_appended());
+        replyf(" dropped:  %u", EventLog.records_dropped());
+        replyf(" sectors:  %u of %i", EventLog.sectors_written(), EventLog.sector_count());
+        replyf(" sequence: %u", EventLog.head_sequence());
+        replyf(" erased:   %i ahead", EventLog.sectors_erased());
+        return pass();
+    }
+
+    // Is the user asking for every record in the log?
+    if token_is("dump")
+    {
+        return pass("%i", EventLog.for_each(log_dump_callback, this));
+    }
+
+    // Is the user adding a text record to the log?
+    if token_is("write")
+    {
+        if (!get_next_token(&token)) return fail_syntax();
+        return EventLog.append(EVTLOG_TYPE_TEXT, token, strlen(token)) ? pass() : fail("DROPPED");
+    }
+
+    // Is the user asking us to write the staging buffer to flash?
+    if token_is("flush")
+    {
+        EventLog.flush();
+        return pass();
+    }
+
+    // Is the user asking us to erase the log?
+    if token_is("erase")
+    {
+        EventLog.erase();
+        return pass();
+    }
+
+    // If we get here, we didn't understand the sub-command
+    return fail_syntax();
+}
+//========================================================================================================= 
+
+
+
+//========================================================================================================= 
+// handle_flash() - Reports the latency statistics of the FlashIO priority lanes
+//
+//      flash stats
+//
+// For each lane, reports: name, request count, average latency, max latency, last latency (in usecs)
+//========================================================================================================= 
+bool CTCPServer::handle_flash()
+{
+    const char* token;
+    static const char* lane_name[FLASH_LANE_COUNT] = {"urgent", "normal", "background"};
+
+    // Fetch the sub-command
+    get_next_token(&token);
+
+    // If it's not a request for statistics, we don't understand it
+    if (!(token[0] == 0 || token_is("stats"))) return fail_syntax();
+
+    // Report the statistics for each lane
+    for (int lane = 0; lane < FLASH_LANE_COUNT; ++lane)
+    {
+        const flash_lane_stats_t& stats = FlashIO.lane_stats((flash_lane_t)lane);
+        U32 average = stats.count ? (U32)(stats.total_us / stats.count) : 0;
+        replyf(" %-10s %u %u %u %u", lane_name[lane], stats.count, average, stats.max_us, stats.last_us);
+    }
+
+    return pass();
+}
+//========================================================================================================= 
+
+
+
+//========================================================================================================= 
+// handle_tables() - Reports the contents of the memory-mapped data table image
+//
+//      tables
+//
+// Reports the name, length, and CRC of each table, then passes with the data version of the image
+//========================================================================================================= 
+bool CTCPServer::handle_tables()
+{
+    // If there is no valid table image, this command doesn't make sense
+    if (!DataTables.is_available()) return fail_unsupp();
+
+    // Report every table in the image
+    for (int i=0; i<DataTables.count(); ++i)
+    {
+        const dtbl_entry_t* p_entry = DataTables.entry(i);
+        replyf(" %-15s %u 0x%08X", p_entry->name, p_entry->length, p_entry->crc);
+    }
+
+    return pass("%u", DataTables.data_version());
+}
+//========================================================================================================= 
+
+
+
+//========================================================================================================= 
+// handle_boot() - Reports the boot timeline
+//
+//      boot
+//
+// Reports each boot step with its start and end time, then each milestone with its time.  All
+// times are in milliseconds since power-up
+//========================================================================================================= 
+bool CTCPServer::handle_boot()
+{
+    // Report every init step
+    for (int i=0; i<BootSeq.step_count(); ++i)
+    {
+        const boot_step_t* p_step = BootSeq.step(i);
+        replyf(" %-10s %u %u", p_step->name, p_step->start_ms, p_step->end_ms);
+    }
+
+    // Report every milestone
+    for (int i=0; i<BootSeq.mark_count(); ++i)
+    {
+        const boot_mark_t* p_mark = BootSeq.get_mark(i);
+        replyf(" %-10s %u", p_mark->name, p_mark->time_ms);
+    }
+
+    return pass();
+}
+//========================================================================================================= 
+
+
+
+//========================================================================================================= 
+// handle_power() - Reports or changes the Wi-Fi power-save policy
+//
+//      power [auto | full | balanced | low]
+//
+// With no argument, reports the policy, the current mode, and for each mode, its estimated current 
+// draw (mA), the latency it adds to incoming commands (ms), and how long we've spent in it (ms)
+//========================================================================================================= 
+bool CTCPServer::handle_power()
+{
+    const char* token;
+
+    // If the user is setting the policy, find out which one it is
+    if (get_next_token(&token))
+    {
+        for (int i=0; i<POWER_POLICY_COUNT; ++i)
+        {
+            if (strcmp(token, PowerMgr.policy_name((power_policy_t)i)) == 0)
+            {
+                PowerMgr.set_policy((power_policy_t)i);
+                return pass();
+            }
+        }
+        return fail_syntax();
+    }
+
+    // Report the policy and the mode we're in
+    replyf(" policy:   %s", PowerMgr.policy_name(PowerMgr.policy()));
+    replyf(" mode:     %s", PowerMgr.mode_info(PowerMgr.mode()).name);
+    replyf(" switches: %u", PowerMgr.switch_count());
+
+    // Report what each mode costs us
+    for (int i=0; i<POWER_MODE_COUNT; ++i)
+    {
+        const power_mode_info_t& info = PowerMgr.mode_info((power_mode_t)i);
+        replyf(" %-8s %4u mA %4u ms %10u ms", info.name, info.current_ma, info.latency_ms, PowerMgr.residency_ms((power_mode_t)i));
+    }
+
+    return pass();
+}
+//========================================================================================================= 
+
+
+
+//========================================================================================================= 
+// handle_i2c() - Reports on the I2C bus
+//
+//      i2c [stats]
+//      i2c scan
+//      i2c clear
+//      i2c speed [<address> <khz>]
+//
+// "stats" reports how often the bus has been used, how often a task gave up waiting for it, how
+// long tasks have waited for it and held it (average/maximum, in microseconds), and the transaction
+// and error counts of every known device.  "scan" probes the bus and lists the devices that answer.
+// "clear" frees a stuck bus.  "speed" reports the bus clock and the devices with speed profiles,
+// or sets a device's profile (0 = default)
+//========================================================================================================= 
+bool CTCPServer::handle_i2c()
+{
+    const char* token;
+    i2c_stats_t stats;
+
+    // Fetch the subcommand
+    get_next_token(&token);
+
+    // An empty token or "stats" reports the contention statistics
+    if (token[0] == 0 || token_is("stats"))
+    {
+        I2C.get_stats(&stats);
+        U32 wait_avg = stats.locks ? (U32)(stats.wait_us_total / stats.locks) : 0;
+        U32 hold_avg = stats.locks ? (U32)(stats.hold_us_total / stats.locks) : 0;
+        replyf(" locks:        %u", stats.locks);
+        replyf(" timeouts:     %u", stats.timeouts);
+        replyf(" transactions: %u", stats.transactions);
+        replyf(" errors:       %u", stats.errors);
+        replyf(" wait_us:      %u / %u", wait_avg, stats.wait_us_max);
+        replyf(" hold_us:      %u / %u", hold_avg, stats.hold_us_max);
+
+        // And report on the asynchronous engine
+        i2c_engine_stats_t engine;
+        I2CEngine.get_stats(&engine);
+        replyf(" async:        %u ok, %u failed, %u rejected, %u cancelled, peak queue %u", engine.completed, engine.failed, engine.rejected, engine.cancelled, engine.peak_depth);
+        replyf(" bus_clears:   %u", stats.bus_clears);
+
+        // And report on every device we know about
+        for (int address = 0; address < I2C_ADDRESS_COUNT; ++address)
+        {
+            i2c_device_t device;
+            I2C.get_device(address, &device);
+            if (!device.is_present && device.transactions == 0) continue;
+            replyf(" 0x%02X: %s  %u transactions  %u errors", address, device.is_present ? "present" : "missing", device.transactions, device.errors);
+        }
+        return pass();
+    }
+
+    // Is the user asking us to find out what's on the bus?
+    if token_is("scan")
+    {
+        int found = I2C.scan();
+        if (found < 0) return fail("BUSY");
+        for (int address = I2C_FIRST_ADDRESS; address <= I2C_LAST_ADDRESS; ++address)
+        {
+            i2c_device_t device;
+            I2C.get_device(address, &device);
+            if (device.is_present) replyf(" 0x%02X", address);
+        }
+        return pass("%i", found);
+    }
+
+    // Is the user asking us to free a stuck bus?
+    if token_is("clear")
+    {
+        return I2C.clear_bus() ? pass() : fail("STUCK");
+    }
+
+    // "speed" reports the bus clock, or sets the speed profile of a device: "i2c speed <addr> <khz>"
+    if token_is("speed")
+    {
+        if (!get_next_token(&token))
+        {
+            replyf(" clock:   %u", I2C.clock());
+            replyf(" default: %u", I2C.default_clock());
+            replyf(" retimes: %u", I2C.retime_count());
+            for (int address = 0; address < I2C_ADDRESS_COUNT; ++address)
+            {
+                if (I2C.device_speed(address) != I2C.default_clock()) replyf(" 0x%02X:    %u", address, I2C.device_speed(address));
+            }
+            return pass();
+        }
+        int address = strtol(token, nullptr, 0);
+        if (!get_next_token(&token)) return fail_syntax();
+        I2C.set_device_speed(address, atoi(token) * 1000);
+        return pass();
+    }
+
+    return fail_syntax();
+}
+//========================================================================================================= 
+
+
+
+//========================================================================================================= 
+// handle_sensor() - Reports on, or registers, periodically sampled I2C sensors
+//
+//      sensor
+//      sensor add <address> <register> <length> <period_ms>
+//
+// With no arguments, reports each sensor's recipe, the number of samples taken, missed deadlines,
+// failed reads, average/maximum jitter in microseconds, and the most recent sample in hex
+//========================================================================================================= 
+bool CTCPServer::handle_sensor()
+{
+    const char* token;
+    sensor_stats_t stats;
+    sensor_sample_t sample;
+    int address, reg, length;
+    U32 period_ms;
+    char hex[SENSOR_MAX_BYTES * 2 + 1];
+
+    // Is the user registering a new sensor?  Registers are assumed to be one byte long
+    if (get_next_token(&token))
+    {
+        if (!token_is("add")) return fail_syntax();
+        if (!get_next_token(&token)) return fail_syntax();
+        address = strtol(token, nullptr, 0);
+        if (!get_next_token(&token)) return fail_syntax();
+        reg = strtol(token, nullptr, 0);
+        if (!get_next_token(&token)) return fail_syntax();
+        length = atoi(token);
+        if (!get_next_token(&token)) return fail_syntax();
+        period_ms = atoi(token);
+        int id = Sensors.add(address, reg, 1, length, period_ms);
+        if (id < 0) return fail(Sensors.count() == SENSOR_MAX ? "FULL" : "RANGE");
+        return pass("%i", id);
+    }
+
+    // Report on every sensor
+    for (int id = 0; id < Sensors.count(); ++id)
+    {
+        Sensors.get_recipe(id, &address, &reg, &length, &period_ms);
+        Sensors.get_stats(id, &stats);
+        U32 jitter_avg = stats.samples ? (U32)(stats.jitter_us_total / stats.samples) : 0;
+
+        // Fetch the most recent sample in hex
+        hex[0] = 0;
+        if (Sensors.read(id, &sample))
+        {
+            for (int i=0; i<length; ++i) sprintf(hex + 2 * i, "%02X", sample.data[i]);
+        }
+
+        replyf(" %i: 0x%02X/0x%02X x%i every %u ms  samples %u missed %u errors %u jitter %u/%u  %s", 
+            id, address, reg, length, period_ms, stats.samples, stats.missed, stats.errors, jitter_avg, stats.jitter_us_max, hex);
+    }
+
+    return pass();
+}
+//========================================================================================================= 
+
+
+
+//========================================================================================================= 
+// handle_eeprom() - Reads, writes, or reports on the I2C EEPROM
+//
+//      eeprom
+//      eeprom read <offset> <length>
+//      eeprom write <offset> <length>
+//
+// With no arguments, reports the geometry of the chip and how many pages have been written.  "read"
+// replies with the data in hex, 32 bytes per line.  "write" expects exactly <length> raw bytes to
+// follow the command, which must be terminated by a single linefeed.  The bytes are streamed to the
+// chip as they arrive, so uploads of any size need only a small buffer
+//========================================================================================================= 
+bool CTCPServer::handle_eeprom()
+{
+    const char* token;
+    static U8 buffer[EEPROM_BURST_SIZE];
+    char hex[32 * 2 + 1];
+
+    // With no arguments, report on the chip
+    if (!get_next_token(&token))
+    {
+        replyf(" address: 0x%02X (%s)", Eeprom.address(), Eeprom.is_fram() ? "FRAM" : "EEPROM");
+        replyf(" size:    %u", Eeprom.size());
+        replyf(" page:    %u", Eeprom.page_size());
+        replyf(" writes:  %u pages, %u polls", Eeprom.page_count(), Eeprom.poll_count());
+        return pass();
+    }
+
+    // Both subcommands take an offset and a length
+    bool is_write = token_is("write");
+    if (!is_write && !token_is("read")) return fail_syntax();
+    if (!get_next_token(&token)) return fail_syntax();
+    U32 offset = strtoul(token, nullptr, 0);
+    if (!get_next_token(&token)) return fail_syntax();
+    U32 length = strtoul(token, nullptr, 0);
+    bool is_in_range = (offset <= Eeprom.size() && length <= Eeprom.size() - offset);
+
+    // Is the user asking to read from the chip?
+    if (!is_write)
+    {
+        if (!is_in_range) return fail("RANGE");
+        while (length)
+        {
+            U32 count = length < 32 ? length : 32;
+            if (!Eeprom.read(offset, buffer, count)) return fail("READ");
+            for (U32 i=0; i<count; ++i) sprintf(hex + 2 * i, "%02X", buffer[i]);
+            replyf(" %04X: %s", offset, hex);
+            offset += count;
+            length -= count;
+        }
+        return pass();
+    }
+
+    // Stream the payload to the chip.  Each chunk ends on a burst boundary, so it never splits a page
+    // that it didn't have to.  If something goes wrong, we still consume the rest of the payload so
+    // that it isn't mistaken for commands
+    bool status = is_in_range;
+    U32 remaining = length;
+    while (remaining)
+    {
+        U32 count = EEPROM_BURST_SIZE - (offset % EEPROM_BURST_SIZE);
+        if (count > remaining) count = remaining;
+        if (recv_raw(buffer, count) != (int)count) return fail("TRUNCATED");
+        if (status) status = Eeprom.write(offset, buffer, count);
+        offset    += count;
+        remaining -= count;
+    }
+
+    if (!is_in_range) return fail("RANGE");
+    if (!status) return fail("WRITE");
+    return pass("%u", length);
+}
+//========================================================================================================= 
+
+
+
 //=========================================================================================================
 // on_command() - The top level dispatcher for commands
 // 
@@ -284,6 +1076,15 @@ void CTCPServer::on_command(const char* token)
     else if token_is("rssi")     handle_rssi();
     else if token_is("wifi")     handle_wifi();
     else if token_is("stack")    handle_stack();
+    else if token_is("kv")       handle_kv();
+    else if token_is("log")      handle_log();
+    else if token_is("flash")    handle_flash();
+    else if token_is("tables")   handle_tables();
+    else if token_is("boot")     handle_boot();
+    else if token_is("power")    handle_power();
+    else if token_is("i2c")      handle_i2c();
+    else if token_is("sensor")   handle_sensor();
+    else if token_is("eeprom")   handle_eeprom();
 
     else fail_syntax();
 }
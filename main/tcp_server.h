@@ -1,6 +1,9 @@
 #pragma once
 #include "common.h"
 #include "tcp_server_base.h"
+#include "kv_store.h"
+#include "event_log.h"
+#include "scan_cache.h"
 
 
 //=========================================================================================================
@@ -13,6 +16,15 @@ public:
     // Constructor - just calls the base class
     CTCPServer(int port) : CTCPServerBase(port) {}
 
+    // Called by the "kv ls" handler once for each record in the store
+    void    report_kv_entry(const kv_entry_t* p_entry);
+
+    // Called by the "log dump" handler once for each record in the event log
+    void    report_log_record(const evtlog_rec_t* p_rec, const U8* payload);
+
+    // Called by the "wifi scan" handler once for each access point in the scan cache
+    void    report_scan_entry(const scan_entry_t* p_entry, U32 age_ms);
+
 protected:
 
 
@@ -27,6 +39,15 @@ protected:
     bool    handle_rssi();
     bool    handle_wifi();
     bool    handle_stack();
+    bool    handle_kv();
+    bool    handle_log();
+    bool    handle_flash();
+    bool    handle_tables();
+    bool    handle_boot();
+    bool    handle_power();
+    bool    handle_i2c();
+    bool    handle_sensor();
+    bool    handle_eeprom();
     // ------------------------------------------------------------------
 
 
@@ -35,6 +56,9 @@ protected:
     //  A custom failure code
     bool    fail_unsupp() {return fail("UNSUPP");}
 
+    // Replies with a block of binary data as lines of hex
+    void    reply_hex(const U8* data, int length);
+
     // Whenever a command comes in, this top-level handler gets called
     void    on_command(const char* command);
 
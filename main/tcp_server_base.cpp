@@ -21,6 +21,7 @@ CTCPServerBase::CTCPServerBase(int port)
     m_sock = CLOSED;
     m_has_client = false;
     m_server_port = port;
+    m_skip_lf = false;
 }
 //=========================================================================================================
 
@@ -128,6 +129,10 @@ again:
             // Nul-terminate the message
             *p_input = 0;
 
+            // A client that ends its lines with CR-LF sends an LF after this line.  If a raw payload
+            // follows, that LF isn't part of it
+            m_skip_lf = (c == 13);
+
             // Go see if the message needs to be handled
             handle_new_message();
 
@@ -365,6 +370,45 @@ void CTCPServerBase::replyf(const char* fmt, ...)
 //=========================================================================================================
 
 
+//=========================================================================================================
+// recv_raw() - Reads raw bytes from the socket
+//
+// Passed: vp_buffer = Where to store the bytes
+//         length    = The number of bytes to read
+//
+// Returns: The number of bytes read.  This is less than "length" only if the connection closed
+//
+// Command handlers use this to fetch a binary payload that immediately follows the command line.  If
+// the command line ended with a CR, a single LF right after it is skipped
+//=========================================================================================================
+int CTCPServerBase::recv_raw(void* vp_buffer, int length)
+{
+    char* p_buffer = (char*)vp_buffer;
+    int   total = 0;
+
+    // If the command line ended with a CR, the client may have sent an LF after it.  Throw it away
+    if (m_skip_lf && length > 0)
+    {
+        m_skip_lf = false;
+        if (recv(m_sock, p_buffer, 1, 0) < 1) return 0;
+        if (*p_buffer != 10) total = 1;
+    }
+
+    // Keep receiving until we have all the bytes or the client goes away
+    while (total < length)
+    {
+        int count = recv(m_sock, p_buffer + total, length - total, 0);
+        if (count < 1) break;
+        total += count;
+    }
+
+    // Tell the network that there is activity on this socket
+    Network.register_activity();
+    return total;
+}
+//=========================================================================================================
+
+
 //========================================================================================================= 
 // wait_for_connection() - Closes down any existing socket, creates a new one, and starts listening for 
 //                         a TCP connection on our server port
@@ -378,8 +422,8 @@ void CTCPServerBase::replyf(const char* fmt, ...)
 //========================================================================================================= 
 bool CTCPServerBase::wait_for_connection()
 {
-    int error, True = 1;
-    struct sockaddr_in sock_desc;
+    int error, True = 1, False = 0;
+    struct sockaddr_in6 sock_desc;
 
     // We have no client connected
     m_has_client = false;
@@ -387,21 +431,25 @@ bool CTCPServerBase::wait_for_connection()
     // If we already have a socket created, close it down
     hard_shutdown();
 
-    // We can bind to any available IP address (though there will really only be one)
-    sock_desc.sin_addr.s_addr = htonl(INADDR_ANY);
+    // We can bind to any available IPv4 or IPv6 address
+    memset(&sock_desc, 0, sizeof sock_desc);
+    sock_desc.sin6_addr = in6addr_any;
 
-    // This is an IP socket
-    sock_desc.sin_family = AF_INET;
+    // This is an IPv6 socket
+    sock_desc.sin6_family = AF_INET6;
 
     // Bind the the pre-defined port number
-    sock_desc.sin_port = htons(m_server_port);
+    sock_desc.sin6_port = htons(m_server_port);
 
     // Create our socket
-    m_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    m_sock = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
 
     // This socket is allowed to re-use a previous bound port number
     setsockopt(m_sock, SOL_SOCKET, SO_REUSEADDR, (void*)&True, sizeof(True));
 
+    // And it accepts IPv4 connections as well as IPv6 (dual-stack)
+    setsockopt(m_sock, IPPROTO_IPV6, IPV6_V6ONLY, (void*)&False, sizeof(False));
+
     // Bind the socket to the TCP port we specified
     error = bind(m_sock, (struct sockaddr *)&sock_desc, sizeof(sock_desc));
     
@@ -422,9 +470,9 @@ bool CTCPServerBase::wait_for_connection()
         return false;
     }
 
-    // The IP address of the client will be stored here
+    // The IP address of the client will be stored here.  This is big enough for an IPv4 or IPv6 address
     struct sockaddr_in6 source_addr; 
-    uint32_t addr_len = sizeof(source_addr);
+    socklen_t addr_len = sizeof(source_addr);
 
     // Wait for a client connect and accept it when it arrives
     int new_socket = accept(m_sock, (struct sockaddr *)&source_addr, &addr_len);
@@ -26,6 +26,9 @@ public:
     // Call this to find out if there is a client connected to our server
     bool    has_client() {return m_has_client;}
 
+    // Returns the port that the server listens on
+    int     port() {return m_server_port;}
+
     //--------------------------------------------------------------------------------
     // Public only so that launch_thread() has access to it
     //--------------------------------------------------------------------------------
@@ -61,6 +64,10 @@ protected:
     // Lowest level methods for replying to a command
     void    replyf(const char* fmt, ...);
 
+    // Reads raw bytes that follow a command, skipping the LF of a CR-LF line ending.  Returns the
+    // number of bytes read, which is less than "length" only if the client disconnected
+    int     recv_raw(void* vp_buffer, int length);
+
 
     //--------------------------------------------------------------------------------
     // Functions and data that are private to the base class
@@ -82,6 +89,9 @@ private:
     // When "get_next_token()" is called, this points to the 1st char of the next token
     char*   m_next_token;
 
+    // True if the most recent command line ended with a CR, and recv_raw() hasn't been called since
+    bool    m_skip_lf;
+
 private:  /* TCP and ESP specific stuff */
 
 
@@ -0,0 +1,146 @@
+//=========================================================================================================
+// time_sync.cpp - Implements a service that keeps the system clock synchronized via SNTP
+//=========================================================================================================
+#include <sys/time.h>
+#include "esp_timer.h"
+#include "esp_sntp.h"
+#include "globals.h"
+
+// This protects our statistics, which are updated in the lwIP thread and read everywhere else
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+//=========================================================================================================
+// sntp_sync_time() - SNTP calls this every time it receives the time from a server
+//
+// This replaces the weak default in ESP-IDF, so that we can measure the offset before deciding how to
+// apply it
+//=========================================================================================================
+void sntp_sync_time(struct timeval* tv)
+{
+    TimeSync.on_sync(tv);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// start() - Starts SNTP, or restarts it so that we sync right away
+//=========================================================================================================
+void CTimeSync::start()
+{
+    // If SNTP is already running, stop it so that it will ask the server for the time right away
+    if (sntp_enabled()) sntp_stop();
+
+    // Use the NTP server from non-volatile storage, or the default one if none has been configured
+    const char* server = NVS.data.ntp_server[0] ? NVS.data.ntp_server : TIMESYNC_DEFAULT_SERVER;
+    safe_copy(m_server, (char*)server);
+
+    ESP_LOGI("TimeSync", "Starting SNTP with server %s", m_server);
+    sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    sntp_setservername(0, m_server);
+    sntp_set_sync_interval(TIMESYNC_INTERVAL_MS);
+
+    // This runs in the lwIP thread, and will call sntp_sync_time() when it obtains the time
+    sntp_init();
+    m_is_running = true;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// stop() - Stops SNTP
+//=========================================================================================================
+void CTimeSync::stop()
+{
+    if (sntp_enabled()) sntp_stop();
+    m_is_running = false;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// on_sync() - Adjusts the system clock to match the time reported by the server
+//
+// Passed: p_server_time = The time reported by the NTP server
+//=========================================================================================================
+void CTimeSync::on_sync(const struct timeval* p_server_time)
+{
+    struct timeval now, delta;
+
+    // Find out how far our clock is from the server's
+    gettimeofday(&now, nullptr);
+    S64 server_us = (S64)p_server_time->tv_sec * 1000000 + p_server_time->tv_usec;
+    S64 local_us  = (S64)now.tv_sec * 1000000 + now.tv_usec;
+    S64 offset_us = server_us - local_us;
+    S64 abs_us    = offset_us < 0 ? -offset_us : offset_us;
+
+    // If this is the first sync, or the clock is way off, step the clock to the correct time
+    bool is_step = !m_is_synced || abs_us > (S64)TIMESYNC_STEP_THRESHOLD_MS * 1000;
+    if (is_step)
+    {
+        settimeofday(p_server_time, nullptr);
+        sntp_set_sync_status(SNTP_SYNC_STATUS_COMPLETED);
+    }
+
+    // Otherwise, gradually slew the clock into agreement
+    else
+    {
+        delta.tv_sec  = offset_us / 1000000;
+        delta.tv_usec = offset_us % 1000000;
+        adjtime(&delta, nullptr);
+        sntp_set_sync_status(SNTP_SYNC_STATUS_IN_PROGRESS);
+    }
+
+    // Update our statistics
+    portENTER_CRITICAL(&stats_mux);
+    ++m_stats.sync_count;
+    if (is_step) ++m_stats.step_count; else ++m_stats.slew_count;
+    if (!is_step && abs_us > m_stats.max_offset_us) m_stats.max_offset_us = abs_us;
+    m_stats.last_offset_us = offset_us;
+    m_stats.last_sync_us   = esp_timer_get_time();
+    if (m_stats.first_sync_us == 0) m_stats.first_sync_us = m_stats.last_sync_us;
+    portEXIT_CRITICAL(&stats_mux);
+
+    // The first time we find out what time it is, let the rest of the system know
+    if (!m_is_synced)
+    {
+        m_is_synced = true;
+        System.has_current_time = true;
+        BootSeq.mark("NTP");
+    }
+
+    // If someone wants to know every time we sync, tell them
+    if (m_callback) m_callback(&m_stats);
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// state() - Returns the current state of time synchronization
+//=========================================================================================================
+timesync_state_t CTimeSync::state()
+{
+    struct timeval remaining;
+
+    // If SNTP isn't running, and we've never synced, we're stopped
+    if (!m_is_synced) return m_is_running ? TIMESYNC_WAITING : TIMESYNC_STOPPED;
+
+    // If there is still a slew in progress, say so
+    if (adjtime(nullptr, &remaining) == 0 && (remaining.tv_sec || remaining.tv_usec)) return TIMESYNC_SLEWING;
+
+    // Otherwise, we're in sync with the server
+    return TIMESYNC_SYNCED;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// get_stats() - Fetches a consistent copy of our statistics
+//=========================================================================================================
+void CTimeSync::get_stats(timesync_stats_t* p_stats)
+{
+    portENTER_CRITICAL(&stats_mux);
+    *p_stats = m_stats;
+    portEXIT_CRITICAL(&stats_mux);
+}
+//=========================================================================================================
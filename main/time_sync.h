@@ -0,0 +1,90 @@
+//=========================================================================================================
+// time_sync.h - Defines a service that keeps the system clock synchronized via SNTP
+//
+// SNTP runs in the background in the lwIP thread.  Each time a server reply arrives, we measure the
+// offset between the server and our clock.  Large offsets (i.e., the first sync after boot) step the
+// clock immediately; small ones are slewed out gradually with adjtime() so the clock never jumps.
+// Nobody ever has to wait for a sync to complete.
+//=========================================================================================================
+#pragma once
+#include "common.h"
+
+// This is the NTP server we use if none has been configured
+#define TIMESYNC_DEFAULT_SERVER "pool.ntp.org"
+
+// Offsets larger than this are corrected by stepping the clock instead of slewing it
+#define TIMESYNC_STEP_THRESHOLD_MS 500
+
+// After the first sync, we re-sync with the server this often
+#define TIMESYNC_INTERVAL_MS (15 * 60 * 1000)
+
+// These are the states that time synchronization can be in
+enum timesync_state_t
+{
+    TIMESYNC_STOPPED,   // SNTP hasn't been started
+    TIMESYNC_WAITING,   // SNTP is running, but we haven't heard from a server yet
+    TIMESYNC_SLEWING,   // The clock is being gradually adjusted to match the server
+    TIMESYNC_SYNCED     // The clock matches the server
+};
+
+// Synchronization statistics
+struct timesync_stats_t
+{
+    U32     sync_count;         // The number of server replies we've received
+    U32     step_count;         // The number of times the clock was stepped
+    U32     slew_count;         // The number of times the clock was slewed
+    S64     last_offset_us;     // Server time minus our time at the most recent sync
+    S64     max_offset_us;      // The largest absolute offset we've slewed out
+    S64     last_sync_us;       // The time since boot (in usecs) of the most recent sync
+    S64     first_sync_us;      // The time since boot (in usecs) of the first sync
+};
+
+
+//=========================================================================================================
+// CTimeSync - Singleton class, manages SNTP time synchronization
+//=========================================================================================================
+class CTimeSync
+{
+public:
+
+    // Starts (or restarts) SNTP.  Call this when the network gets an IP address.  Never blocks
+    void    start();
+
+    // Stops SNTP
+    void    stop();
+
+    // Registers a routine to be called after every sync.  It runs in the lwIP thread, so keep it short
+    void    set_callback(void (*callback)(const timesync_stats_t*)) {m_callback = callback;}
+
+    // Returns the current synchronization state
+    timesync_state_t state();
+
+    // Fetches a consistent copy of the synchronization statistics
+    void    get_stats(timesync_stats_t* p_stats);
+
+    // Returns the name of the NTP server we're using
+    const char* server() {return m_server;}
+
+public:
+
+    // This is called by SNTP each time it receives the time from a server.  Don't call it directly
+    void    on_sync(const struct timeval* p_server_time);
+
+protected:
+
+    // Our statistics
+    timesync_stats_t    m_stats;
+
+    // Set to true when the clock has been stepped or the most recent slew has been started
+    bool                m_is_synced;
+
+    // True if SNTP is running
+    bool                m_is_running;
+
+    // The name of the NTP server.  SNTP keeps a pointer to this, so it has to be persistent
+    char                m_server[64];
+
+    // Called after every sync
+    void                (*m_callback)(const timesync_stats_t*);
+};
+//=========================================================================================================
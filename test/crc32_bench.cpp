@@ -0,0 +1,79 @@
+//=========================================================================================================
+// crc32_bench.cpp - Measures the throughput of the CRC engine against the original routine
+//
+// For each buffer size from 16 bytes to 1 MB, prints the throughput in MB/s of the original
+// byte-at-a-time routine and of the slice-by-8 engine
+//=========================================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include "crc32.h"
+
+
+//=========================================================================================================
+// reference_crc32() - The original table-driven routine
+//=========================================================================================================
+static uint32_t reference_crc32(const void* buf, size_t len)
+{
+    static uint32_t table[256];
+    static bool is_built = false;
+
+    if (!is_built)
+    {
+        for (uint32_t n=0; n<256; ++n)
+        {
+            uint32_t c = n;
+            for (int k=0; k<8; ++k) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        is_built = true;
+    }
+
+    const uint8_t* p = (const uint8_t*)buf;
+    uint32_t crc = 0xFFFFFFFF;
+    while (len--) crc = (crc >> 8) ^ table[(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// measure() - Returns the throughput of a CRC routine in MB/s
+//=========================================================================================================
+template <class F> static double measure(F routine, const std::vector<uint8_t>& data, size_t size)
+{
+    // Run about 64 MB through the routine, but at least a few iterations
+    size_t iterations = (64u * 1024 * 1024) / size;
+    if (iterations < 4) iterations = 4;
+
+    volatile uint32_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i=0; i<iterations; ++i) sink = sink + routine((void*)&data[0], size);
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    return (double)size * iterations / seconds / (1024 * 1024);
+}
+//=========================================================================================================
+
+
+int main()
+{
+    std::vector<uint8_t> data(1024 * 1024);
+    for (auto& b : data) b = rand() & 0xFF;
+
+    // Build the engine's tables before we start timing
+    crc32(&data[0], 1);
+
+    printf("%10s %14s %14s %8s\n", "bytes", "original MB/s", "engine MB/s", "speedup");
+    for (size_t size = 16; size <= data.size(); size *= 4)
+    {
+        double original = measure(reference_crc32, data, size);
+        double engine   = measure(crc32, data, size);
+        printf("%10zu %14.1f %14.1f %7.2fx\n", size, original, engine, engine / original);
+    }
+
+    return 0;
+}
+//=========================================================================================================
@@ -0,0 +1,95 @@
+//=========================================================================================================
+// crc32_test.cpp - Proves that the CRC engine produces results identical to the original routine
+//
+// The reference below is the byte-at-a-time, table-driven crc32() that the firmware used before the
+// CRC engine existed.  Every length from 0 to 4K, every starting alignment, a few large buffers, and
+// incremental updates split at arbitrary points must all match it exactly.
+//=========================================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "crc32.h"
+
+static int failures = 0;
+
+
+//=========================================================================================================
+// reference_crc32() - The original table-driven routine, with its table generated from the polynomial
+//=========================================================================================================
+static uint32_t reference_crc32(const void* buf, size_t len)
+{
+    static uint32_t table[256];
+    static bool is_built = false;
+
+    if (!is_built)
+    {
+        for (uint32_t n=0; n<256; ++n)
+        {
+            uint32_t c = n;
+            for (int k=0; k<8; ++k) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        is_built = true;
+    }
+
+    const uint8_t* p = (const uint8_t*)buf;
+    uint32_t crc = 0xFFFFFFFF;
+    while (len--) crc = (crc >> 8) ^ table[(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// check() - Records a failure if two CRCs differ
+//=========================================================================================================
+static void check(const char* what, size_t length, uint32_t expected, uint32_t actual)
+{
+    if (expected == actual) return;
+    printf("FAIL: %s, length %zu: expected %08X, got %08X\n", what, length, expected, actual);
+    ++failures;
+}
+//=========================================================================================================
+
+
+int main()
+{
+    // Fill a buffer with pseudo-random data
+    std::vector<uint8_t> data(1024 * 1024 + 16);
+    srand(12345);
+    for (auto& b : data) b = rand() & 0xFF;
+
+    // The standard check value
+    check("check value", 9, 0xCBF43926, crc32((void*)"123456789", 9));
+
+    // Every length up to 4K, at every alignment of the start of the buffer
+    for (size_t align = 0; align < 8; ++align)
+    {
+        for (size_t length = 0; length <= 4096; ++length)
+        {
+            check("one-shot", length, reference_crc32(&data[align], length), crc32(&data[align], length));
+        }
+    }
+
+    // A few large buffers
+    for (size_t length : {65536, 65537, 1000003, 1024 * 1024})
+    {
+        check("large", length, reference_crc32(&data[0], length), crc32(&data[0], length));
+    }
+
+    // Incremental updates split at many different points must match a one-shot CRC
+    for (size_t split = 0; split <= 300; ++split)
+    {
+        const size_t length = 300;
+        uint32_t state = crc32_init();
+        state = crc32_update(state, &data[0], split);
+        state = crc32_update(state, &data[split], length - split);
+        check("incremental", split, reference_crc32(&data[0], length), crc32_final(state));
+    }
+
+    if (failures) return 1;
+    printf("crc32: all results identical to the reference\n");
+    return 0;
+}
+//=========================================================================================================
@@ -0,0 +1,120 @@
+//=========================================================================================================
+// data_tables_test.cpp - Exercises CDataTables through its host build, which maps the image from a file
+//
+// Builds a table image the way the image tool does, then checks that the tables are found in place,
+// and that images with a bad CRC, an unknown format version, or a bad directory entry are rejected
+//=========================================================================================================
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "data_tables.h"
+#include "crc32.h"
+
+static int failures = 0;
+
+#define CHECK(condition) if (!(condition)) {printf("FAIL: line %i: %s\n", __LINE__, #condition); ++failures;}
+
+
+//=========================================================================================================
+// build_image() - Builds an image containing two tables
+//=========================================================================================================
+static std::vector<U8> build_image()
+{
+    static const char alpha[] = "the first table";
+    static const U32  beta[]  = {1, 2, 3, 4, 5, 6, 7, 8};
+
+    size_t data_start = sizeof(dtbl_header_t) + 2 * sizeof(dtbl_entry_t);
+    std::vector<U8> image(data_start + sizeof alpha + sizeof beta);
+
+    dtbl_header_t* p_header = (dtbl_header_t*)&image[0];
+    dtbl_entry_t*  p_dir    = (dtbl_entry_t*)&image[sizeof(dtbl_header_t)];
+
+    // Fill in the directory and copy in the tables
+    strcpy(p_dir[0].name, "alpha");
+    p_dir[0].offset = data_start;
+    p_dir[0].length = sizeof alpha;
+    memcpy(&image[p_dir[0].offset], alpha, sizeof alpha);
+    p_dir[0].crc    = crc32(&image[p_dir[0].offset], p_dir[0].length);
+
+    strcpy(p_dir[1].name, "beta");
+    p_dir[1].offset = data_start + sizeof alpha;
+    p_dir[1].length = sizeof beta;
+    memcpy(&image[p_dir[1].offset], beta, sizeof beta);
+    p_dir[1].crc    = crc32(&image[p_dir[1].offset], p_dir[1].length);
+
+    // And the header, whose CRC covers everything after it
+    p_header->magic          = 0x4C425444;
+    p_header->format_version = DTBL_FORMAT_VERSION;
+    p_header->count          = 2;
+    p_header->data_version   = 42;
+    p_header->length         = image.size();
+    p_header->crc            = crc32(&image[sizeof(dtbl_header_t)], image.size() - sizeof(dtbl_header_t));
+    return image;
+}
+//=========================================================================================================
+
+
+//=========================================================================================================
+// load() - Writes an image to the host file and initializes a CDataTables from it
+//=========================================================================================================
+static bool load(CDataTables& tables, const std::vector<U8>& image)
+{
+    FILE* file = fopen(DTBL_HOST_FILE, "wb");
+    fwrite(&image[0], 1, image.size(), file);
+    fclose(file);
+    return tables.init();
+}
+//=========================================================================================================
+
+
+int main()
+{
+    size_t length;
+
+    // A good image is accepted, and its tables are found in place
+    {
+        CDataTables tables;
+        CHECK(load(tables, build_image()));
+        CHECK(tables.count() == 2);
+        CHECK(tables.data_version() == 42);
+        const char* alpha = (const char*)tables.find("alpha", &length);
+        CHECK(alpha && length == 16 && strcmp(alpha, "the first table") == 0);
+        const U32* beta = (const U32*)tables.find("beta", &length);
+        CHECK(beta && length == 32 && beta[7] == 8);
+        CHECK(tables.find("gamma", &length) == nullptr && length == 0);
+    }
+
+    // A damaged table is rejected
+    {
+        CDataTables tables;
+        std::vector<U8> image = build_image();
+        image[image.size() - 1] ^= 1;
+        CHECK(!load(tables, image));
+        CHECK(!tables.is_available());
+    }
+
+    // An image in a format we don't understand is rejected
+    {
+        CDataTables tables;
+        std::vector<U8> image = build_image();
+        ((dtbl_header_t*)&image[0])->format_version = DTBL_FORMAT_VERSION + 1;
+        CHECK(!load(tables, image));
+    }
+
+    // A directory entry that points outside the image is rejected, even with a good image CRC
+    {
+        CDataTables tables;
+        std::vector<U8> image = build_image();
+        dtbl_header_t* p_header = (dtbl_header_t*)&image[0];
+        dtbl_entry_t*  p_dir    = (dtbl_entry_t*)&image[sizeof(dtbl_header_t)];
+        p_dir[1].length = 1000;
+        p_header->crc   = crc32(&image[sizeof(dtbl_header_t)], image.size() - sizeof(dtbl_header_t));
+        CHECK(!load(tables, image));
+    }
+
+    remove(DTBL_HOST_FILE);
+    if (failures) return 1;
+    printf("data_tables: all checks passed\n");
+    return 0;
+}
+//=========================================================================================================
@@ -0,0 +1,149 @@
+//=========================================================================================================
+// i2c_bench.cpp - Measures I2C throughput at each speed profile against a simulated slave
+//
+// The bus is simulated bit by bit with the timings that i2c_compute_timing() programs, counting cycles
+// of the peripheral's source clock.  The slave is a register-file device like our sensors and EEPROM:
+// it ACKs its address, takes a register pointer, and returns consecutive registers, optionally
+// stretching SCL after every byte the way slow devices do.  For each profile, prints the bus time of
+// a register read and the resulting payload throughput, and checks that the data read back is right
+//=========================================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include "i2c_timing.h"
+
+
+//=========================================================================================================
+// CSimSlave - A register-file device on the simulated bus
+//=========================================================================================================
+class CSimSlave
+{
+public:
+    CSimSlave(int address, int stretch_cycles) : m_address(address), m_stretch(stretch_cycles)
+    {
+        for (int i=0; i<256; ++i) m_reg[i] = (uint8_t)(i * 7 + 3);
+        m_pointer = 0;
+        m_is_addressed = m_is_reading = m_has_pointer = false;
+    }
+
+    // Called on every START.  The next byte written is an address byte
+    void    start() {m_is_addressed = m_has_pointer = false; m_expect_address = true;}
+
+    // Called with every byte the master writes.  Returns 'true' if the slave ACKs it
+    bool    write(uint8_t byte)
+    {
+        if (m_expect_address)
+        {
+            m_expect_address = false;
+            m_is_addressed   = (byte >> 1) == m_address;
+            m_is_reading     = byte & 1;
+            return m_is_addressed;
+        }
+        if (!m_is_addressed || m_is_reading) return false;
+        if (!m_has_pointer) m_pointer = byte, m_has_pointer = true;
+        else m_reg[m_pointer++] = byte;
+        return true;
+    }
+
+    // Called for every byte the master reads
+    uint8_t read() {return m_is_addressed && m_is_reading ? m_reg[m_pointer++] : 0xFF;}
+
+    // The number of source-clock cycles the slave holds SCL low after each byte
+    int     stretch() {return m_stretch;}
+
+    // The contents of a register
+    uint8_t reg(int index) {return m_reg[index & 0xFF];}
+
+protected:
+    int     m_address;
+    int     m_stretch;
+    uint8_t m_reg[256];
+    uint8_t m_pointer;
+    bool    m_expect_address, m_is_addressed, m_is_reading, m_has_pointer;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// CSimBus - A master on the simulated bus.  Accumulates elapsed time in source-clock cycles
+//=========================================================================================================
+class CSimBus
+{
+public:
+    CSimBus(uint32_t hz, CSimSlave* p_slave) : m_slave(p_slave), m_cycles(0) {i2c_compute_timing(hz, &m_t);}
+
+    void    start()   {m_cycles += m_t.start_setup + m_t.start_hold; m_slave->start();}
+    void    stop()    {m_cycles += m_t.scl_low + m_t.stop_setup + m_t.stop_hold;}
+
+    // 8 data bits and an ACK bit, each a full SCL cycle, then any clock stretching
+    bool    write(uint8_t byte)
+    {
+        m_cycles += 9 * (m_t.scl_high + m_t.scl_low) + m_slave->stretch();
+        return m_slave->write(byte);
+    }
+
+    uint8_t read()
+    {
+        m_cycles += 9 * (m_t.scl_high + m_t.scl_low) + m_slave->stretch();
+        return m_slave->read();
+    }
+
+    uint64_t cycles() {return m_cycles;}
+
+protected:
+    CSimSlave*      m_slave;
+    i2c_timing_t    m_t;
+    uint64_t        m_cycles;
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// register_read() - Performs the transaction that CI2CBatch::read_reg() builds: START, address+W,
+//                   register, repeated START, address+R, the data, STOP
+//
+// Returns: 'false' if the slave didn't ACK or the data is wrong
+//=========================================================================================================
+static bool register_read(CSimBus& bus, CSimSlave& slave, int address, uint8_t reg, int length)
+{
+    bool status = true;
+
+    bus.start();
+    status &= bus.write(address << 1 | 0);
+    status &= bus.write(reg);
+    bus.start();
+    status &= bus.write(address << 1 | 1);
+    for (int i=0; i<length; ++i) status &= (bus.read() == slave.reg(reg + i));
+    bus.stop();
+    return status;
+}
+//=========================================================================================================
+
+
+int main()
+{
+    const int address = 0x50;
+    const uint32_t profile[]  = {100000, 400000, 1000000};
+    const int      length[]   = {2, 6, 32};
+    const int      stretch[]  = {0, 80};
+    int failures = 0;
+
+    printf("%9s %8s %7s %10s %10s\n", "clock", "stretch", "bytes", "bus us", "KB/s");
+    for (int s : stretch)
+    {
+        for (uint32_t hz : profile)
+        {
+            for (int len : length)
+            {
+                CSimSlave slave(address, s);
+                CSimBus   bus(hz, &slave);
+                if (!register_read(bus, slave, address, 0x10, len)) ++failures;
+
+                double us = bus.cycles() * 1e6 / I2C_SOURCE_HZ;
+                printf("%5u kHz %5.2f us %7i %10.1f %10.1f\n", hz / 1000, s * 1e6 / I2C_SOURCE_HZ, len, us, len / us * 1e6 / 1024);
+            }
+        }
+    }
+
+    if (failures) printf("%i transactions failed\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+//=========================================================================================================
+// i2c_timing_test.cpp - Proves that i2c_compute_timing() programs the same timings as the driver
+//
+// The expected values below are the register values that ESP-IDF 4.3's i2c_param_config() writes on
+// the ESP32 (via i2c_ll_cal_bus_clk() and i2c_ll_set_bus_timing()) for the standard clocks.  Every
+// clock we allow must fit in the timing registers, and a clock too slow to fit must be refused.
+//=========================================================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include "i2c_timing.h"
+
+static int failures = 0;
+
+
+//=========================================================================================================
+// The registers the driver programs for one clock, in cycles of the 80 MHz source clock
+//=========================================================================================================
+struct expected_t
+{
+    uint32_t    hz;
+    int         scl_high, scl_low;
+    int         start_setup, start_hold;
+    int         stop_setup, stop_hold;
+    int         data_sample, data_hold;
+    int         timeout;
+};
+
+static const expected_t expected[] =
+{
+    //   hz      high  low  rsetup  hold  psetup  phold  sample  dhold  timeout
+    { 100000,    400,  400,   400,   400,   400,   400,    200,   200,   8000},
+    { 400000,    100,  100,   100,   100,   100,   100,     50,    50,   2000},
+    {1000000,     40,   40,    40,    40,    40,    40,     20,    20,    800},
+};
+//=========================================================================================================
+
+
+//=========================================================================================================
+// check() - Records a failure if a condition is false
+//=========================================================================================================
+static void check(bool condition, const char* what, uint32_t hz)
+{
+    if (condition) return;
+    printf("FAIL: %s at %u Hz\n", what, hz);
+    ++failures;
+}
+//=========================================================================================================
+
+
+int main()
+{
+    // The standard clocks must produce exactly the driver's register values
+    for (const expected_t& e : expected)
+    {
+        i2c_timing_t t;
+        check(i2c_compute_timing(e.hz, &t), "accepted", e.hz);
+        check(t.scl_high    == e.scl_high,    "scl_high",    e.hz);
+        check(t.scl_low     == e.scl_low,     "scl_low",     e.hz);
+        check(t.start_setup == e.start_setup, "start_setup", e.hz);
+        check(t.start_hold  == e.start_hold,  "start_hold",  e.hz);
+        check(t.stop_setup  == e.stop_setup,  "stop_setup",  e.hz);
+        check(t.stop_hold   == e.stop_hold,   "stop_hold",   e.hz);
+        check(t.data_sample == e.data_sample, "data_sample", e.hz);
+        check(t.data_hold   == e.data_hold,   "data_hold",   e.hz);
+        check(t.timeout     == e.timeout,     "timeout",     e.hz);
+    }
+
+    // Every clock from the slowest to the fastest we allow must fit in the registers
+    for (uint32_t hz = I2C_MIN_HZ; hz <= 1000000; hz += 1000)
+    {
+        i2c_timing_t t;
+        check(i2c_compute_timing(hz, &t), "accepted", hz);
+        check(t.scl_low     <= I2C_MAX_PERIOD,  "scl_low fits",     hz);
+        check(t.start_setup <= I2C_MAX_TIMING,  "start_setup fits", hz);
+        check(t.timeout     <= I2C_MAX_TIMEOUT, "timeout fits",     hz);
+
+        // SDA has to change and be sampled while SCL is in the right half of the cycle
+        check(t.data_hold   < t.scl_low,  "data_hold inside SCL low",    hz);
+        check(t.data_sample < t.scl_high, "data_sample inside SCL high", hz);
+    }
+
+    // A clock too slow for the registers must be refused rather than silently truncated.  1 kHz is
+    // what "i2c speed <addr> 1" asked for before profiles were clamped
+    const uint32_t too_slow[] = {0, 1, 1000, 10000, I2C_MIN_HZ - 1000};
+    for (uint32_t hz : too_slow)
+    {
+        i2c_timing_t t;
+        check(!i2c_compute_timing(hz, &t), "refused", hz);
+    }
+
+    if (failures) printf("%i failures\n", failures);
+    else printf("All I2C timing tests passed\n");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}